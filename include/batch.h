@@ -0,0 +1,17 @@
+#ifndef PARTMAN_BATCH_H
+#define PARTMAN_BATCH_H
+
+#include "partman_types.h"
+
+/* Batch job function, called once for each job index */
+typedef pres (*batch_func) (
+    void                    *arg,
+    pu32                    index
+);
+
+/* Runs jobs [0, job_cnt) on a pool of up to thread_cnt worker threads and
+ * waits for all of them. Result of each job is stored in res array */
+void batch_run(batch_func func, void *arg, pres *res, pu32 job_cnt,
+               pu32 thread_cnt);
+
+#endif
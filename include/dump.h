@@ -0,0 +1,26 @@
+#ifndef PARTMAN_DUMP_H
+#define PARTMAN_DUMP_H
+
+#include "partman_types.h"
+#include "img_ctx.h"
+#include "schem.h"
+
+/* Machine-readable scheme dump format */
+enum dump_fmt {
+    dump_fmt_none,
+
+    /* Single JSON object */
+    dump_fmt_json,
+
+    /* Disk line, column names line, then one line per partition */
+    dump_fmt_columns
+};
+
+/* Parses dump format name */
+pres dump_fmt_parse(const char *str, enum dump_fmt *fmt);
+
+/* Writes scheme (NULL, if there is none) to stdout with a single write */
+pres dump_scheme(const struct schem *schem, const struct img_ctx *img_ctx,
+                 enum dump_fmt fmt);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef PARTMAN_LAYOUT_H
+#define PARTMAN_LAYOUT_H
+
+#include "partman_types.h"
+#include "guid.h"
+#include "img_ctx.h"
+#include "schem.h"
+
+/* Layout position or size value */
+struct layout_val {
+    /* Value, in sectors or in bytes */
+    pu64 val;
+
+    /* Set, if value is in bytes (converted to sectors, when applied) */
+    pflag bytes;
+};
+
+/* Layout partition */
+struct layout_part {
+    /* Set for each field, which is specified in the layout */
+    pflag has_start;
+    pflag has_size;
+    pflag has_type;
+    pflag has_uuid;
+    pflag has_name;
+
+    /* Partition start, default is the first free sector */
+    struct layout_val start;
+
+    /* Partition size, default is all available space after start */
+    struct layout_val size;
+
+    /* Partition type: integer (MBR) or GUID (GPT) */
+    union {
+        pu8 i;
+        struct guid guid;
+    } type;
+
+    /* GPT: Partition GUID */
+    struct guid uuid;
+
+    /* GPT: Name of the partition, using UCS-2 */
+    pchar_ucs name[36];
+
+    /* MBR: Set, if partition is bootable */
+    pflag bootable;
+};
+
+/* Declarative partitioning scheme layout */
+struct layout {
+    /* Scheme type */
+    enum schem_type type;
+
+    /* Set, if disk identifier is specified in the layout */
+    pflag has_id;
+
+    /* Disk identifier: integer (MBR) or GUID (GPT) */
+    union {
+        pu32 i;
+        struct guid guid;
+    } id;
+
+    /* Number of partitions */
+    pu32 part_cnt;
+
+    /* Partitions, in the order of partition table entries */
+    struct layout_part *parts;
+};
+
+/* Parses layout file. Layout must be freed with layout_free() */
+pres layout_load(struct layout *layout, const char *path);
+
+void layout_free(struct layout *layout);
+
+/* Fills identifier flags, which keep the disk identifier and partition
+ * GUIDs, set by the layout, when a rendered scheme gets new identifiers.
+ * Flags must be freed with layout_regen_free() */
+pres layout_regen(const struct layout *layout, struct schem_regen *regen);
+
+void layout_regen_free(struct schem_regen *regen);
+
+/* Creates a new scheme in scheme context from the layout. Scheme is only
+ * built in memory and must be saved with schem_ctx_save() */
+pres layout_apply(const struct layout *layout, struct schem_ctx *schem_ctx,
+                  const struct img_ctx *img_ctx);
+
+#endif
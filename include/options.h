@@ -3,6 +3,7 @@
 
 #include "partman_types.h"
 #include "log.h"
+#include "dump.h"
 
 struct partman_opts {
     enum log_level log_level;
@@ -12,6 +13,19 @@ struct partman_opts {
     plba align;
     pu8 hpc;
     pu8 spt;
+    pu32 threads;
+    pu32 gpt_part_cnt;
+    pflag uring;
+    pflag read_only;
+    const char *script;
+    pflag batch;
+    pu32 jobs;
+    pflag stamp;
+    enum dump_fmt dump;
+    pflag stats;
+    const char *trace;
+    char * const *img_names;
+    pu32 img_cnt;
 };
 
 pres opts_parse(struct partman_opts *opts, int argc, char * const *argv);
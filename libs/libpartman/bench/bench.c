@@ -0,0 +1,224 @@
+/* For clock_gettime() */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "partman_types.h"
+#include "crc32.h"
+#include "memutils.h"
+#include "bench.h"
+
+enum {
+    /* Small benchmark buffer size, in bytes - full 128-entry GPT table */
+    bench_small_sz = 128 * 128,
+
+    /* Large benchmark buffer size, in bytes */
+    bench_large_sz = 4 * 1024 * 1024,
+
+    /* GPT partition entry size, in bytes */
+    bench_ent_sz = 128,
+
+    /* Maximum GPT partition entry count to benchmark */
+    bench_max_ent_cnt = 262144,
+
+    /* Amount of data to process per benchmark, in bytes */
+    bench_total_sz = 64 * 1024 * 1024
+};
+
+/* Number of results, which are already written */
+static pu32 bench_result_cnt;
+
+double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double bench_elapsed(double start)
+{
+    return bench_now() - start;
+}
+
+void bench_result(const char *name, const char *params, double value,
+                  const char *unit)
+{
+    printf("%s\n    {\"name\": \"%s\", \"params\": \"%s\", "
+           "\"value\": %.3f, \"unit\": \"%s\"}",
+           bench_result_cnt ? "," : "", name, params, value, unit);
+
+    bench_result_cnt++;
+}
+
+static void bench_report(const char *name, size_t len, double secs)
+{
+    char params[32];
+    double mib;
+
+    mib = (double) bench_total_sz / (1024.0 * 1024.0);
+
+    sprintf(params, "len=%lu", (unsigned long) len);
+    bench_result(name, params, secs > 0 ? mib / secs : 0, "MiB/s");
+}
+
+static double bench_crc32_byte(const pu8 *buf, size_t len, pcrc32 *crc32)
+{
+    double start;
+    size_t i, n;
+
+    start = bench_now();
+
+    for(n = 0; n < bench_total_sz / len; n++) {
+        *crc32 = crc32_init();
+        for(i = 0; i < len; i++) {
+            crc32_compute8(crc32, buf[i]);
+        }
+        crc32_finalize(crc32);
+    }
+
+    return bench_elapsed(start);
+}
+
+static double bench_crc32_buf(const pu8 *buf, size_t len, pcrc32 *crc32)
+{
+    double start;
+    size_t n;
+
+    start = bench_now();
+
+    for(n = 0; n < bench_total_sz / len; n++) {
+        *crc32 = crc32_init();
+        crc32_compute_buf(crc32, buf, len);
+        crc32_finalize(crc32);
+    }
+
+    return bench_elapsed(start);
+}
+
+static double bench_crc32_word(const pu8 *buf, size_t len, pcrc32 *crc32)
+{
+    double start;
+    size_t i, n;
+
+    start = bench_now();
+
+    for(n = 0; n < bench_total_sz / len; n++) {
+        *crc32 = crc32_init();
+        for(i = 0; i + 8 <= len; i += 8) {
+            crc32_compute64(crc32, read_pu64(buf + i));
+        }
+        crc32_finalize(crc32);
+    }
+
+    return bench_elapsed(start);
+}
+
+static pflag bench_crc32(const pu8 *buf, size_t len)
+{
+    pcrc32 crc_byte, crc_word, crc_buf;
+    double t_byte, t_word, t_buf;
+
+    t_byte = bench_crc32_byte(buf, len, &crc_byte);
+    bench_report("crc32_compute8", len, t_byte);
+
+    t_word = bench_crc32_word(buf, len, &crc_word);
+    bench_report("crc32_compute64", len, t_word);
+
+    t_buf = bench_crc32_buf(buf, len, &crc_buf);
+    bench_report("crc32_compute_buf", len, t_buf);
+
+    if(crc_byte != crc_buf || crc_word != crc_buf) {
+        fprintf(stderr, "CRC32 mismatch\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static pflag bench_crc32_par(const pu8 *buf, pu32 ent_cnt)
+{
+    static const pu32 thread_cnts[] = { 1, 2, 4, 8 };
+
+    char params[32];
+    size_t len, n, iter_cnt;
+    pcrc32 crc32, crc_ref;
+    double start, secs;
+    int i;
+
+    len = (size_t) ent_cnt * bench_ent_sz;
+    iter_cnt = bench_total_sz / len ? bench_total_sz / len : 1;
+
+    crc_ref = crc32_init();
+    crc32_compute_buf(&crc_ref, buf, len);
+    crc32_finalize(&crc_ref);
+
+    for(i = 0; i < ARRAY_SIZE(thread_cnts); i++) {
+        start = bench_now();
+
+        for(n = 0; n < iter_cnt; n++) {
+            crc32 = crc32_init();
+            crc32_compute_buf_par(&crc32, buf, len, thread_cnts[i]);
+            crc32_finalize(&crc32);
+        }
+
+        secs = bench_elapsed(start) / iter_cnt;
+
+        sprintf(params, "entries=%lu,threads=%lu", ent_cnt, thread_cnts[i]);
+        bench_result("crc32_compute_buf_par", params,
+                     secs > 0 ? len / secs / (1024.0 * 1024.0) : 0, "MiB/s");
+
+        if(crc32 != crc_ref) {
+            fprintf(stderr, "CRC32 mismatch\n");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(void)
+{
+    pu8 *buf;
+    size_t i;
+    pflag ok;
+
+    buf = malloc((size_t) bench_max_ent_cnt * bench_ent_sz);
+    if(buf == NULL) {
+        perror("malloc()");
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < (size_t) bench_max_ent_cnt * bench_ent_sz; i++) {
+        buf[i] = rand() & 0xFF;
+    }
+
+    printf("{\"benchmarks\": [");
+
+    ok = bench_crc32(buf, bench_small_sz) &&
+         bench_crc32(buf, bench_large_sz);
+
+    /* CRC32 of GPT partition entry arrays, per table */
+    ok = ok &&
+         bench_crc32_par(buf, 128) &&
+         bench_crc32_par(buf, 4096) &&
+         bench_crc32_par(buf, 65536) &&
+         bench_crc32_par(buf, bench_max_ent_cnt);
+
+    free(buf);
+
+    ok = ok &&
+         bench_gpt_serialize() &&
+         bench_guid_create() &&
+         bench_find_start_sector() &&
+         bench_bulk_create() &&
+         bench_hist() &&
+         bench_schem_cycle();
+
+    printf("\n]}\n");
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,30 @@
+#ifndef LIBPARTMAN_BENCH_H
+#define LIBPARTMAN_BENCH_H
+
+#include "partman_types.h"
+
+/* Returns monotonic wall clock time, in seconds */
+double bench_now(void);
+
+double bench_elapsed(double start);
+
+/* Adds a result to the JSON report. Params describe benchmark input, e.g.
+ * "sec_sz=512" */
+void bench_result(const char *name, const char *params, double value,
+                  const char *unit);
+
+/* Scheme benchmarks */
+pflag bench_gpt_serialize(void);
+
+pflag bench_guid_create(void);
+
+pflag bench_find_start_sector(void);
+
+pflag bench_bulk_create(void);
+
+pflag bench_hist(void);
+
+pflag bench_schem_cycle(void);
+
+#endif
+
@@ -0,0 +1,483 @@
+/* For mkstemp(), ftruncate() */
+#define _XOPEN_SOURCE 500
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "partman_types.h"
+#include "guid.h"
+#include "img_ctx.h"
+#include "schem.h"
+#include "schem_hist.h"
+#include "bench.h"
+
+enum {
+    /* Number of entries in benchmarked GPT tables */
+    bench_gpt_ent_cnt = 16384,
+
+    /* Memory image size, in bytes */
+    bench_mem_img_sz = 64 * 1024 * 1024,
+
+    /* Image file size, in bytes */
+    bench_file_img_sz = 256 * 1024 * 1024,
+
+    /* Number of used partitions in load/save cycle images */
+    bench_cycle_part_cnt = 64,
+
+    /* Number of GUIDs, created per benchmark */
+    bench_guid_cnt = 1000000,
+
+    /* Size of partitions, created by the bulk creation benchmark */
+    bench_bulk_part_sz = 2048,
+
+    /* Number of edits, recorded by the undo history benchmark */
+    bench_hist_edit_cnt = 10000
+};
+
+/* Minimum time, spent in a benchmark, in seconds */
+static const double bench_min_secs = 0.25;
+
+static void bench_img_setup(struct img_ctx *ctx, pu64 sec_sz, pu32 part_cnt)
+{
+    ctx->sec_sz = sec_sz;
+    ctx->align = 1024 * 1024 / sec_sz;
+    ctx->gpt_part_cnt = part_cnt;
+}
+
+/* Creates GPT with used_cnt adjacent partitions of part_sz sectors, from
+ * the first usable sector */
+static struct schem *bench_gpt_create(struct schem_ctx *schem_ctx,
+                                      const struct img_ctx *img_ctx,
+                                      pu32 used_cnt, plba part_sz,
+                                      pflag reverse)
+{
+    struct schem *schem;
+    struct schem_part *part;
+    pu32 i;
+    pu32 k;
+
+    schem_ctx_init(schem_ctx);
+
+    if(!schem_ctx_new(schem_ctx, img_ctx, schem_type_gpt)) {
+        fprintf(stderr, "Failed to create GPT\n");
+        return NULL;
+    }
+
+    schem = schem_ctx->schemes[schem_type_gpt];
+
+    for(i = 0; i < used_cnt && i < schem->part_cnt; i++) {
+        /* Reverse order is the worst case for linear searches */
+        k = reverse ? used_cnt - i - 1 : i;
+
+        part = &schem->table[i];
+        schem->funcs.part_init(part);
+        part->start_lba = schem->first_usable_lba + k * part_sz;
+        part->end_lba = part->start_lba + part_sz - 1;
+        part->name[0] = 'p';
+    }
+
+    schem_table_changed(schem);
+
+    return schem;
+}
+
+static pflag bench_gpt_serialize_sz(pu64 sec_sz)
+{
+    struct img_ctx ctx;
+    struct schem_ctx schem_ctx;
+    struct schem_ctx load_ctx;
+    struct schem *schem;
+    char params[48];
+    double start, secs;
+    pu32 n;
+    pu8 *buf;
+    pres res;
+
+    buf = calloc(1, bench_mem_img_sz);
+    if(buf == NULL) {
+        perror("calloc()");
+        return 0;
+    }
+
+    img_ctx_init_mem(&ctx, "bench", buf, bench_mem_img_sz);
+    bench_img_setup(&ctx, sec_sz, bench_gpt_ent_cnt);
+
+    /* Every entry is used, a partition per sector */
+    schem = bench_gpt_create(&schem_ctx, &ctx, bench_gpt_ent_cnt, 1, 0);
+    if(schem == NULL) {
+        img_ctx_free(&ctx);
+        free(buf);
+        return 0;
+    }
+
+    /* Save serializes every entry and both headers. One entry is changed
+     * each time, so the table CRC is updated too */
+    res = pres_ok;
+    start = bench_now();
+    for(n = 0; res && (n == 0 || bench_elapsed(start) < bench_min_secs); n++) {
+        schem->table[0].attr = n;
+        res = schem->funcs.save(schem, &ctx);
+    }
+    secs = bench_elapsed(start) / n;
+
+    res = res && img_ctx_sync(&ctx);
+
+    schem_ctx_reset(&schem_ctx, 0);
+    img_ctx_free(&ctx);
+
+    if(!res) {
+        fprintf(stderr, "Failed to save GPT\n");
+        free(buf);
+        return 0;
+    }
+
+    sprintf(params, "sec_sz=%llu,entries=%d", sec_sz, bench_gpt_ent_cnt);
+    bench_result("gpt_serialize", params, secs * 1e9 / bench_gpt_ent_cnt,
+                 "ns/entry");
+
+    /* Load parses both headers and every entry of both copies. Image
+     * context is new each time, so sectors are not cached */
+    start = bench_now();
+    for(n = 0; res && (n == 0 || bench_elapsed(start) < bench_min_secs); n++) {
+        img_ctx_init_mem(&ctx, "bench", buf, bench_mem_img_sz);
+        bench_img_setup(&ctx, sec_sz, bench_gpt_ent_cnt);
+
+        schem_ctx_init(&load_ctx);
+        res = schem_ctx_load(&load_ctx, &ctx) &&
+              load_ctx.schemes[schem_type_gpt] != NULL;
+
+        schem_ctx_reset(&load_ctx, 0);
+        img_ctx_free(&ctx);
+    }
+    secs = bench_elapsed(start) / n;
+
+    free(buf);
+
+    if(!res) {
+        fprintf(stderr, "Failed to load GPT\n");
+        return 0;
+    }
+
+    bench_result("gpt_parse", params, secs * 1e9 / bench_gpt_ent_cnt,
+                 "ns/entry");
+
+    return 1;
+}
+
+pflag bench_gpt_serialize(void)
+{
+    return bench_gpt_serialize_sz(512) && bench_gpt_serialize_sz(4096);
+}
+
+pflag bench_guid_create(void)
+{
+    struct guid guid;
+    double start, secs;
+    pu32 i;
+
+    start = bench_now();
+    for(i = 0; i < bench_guid_cnt; i++) {
+        guid_create(&guid);
+    }
+    secs = bench_elapsed(start);
+
+    bench_result("guid_create", "", secs * 1e9 / bench_guid_cnt, "ns/op");
+
+    return 1;
+}
+
+static pflag bench_find_start_sector_cnt(pu32 part_cnt)
+{
+    struct img_ctx ctx;
+    struct schem_ctx schem_ctx;
+    struct schem *schem;
+    char params[32];
+    double start, secs;
+    plba_res lba;
+    pu32 n;
+
+    /* Image is never read or written, only its geometry is used */
+    img_ctx_init(&ctx, "bench", -1, (pu64) 1024 * 1024 * 1024 * 1024);
+    bench_img_setup(&ctx, 512, part_cnt);
+
+    /* Partitions are adjacent, but not aligned, and are listed in reverse
+     * order, so the search steps over each of them and rescans the table
+     * after every step */
+    schem = bench_gpt_create(&schem_ctx, &ctx, part_cnt, ctx.align + 1, 1);
+    if(schem == NULL) {
+        img_ctx_free(&ctx);
+        return 0;
+    }
+
+    lba = 0;
+    start = bench_now();
+    for(n = 0; n == 0 || bench_elapsed(start) < bench_min_secs; n++) {
+        lba = schem_find_start_sector(schem, &ctx, -1);
+    }
+    secs = bench_elapsed(start) / n;
+
+    schem_ctx_reset(&schem_ctx, 0);
+    img_ctx_free(&ctx);
+
+    if(lba < 0) {
+        fprintf(stderr, "Failed to find start sector\n");
+        return 0;
+    }
+
+    sprintf(params, "partitions=%lu", part_cnt);
+    bench_result("schem_find_start_sector", params, secs * 1e6, "us/op");
+
+    return 1;
+}
+
+pflag bench_find_start_sector(void)
+{
+    return bench_find_start_sector_cnt(128) &&
+           bench_find_start_sector_cnt(1024) &&
+           bench_find_start_sector_cnt(4096);
+}
+
+/* Creates partitions one by one, searching free space for each */
+static pflag bench_create_each(struct schem *schem,
+                               const struct img_ctx *img_ctx, pu32 part_cnt)
+{
+    struct schem_part *part;
+    plba start_lba, end_lba;
+    pu32 i;
+
+    for(i = 0; i < part_cnt; i++) {
+        if(!schem_alloc_part(schem, img_ctx, schem_alloc_first_fit,
+                             bench_bulk_part_sz, i, &start_lba, &end_lba)) {
+            return 0;
+        }
+
+        part = &schem->table[i];
+        schem->funcs.part_init(part);
+        part->start_lba = start_lba;
+        part->end_lba = end_lba;
+        schem_part_changed(schem, i);
+    }
+
+    return 1;
+}
+
+static pflag bench_bulk_create_cnt(pu32 part_cnt)
+{
+    struct img_ctx ctx;
+    struct schem_ctx schem_ctx;
+    struct schem *schem;
+    struct schem_part_req *reqs;
+    char params[32];
+    double start, t_each, t_bulk;
+    pu32 n;
+    pflag res;
+
+    reqs = calloc(part_cnt, sizeof(*reqs));
+    if(reqs == NULL) {
+        perror("calloc()");
+        return 0;
+    }
+
+    for(n = 0; n < part_cnt; n++) {
+        reqs[n].secs = bench_bulk_part_sz;
+    }
+
+    /* Image is never read or written, only its geometry is used */
+    img_ctx_init(&ctx, "bench", -1, (pu64) 1024 * 1024 * 1024 * 1024);
+    bench_img_setup(&ctx, 512, part_cnt);
+
+    schem = bench_gpt_create(&schem_ctx, &ctx, 0, 0, 0);
+    res = schem != NULL;
+
+    /* Table is cleared after each run, which is not timed */
+    t_each = 0;
+    t_bulk = 0;
+    for(n = 0; res && (n == 0 || t_each + t_bulk < bench_min_secs); n++) {
+        start = bench_now();
+        res = bench_create_each(schem, &ctx, part_cnt);
+        t_each += bench_elapsed(start);
+
+        memset(schem->table, 0, part_cnt * sizeof(*schem->table));
+        schem_table_changed(schem);
+
+        start = bench_now();
+        res = res && schem_add_parts(schem, &ctx, reqs, part_cnt);
+        t_bulk += bench_elapsed(start);
+
+        memset(schem->table, 0, part_cnt * sizeof(*schem->table));
+        schem_table_changed(schem);
+    }
+
+    if(schem != NULL) {
+        schem_ctx_reset(&schem_ctx, 0);
+    }
+    img_ctx_free(&ctx);
+    free(reqs);
+
+    if(!res) {
+        fprintf(stderr, "Failed to create partitions\n");
+        return 0;
+    }
+
+    sprintf(params, "partitions=%lu", part_cnt);
+    bench_result("schem_create_each", params, t_each * 1e3 / n, "ms/op");
+    bench_result("schem_add_parts", params, t_bulk * 1e3 / n, "ms/op");
+
+    return 1;
+}
+
+pflag bench_bulk_create(void)
+{
+    return bench_bulk_create_cnt(128) && bench_bulk_create_cnt(1024);
+}
+
+pflag bench_hist(void)
+{
+    struct img_ctx ctx;
+    struct schem_ctx schem_ctx;
+    struct schem *schem;
+    struct schem_hist hist;
+    char params[32];
+    double start, t_step, t_undo;
+    pu32 i;
+    pres res;
+
+    img_ctx_init(&ctx, "bench", -1, (pu64) 1024 * 1024 * 1024 * 1024);
+    bench_img_setup(&ctx, 512, bench_gpt_ent_cnt);
+
+    schem = bench_gpt_create(&schem_ctx, &ctx, bench_gpt_ent_cnt, 1, 0);
+    if(schem == NULL) {
+        img_ctx_free(&ctx);
+        return 0;
+    }
+
+    schem_hist_init(&hist, &schem_ctx);
+
+    /* Each step changes a single partition, like an interactive command */
+    res = pres_ok;
+    start = bench_now();
+    for(i = 0; res && i < bench_hist_edit_cnt; i++) {
+        schem_hist_snap(&hist);
+        res = schem_hist_touch(&hist, schem_type_gpt,
+                               (i * 97) % bench_gpt_ent_cnt);
+        schem->table[(i * 97) % bench_gpt_ent_cnt].attr = i;
+    }
+    t_step = bench_elapsed(start);
+
+    start = bench_now();
+    for(i = 0; res && i < schem_hist_max_steps; i++) {
+        res = schem_hist_undo(&hist);
+    }
+    t_undo = bench_elapsed(start);
+
+    schem_hist_free(&hist);
+    schem_ctx_reset(&schem_ctx, 0);
+    img_ctx_free(&ctx);
+
+    if(!res) {
+        fprintf(stderr, "Undo history failed\n");
+        return 0;
+    }
+
+    sprintf(params, "entries=%d", bench_gpt_ent_cnt);
+    bench_result("schem_hist_step", params,
+                 t_step * 1e9 / bench_hist_edit_cnt, "ns/op");
+    bench_result("schem_hist_undo", params,
+                 t_undo * 1e9 / schem_hist_max_steps, "ns/op");
+
+    return 1;
+}
+
+/* Returns directory for image files, tmpfs is preferred */
+static const char *bench_img_dir(void)
+{
+    const char *dir;
+
+    dir = getenv("BENCH_DIR");
+    if(dir) {
+        return dir;
+    }
+
+    return access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+}
+
+static pflag bench_schem_cycle_sz(pu64 sec_sz)
+{
+    struct img_ctx ctx;
+    struct schem_ctx schem_ctx;
+    struct schem *schem;
+    char path[4096];
+    char params[48];
+    double start, t_load, t_save;
+    pu32 n;
+    int fd;
+    pres res;
+
+    sprintf(path, "%.4000s/partman-bench-XXXXXX", bench_img_dir());
+
+    fd = mkstemp(path);
+    if(fd == -1) {
+        perror("mkstemp()");
+        return 0;
+    }
+
+    res = ftruncate(fd, bench_file_img_sz) == 0;
+
+    /* Initial image with GPT and Protective MBR */
+    img_ctx_init(&ctx, path, fd, bench_file_img_sz);
+    bench_img_setup(&ctx, sec_sz, 128);
+
+    schem = bench_gpt_create(&schem_ctx, &ctx, bench_cycle_part_cnt,
+                             ctx.align, 0);
+    res = res && schem && schem_ctx_save(&schem_ctx, &ctx);
+    schem_ctx_reset(&schem_ctx, 0);
+    img_ctx_free(&ctx);
+
+    /* Each cycle opens the image, loads schemes, changes a partition name
+     * and saves them */
+    t_load = 0;
+    t_save = 0;
+    for(n = 0; res && (n == 0 || t_load + t_save < bench_min_secs); n++) {
+        img_ctx_init(&ctx, path, fd, bench_file_img_sz);
+        bench_img_setup(&ctx, sec_sz, 128);
+        schem_ctx_init(&schem_ctx);
+
+        start = bench_now();
+        res = schem_ctx_load(&schem_ctx, &ctx) &&
+              schem_ctx.schemes[schem_type_gpt] != NULL;
+        t_load += bench_elapsed(start);
+
+        if(res) {
+            schem_ctx.schemes[schem_type_gpt]->table[0].name[1] = 'a' + n % 26;
+
+            start = bench_now();
+            res = schem_ctx_save(&schem_ctx, &ctx);
+            t_save += bench_elapsed(start);
+        }
+
+        schem_ctx_reset(&schem_ctx, 0);
+        img_ctx_free(&ctx);
+    }
+
+    close(fd);
+    unlink(path);
+
+    if(!res) {
+        fprintf(stderr, "Load/save cycle failed\n");
+        return 0;
+    }
+
+    sprintf(params, "sec_sz=%llu", sec_sz);
+    bench_result("schem_ctx_load", params, t_load * 1e6 / n, "us/op");
+    bench_result("schem_ctx_save", params, t_save * 1e6 / n, "us/op");
+
+    return 1;
+}
+
+pflag bench_schem_cycle(void)
+{
+    return bench_schem_cycle_sz(512) && bench_schem_cycle_sz(4096);
+}
+
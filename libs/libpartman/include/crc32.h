@@ -1,12 +1,19 @@
 #ifndef LIBPARTMAN_CRC32_H
 #define LIBPARTMAN_CRC32_H
 
+#include <stddef.h>
+
 #include "partman_types.h"
 
 typedef pu32 pcrc32;
 
 pcrc32 crc32_init(void);
 
+/* Generates lookup tables, if they are not generated yet. Tables are also
+ * generated on first use, but this must be called before CRC32 is computed
+ * from multiple threads at once */
+void crc32_prepare(void);
+
 void crc32_compute8(pcrc32 *crc32, pu8 i);
 
 void crc32_compute16(pcrc32 *crc32, pu16 i);
@@ -15,7 +22,18 @@ void crc32_compute32(pcrc32 *crc32, pu32 i);
 
 void crc32_compute64(pcrc32 *crc32, pu64 i);
 
+void crc32_compute_buf(pcrc32 *crc32, const pu8 *buf, size_t len);
+
+/* Same as crc32_compute_buf, but splits large buffers between up to
+ * thread_cnt threads */
+void crc32_compute_buf_par(pcrc32 *crc32, const pu8 *buf, size_t len,
+                           pu32 thread_cnt);
+
 void crc32_finalize(pcrc32 *crc32);
 
+/* Returns CRC32 of concatenated blocks A and B, using finalized CRC32 of
+ * each block and length of block B, in bytes */
+pcrc32 crc32_combine(pcrc32 crc1, pcrc32 crc2, pu64 len2);
+
 #endif
 
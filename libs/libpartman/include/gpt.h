@@ -4,17 +4,22 @@
 #include "partman_types.h"
 #include "schem.h"
 
-enum {
-    /* Maximum supported partition count for GPT */
-    gpt_max_part_cnt = 128
+/* Status of a GPT copy, as found by the last load */
+enum schem_gpt_copy {
+    schem_gpt_copy_unknown,
+    schem_gpt_copy_ok,
+    schem_gpt_copy_hdr_inv,
+    schem_gpt_copy_table_inv
 };
 
-void schem_init_gpt(struct schem *schem, const struct img_ctx *img_ctx);
+pres schem_init_gpt(struct schem *schem, const struct img_ctx *img_ctx);
 
 void schem_part_init_gpt(struct schem_part *part);
 
 pflag schem_part_is_used_gpt(const struct schem_part *part);
 
+pu32 schem_probe_gpt(const struct img_ctx *img_ctx, struct img_range *ranges);
+
 enum schem_load_res
 schem_load_gpt(struct schem *schem, const struct img_ctx *img_ctx);
 
@@ -22,5 +27,15 @@ pres schem_save_gpt(const struct schem *schem, const struct img_ctx *img_ctx);
 
 pres schem_remove_gpt(const struct img_ctx *img_ctx);
 
+void schem_release_gpt(struct schem *schem);
+
+pres schem_regen_gpt(struct schem_blob *blob,
+                      const struct schem_regen *regen);
+
+/* Returns status of the primary (is_sec is 0) or secondary GPT copy. Copies
+ * of a new scheme have unknown status until it is saved */
+enum schem_gpt_copy
+schem_gpt_copy_status(const struct schem *schem, pflag is_sec);
+
 #endif
 
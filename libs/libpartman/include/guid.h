@@ -4,6 +4,11 @@
 #include "partman_types.h"
 #include "crc32.h"
 
+enum {
+    /* GUID size on disk, in bytes */
+    guid_sz = 16
+};
+
 /* Globally Unique Identifier (GUID) structure */
 struct guid {
     pu32 time_lo;
@@ -16,6 +21,9 @@ struct guid {
 
 void guid_create(struct guid *guid);
 
+/* Creates cnt random GUIDs, random bytes are generated in batches */
+void guid_create_n(struct guid *guids, pu32 cnt);
+
 void guid_read(const pu8 *buf, struct guid *guid);
 
 void guid_write(pu8 *buf, const struct guid *guid);
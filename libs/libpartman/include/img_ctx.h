@@ -1,8 +1,51 @@
 #ifndef LIBPARTMAN_IMG_CTX_H
 #define LIBPARTMAN_IMG_CTX_H
 
+#include <sys/uio.h>
+
 #include "partman_types.h"
 
+/* Image sector cache, defined in img_ctx.c */
+struct img_cache;
+
+/* io_uring instance, defined in img_uring.c */
+struct img_uring;
+
+struct img_ctx;
+
+/* Image block backend operations */
+struct img_ops {
+    /* Reads secs_cnt sectors, starting at lba, into the buffer */
+    pres (*read_secs)(const struct img_ctx *ctx, plba lba, plba secs_cnt,
+                      pu8 *buf);
+
+    /* Writes buffers of whole sectors to contiguous sectors, starting at
+     * lba. Buffers array may be modified */
+    pres (*write_secs)(const struct img_ctx *ctx, plba lba,
+                       struct iovec *iov, int iov_cnt);
+
+    /* Ensures all written data is stored */
+    pres (*flush)(const struct img_ctx *ctx);
+
+    /* Returns image size, in bytes */
+    pu64 (*size)(const struct img_ctx *ctx);
+};
+
+/* POSIX file (or device) backend, uses img_fd */
+extern const struct img_ops img_file_ops;
+
+/* In-memory buffer backend, uses priv as the image buffer */
+extern const struct img_ops img_mem_ops;
+
+/* Range of image sectors */
+struct img_range {
+    /* First sector LBA */
+    plba lba;
+
+    /* Number of sectors */
+    plba secs_cnt;
+};
+
 struct img_ctx {
     /* Image file name */
     const char *img_name;
@@ -10,6 +53,15 @@ struct img_ctx {
     /* Image file descriptor */
     int img_fd;
 
+    /* Image block backend */
+    const struct img_ops *ops;
+
+    /* Set, if image must not be written */
+    pflag read_only;
+
+    /* Backend specific data */
+    void *priv;
+
     /* Logical sector (block) size, in bytes */
     pu64 sec_sz;
 
@@ -24,15 +76,54 @@ struct img_ctx {
 
     /* Maximum logical number of sectors per track (max 63) */
     pu8 spt;
+
+    /* Number of threads, used for checksum computation */
+    pu32 threads;
+
+    /* Number of partition entries in newly created GPT */
+    pu32 gpt_part_cnt;
+
+    /* Cache of image sectors, which were read or written */
+    struct img_cache *cache;
+
+    /* io_uring I/O backend, NULL if synchronous I/O is used */
+    struct img_uring *uring;
 };
 
-void img_ctx_init(struct img_ctx *ctx, const char *img_name, int img_fd,
+pres img_ctx_init(struct img_ctx *ctx, const char *img_name, int img_fd,
                   pu64 img_sz);
 
+pres img_ctx_init_mem(struct img_ctx *ctx, const char *img_name, pu8 *buf,
+                      pu64 buf_sz);
+
+pres img_ctx_init_ops(struct img_ctx *ctx, const char *img_name,
+                      const struct img_ops *ops, void *priv);
+
+void img_ctx_free(struct img_ctx *ctx);
+
+/* Switches file backend I/O to io_uring. Synchronous I/O is kept, if
+ * io_uring is not available */
+void img_ctx_uring_enable(struct img_ctx *ctx);
+
 pres img_ctx_validate(const struct img_ctx *ctx);
 
+/* Writes dirty cached sectors. Number of written sectors is stored into
+ * written_cnt */
+pres img_ctx_flush(const struct img_ctx *ctx, pu32 *written_cnt);
+
 pres img_ctx_sync(const struct img_ctx *ctx);
 
+/* Reads all ranges into the sector cache as a single batch. Does nothing,
+ * if io_uring backend is not used */
+void img_prefetch_secs(const struct img_ctx *ctx,
+                       const struct img_range *ranges, pu32 ranges_cnt);
+
+pres img_read_secs(const struct img_ctx *ctx, plba lba, plba secs_cnt,
+                   pu8 *buf);
+
+pres img_write_secs(const struct img_ctx *ctx, plba lba, plba secs_cnt,
+                    const pu8 *buf);
+
 pu64 lba_to_byte(const struct img_ctx *ctx, plba lba);
 
 plba byte_to_lba(const struct img_ctx *ctx, pu64 bytes, pflag round_up);
@@ -0,0 +1,45 @@
+#ifndef LIBPARTMAN_IMG_URING_H
+#define LIBPARTMAN_IMG_URING_H
+
+#include <sys/uio.h>
+
+#include "partman_types.h"
+
+/* io_uring instance, defined in img_uring.c */
+struct img_uring;
+
+/* Single image I/O request */
+struct img_io {
+    /* Request buffers */
+    struct iovec *iov;
+
+    /* Number of request buffers */
+    int iov_cnt;
+
+    /* Image offset, in bytes */
+    pu64 off;
+
+    /* Set for write requests, unset for read requests */
+    pflag write;
+
+    /* Set, if request must start only after all previous requests of the
+     * same batch are completed successfully. Otherwise, it and the requests
+     * after it are not submitted */
+    pflag barrier;
+
+    /* Request result: number of bytes transferred or negative error code */
+    p64 res;
+};
+
+/* Returns NULL, if io_uring is not supported by the kernel or the build */
+struct img_uring *img_uring_create(pu32 depth);
+
+void img_uring_free(struct img_uring *ring);
+
+/* Submits all requests as a single batch and waits for their completion.
+ * Result of each request is stored in its res field. On failure, requests,
+ * which were submitted, are completed before return too */
+pres img_uring_submit(struct img_uring *ring, int fd, struct img_io *ios,
+                      pu32 ios_cnt);
+
+#endif
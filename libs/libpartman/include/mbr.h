@@ -9,12 +9,14 @@ enum {
     mbr_max_part_cnt = 4
 };
 
-void schem_init_mbr(struct schem *schem, const struct img_ctx *img_ctx);
+pres schem_init_mbr(struct schem *schem, const struct img_ctx *img_ctx);
 
 void schem_part_init_mbr(struct schem_part *part);
 
 pflag schem_part_is_used_mbr(const struct schem_part *part);
 
+pu32 schem_probe_mbr(const struct img_ctx *img_ctx, struct img_range *ranges);
+
 enum schem_load_res
 schem_load_mbr(struct schem *schem, const struct img_ctx *img_ctx);
 
@@ -22,6 +24,16 @@ pres schem_save_mbr(const struct schem *schem, const struct img_ctx *img_ctx);
 
 pres schem_remove_mbr(const struct img_ctx *img_ctx);
 
+void schem_release_mbr(struct schem *schem);
+
+pres schem_regen_mbr(struct schem_blob *blob,
+                      const struct schem_regen *regen);
+
+/* Replaces bytes of the rendered MBR sector(s), which MBR save keeps
+ * (bootstrap code), with the ones, read from the image */
+pres schem_mbr_keep_boot(struct schem_blob *blob,
+                         const struct img_ctx *img_ctx);
+
 void schem_mbr_set_prot(struct schem *schem);
 
 pflag schem_mbr_is_prot(const struct schem *schem);
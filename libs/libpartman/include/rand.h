@@ -9,5 +9,8 @@ pu16 rand_16(void);
 
 pu32 rand_32(void);
 
+/* Fills buffer with random bytes, using all bytes of each rand() result */
+void rand_fill(pu8 *buf, pu32 cnt);
+
 #endif
 
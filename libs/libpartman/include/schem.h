@@ -12,6 +12,23 @@ enum schem_type {
     schem_cnt
 };
 
+enum {
+    /* Maximum number of sector ranges, read by a scheme while loading */
+    schem_probe_max_ranges = 2
+};
+
+/* Free extent allocation policy */
+enum schem_alloc_policy {
+    /* Extent with the lowest start LBA */
+    schem_alloc_first_fit,
+
+    /* Smallest extent */
+    schem_alloc_best_fit,
+
+    /* Largest extent */
+    schem_alloc_largest
+};
+
 /* Partitioning scheme load result */
 enum schem_load_res {
     schem_load_ok, schem_load_not_found, schem_load_fatal
@@ -21,8 +38,14 @@ struct schem;
 
 struct schem_part;
 
+struct schem_index;
+
+struct schem_blob;
+
+struct schem_regen;
+
 /* Partitioning scheme function type definitions */
-typedef void (*schem_func_init) (
+typedef pres (*schem_func_init) (
     struct schem            *schem,
     const struct img_ctx    *img_ctx
 );
@@ -35,6 +58,11 @@ typedef pflag (*schem_func_part_is_used) (
     const struct schem_part *part
 );
 
+typedef pu32 (*schem_func_probe) (
+    const struct img_ctx    *img_ctx,
+    struct img_range        *ranges
+);
+
 typedef enum schem_load_res (*schem_func_load) (
     struct schem            *schem,
     const struct img_ctx    *img_ctx
@@ -49,14 +77,26 @@ typedef pres (*schem_func_remove) (
     const struct img_ctx    *img_ctx
 );
 
+typedef void (*schem_func_release) (
+    struct schem            *schem
+);
+
+typedef pres (*schem_func_regen) (
+    struct schem_blob       *blob,
+    const struct schem_regen *regen
+);
+
 /* Unified scheme functions structure (contains function pointers) */
 struct schem_funcs {
     schem_func_init         init;
     schem_func_part_init    part_init;
     schem_func_part_is_used part_is_used;
+    schem_func_probe        probe;
     schem_func_load         load;
     schem_func_save         save;
     schem_func_remove       remove;
+    schem_func_release      release;
+    schem_func_regen        regen;
 };
 
 /* Unified scheme structure */
@@ -65,7 +105,7 @@ struct schem {
     enum schem_type type;
 
     /* Disk identifier: integer (MBR) or GUID (GPT) */
-    union {
+    union schem_id {
         pu32 i;
         struct guid guid;
     } id;
@@ -82,6 +122,13 @@ struct schem {
     /* Partition table */
     struct schem_part *table;
 
+    /* Scheme specific data, which is kept between load and save */
+    void *priv;
+
+    /* Used partitions, sorted by start LBA, for searches. Partition changes
+     * in the table must be reported with schem_part_changed() */
+    struct schem_index *index;
+
     struct schem_funcs funcs;
 };
 
@@ -112,6 +159,58 @@ struct schem_part {
     pu8 boot_ind;
 };
 
+/* Free sector range, which is not used by any partition */
+struct schem_free_ext {
+    plba start_lba;
+    plba end_lba;
+    plba secs;
+
+    /* Range with aligned start and end. Is set, only if aligned sector count
+     * is not 0 */
+    plba align_start_lba;
+    plba align_end_lba;
+    plba align_secs;
+};
+
+/* Free space summary */
+struct schem_free_stats {
+    /* Number of free extents */
+    pu32 ext_cnt;
+
+    /* Total and largest extent sector counts, raw and aligned */
+    plba free_secs;
+    plba largest_secs;
+    plba align_free_secs;
+    plba align_largest_secs;
+};
+
+/* Partition request for bulk creation */
+struct schem_part_req {
+    /* Size in sectors, 0 for the rest of the free extent */
+    plba secs;
+
+    /* Start alignment in sectors, 0 for the image alignment */
+    plba align;
+
+    /* Partition type: integer (MBR) or GUID (GPT), zero for the default
+     * type of the scheme */
+    union {
+        pu8 i;
+        struct guid guid;
+    } type;
+};
+
+/* Identifiers, which are kept, when a rendered scheme gets new ones */
+struct schem_regen {
+    /* Set, if disk identifier is kept */
+    pflag keep_id;
+
+    /* GPT: set for each partition table entry, which keeps its partition
+     * GUID. Entries past keep_part_cnt get new GUIDs */
+    pflag *keep_part_ids;
+    pu32 keep_part_cnt;
+};
+
 /* Scheme context structure */
 struct schem_ctx {
     /* Array of pointers to all current schemes in memory */
@@ -121,6 +220,8 @@ struct schem_ctx {
     pflag schemes_in_img[schem_cnt];
 };
 
+void schem_map_funcs(struct schem_funcs *funcs, enum schem_type type);
+
 void schem_ctx_init(struct schem_ctx *schem_ctx);
 
 pres schem_ctx_new(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx,
@@ -134,9 +235,23 @@ schem_ctx_save(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx);
 
 enum schem_type schem_ctx_get_type(const struct schem_ctx *schem_ctx);
 
+/* Removes schemes, which are found in the image, except the ones, which are
+ * set in keep. Used, when schemes are written without loading the image */
+pres schem_remove_found(const struct img_ctx *img_ctx, const pflag *keep);
+
 void schem_ctx_reset(struct schem_ctx *schem_ctx, pflag keep_scheme_flags);
 
-void schem_part_delete(struct schem_part *part);
+pres schem_table_alloc(struct schem *schem, pu32 part_cnt);
+
+/* Updates partition in the search index, after its type or boundaries
+ * are changed */
+void schem_part_changed(struct schem *schem, pu32 index);
+
+/* Marks the whole search index as outdated, after many partitions are
+ * changed at once. Index is rebuilt on the next search */
+void schem_table_changed(struct schem *schem);
+
+void schem_part_delete(struct schem *schem, pu32 index);
 
 p32 schem_find_overlap(const struct schem *schem, plba start_lba, plba end_lba,
                        p32 part_ign);
@@ -150,5 +265,34 @@ plba_res schem_find_last_sector(const struct schem *schem,
                                 const struct img_ctx *img_ctx, p32 part_ign,
                                 plba first_lba);
 
+/* Checks, that every used partition is within the usable range and does not
+ * overlap others. If strict_align is set, partition starts must be aligned.
+ * All found problems are reported */
+pres schem_validate(const struct schem *schem, const struct img_ctx *img_ctx,
+                    pflag strict_align);
+
+/* Finds free extents between the first and the last usable LBA, which are
+ * not used by partitions other than part_ign. Extents are sorted by start
+ * LBA. Returned array must be freed */
+pres schem_find_free_exts(const struct schem *schem,
+                          const struct img_ctx *img_ctx, p32 part_ign,
+                          struct schem_free_ext **exts, pu32 *ext_cnt);
+
+void schem_free_stats(const struct schem_free_ext *exts, pu32 ext_cnt,
+                      struct schem_free_stats *stats);
+
+/* Places a partition of secs sectors (0 for the whole extent) into a free
+ * extent, which is chosen by policy. Start LBA is aligned, if partition
+ * still fits. Fails, if no extent is large enough */
+pres schem_alloc_part(const struct schem *schem, const struct img_ctx *img_ctx,
+                      enum schem_alloc_policy policy, plba secs, p32 part_ign,
+                      plba *start_lba, plba *end_lba);
+
+/* Creates partitions in free table entries, placing them one after another
+ * in a single sweep over free space. Table is not changed, if some of the
+ * partitions do not fit */
+pres schem_add_parts(struct schem *schem, const struct img_ctx *img_ctx,
+                     const struct schem_part_req *reqs, pu32 req_cnt);
+
 #endif
 
@@ -0,0 +1,61 @@
+#ifndef LIBPARTMAN_SCHEM_BLOB_H
+#define LIBPARTMAN_SCHEM_BLOB_H
+
+#include "img_ctx.h"
+#include "schem.h"
+
+/* Run of contiguous rendered sectors */
+struct schem_blob_run {
+    /* First sector LBA */
+    plba lba;
+
+    /* Number of sectors */
+    plba secs_cnt;
+
+    /* Sector data */
+    pu8 *buf;
+};
+
+/* Scheme metadata sectors, rendered once and written to any number of
+ * images with the same size and sector size */
+struct schem_blob {
+    /* Type of the rendered scheme */
+    enum schem_type type;
+
+    /* Set for each scheme, which is rendered into the blob (GPT comes with
+     * Protective MBR) */
+    pflag schemes[schem_cnt];
+
+    /* Image geometry, the blob was rendered for */
+    pu64 sec_sz;
+    pu64 img_sz;
+
+    /* Rendered sector runs */
+    pu32 run_cnt;
+    struct schem_blob_run *runs;
+};
+
+/* Renders schemes of scheme context, which were created for img_ctx, into
+ * the blob. Image itself is not read or written. Scheme context is treated
+ * as saved afterwards */
+pres schem_blob_render(struct schem_blob *blob, struct schem_ctx *schem_ctx,
+                       const struct img_ctx *img_ctx);
+
+void schem_blob_free(struct schem_blob *blob);
+
+/* Returns non-zero, if blob can be written to the image */
+pflag schem_blob_fits(const struct schem_blob *blob,
+                      const struct img_ctx *img_ctx);
+
+/* Writes blob to the image. Other schemes, which are found in the image, are
+ * removed. Scheme gets new random disk and partition identifiers first,
+ * except the ones, which are kept by regen */
+pres schem_blob_stamp(const struct schem_blob *blob,
+                      const struct img_ctx *img_ctx,
+                      const struct schem_regen *regen);
+
+/* Returns sectors [lba, lba + secs_cnt) of the blob, if they are rendered
+ * as a single run, NULL otherwise */
+pu8 *schem_blob_secs(const struct schem_blob *blob, plba lba, plba secs_cnt);
+
+#endif
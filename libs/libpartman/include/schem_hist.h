@@ -0,0 +1,87 @@
+#ifndef LIBPARTMAN_SCHEM_HIST_H
+#define LIBPARTMAN_SCHEM_HIST_H
+
+#include "schem.h"
+
+enum {
+    /* Number of partitions in a table chunk, which is copied on write */
+    schem_hist_chunk_parts = 64,
+
+    /* Maximum number of kept steps, oldest ones are dropped */
+    schem_hist_max_steps = 256
+};
+
+/* Copy of a table chunk. Holds the chunk contents from the other side of
+ * the step: before it, if the step is done, and after it, if undone */
+struct schem_hist_chunk {
+    enum schem_type type;
+
+    /* Chunk number in the table */
+    pu32 chunk;
+
+    pu32 part_cnt;
+    struct schem_part parts[schem_hist_chunk_parts];
+};
+
+/* Changes, made by a single operation */
+struct schem_hist_step {
+    struct schem_hist_chunk **chunks;
+    pu32 chunk_cnt;
+    pu32 chunk_cap;
+
+    /* Scheme identifiers, which are changed by the step */
+    pflag has_id[schem_cnt];
+    union schem_id ids[schem_cnt];
+};
+
+/* Undo/redo history of scheme context tables. Snapshot only starts a new
+ * step, table chunks are copied into it on their first change */
+struct schem_hist {
+    struct schem_ctx *schem_ctx;
+
+    /* Steps, first pos of them are done, the rest can be redone */
+    struct schem_hist_step *steps;
+    pu32 step_cnt;
+    pu32 step_cap;
+    pu32 pos;
+
+    /* Current snapshot number and whether its step is not created yet */
+    pu32 serial;
+    pflag pending;
+
+    /* Snapshot number, each chunk was last copied at */
+    pu32 *chunk_serial[schem_cnt];
+    pu32 chunk_cnt[schem_cnt];
+};
+
+void schem_hist_init(struct schem_hist *hist, struct schem_ctx *schem_ctx);
+
+void schem_hist_free(struct schem_hist *hist);
+
+/* Drops all steps, e.g. after schemes are replaced */
+void schem_hist_clear(struct schem_hist *hist);
+
+/* Starts a new step in constant time. Step is kept, only if something is
+ * changed after it */
+void schem_hist_snap(struct schem_hist *hist);
+
+/* Must be called before a partition is changed */
+pres schem_hist_touch(struct schem_hist *hist, enum schem_type type,
+                      pu32 index);
+
+/* Must be called before the whole table or the scheme identifier are
+ * changed */
+pres schem_hist_touch_all(struct schem_hist *hist, enum schem_type type);
+
+pflag schem_hist_can_undo(const struct schem_hist *hist);
+
+pflag schem_hist_can_redo(const struct schem_hist *hist);
+
+/* Swaps changed chunks of the last done step back */
+pres schem_hist_undo(struct schem_hist *hist);
+
+/* Swaps changed chunks of the first undone step again */
+pres schem_hist_redo(struct schem_hist *hist);
+
+#endif
+
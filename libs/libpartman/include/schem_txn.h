@@ -0,0 +1,73 @@
+#ifndef LIBPARTMAN_SCHEM_TXN_H
+#define LIBPARTMAN_SCHEM_TXN_H
+
+#include "img_ctx.h"
+#include "schem.h"
+
+/* Partition edit operation */
+enum schem_op {
+    schem_op_create,
+    schem_op_resize,
+    schem_op_delete,
+    schem_op_retype
+};
+
+/* Partition edit */
+struct schem_edit {
+    enum schem_op op;
+
+    /* Partition index in the table */
+    pu32 index;
+
+    /* Create, resize: new partition boundaries */
+    plba start_lba;
+    plba end_lba;
+
+    /* Create, retype: partition type, integer (MBR) or GUID (GPT). Zero
+     * type on create is the default type of the scheme */
+    union {
+        pu8 i;
+        struct guid guid;
+    } type;
+};
+
+/* Transaction of partition edits of a single scheme. Edits are applied to
+ * the table at once, but are validated only on commit */
+struct schem_txn {
+    struct schem_ctx *schem_ctx;
+
+    /* Edited scheme */
+    struct schem *schem;
+
+    /* Copy of the table, which is restored on rollback */
+    struct schem_part *backup;
+    pu32 backup_cnt;
+
+    /* Number of applied edits */
+    pu32 edit_cnt;
+
+    /* Partition starts must be aligned on commit */
+    pflag strict_align;
+};
+
+/* Starts transaction on the scheme of the given type. Other partition
+ * fields (e.g. name) may be changed directly during transaction and are
+ * rolled back too */
+pres schem_txn_begin(struct schem_txn *txn, struct schem_ctx *schem_ctx,
+                     enum schem_type type);
+
+/* Applies edit to the table. Only partition index and its state are checked
+ * here */
+pres schem_txn_apply(struct schem_txn *txn, const struct schem_edit *edit);
+
+/* Validates the resulting table and saves all schemes with a single image
+ * sync, if save is set. Table is rolled back on failure, but image may be
+ * partially written, if save fails. Transaction is ended in both cases */
+pres schem_txn_commit(struct schem_txn *txn, const struct img_ctx *img_ctx,
+                      pflag save);
+
+/* Restores the table, as it was at the transaction start, and ends it */
+void schem_txn_rollback(struct schem_txn *txn);
+
+#endif
+
@@ -0,0 +1,74 @@
+#ifndef LIBPARTMAN_STATS_H
+#define LIBPARTMAN_STATS_H
+
+#include "partman_types.h"
+
+/* Timed phases. Phases may nest, e.g. save includes image sync */
+enum stats_phase {
+    stats_img_open,
+    stats_schem_load,
+    stats_gpt_pair_load,
+    stats_crc,
+    stats_schem_conv,
+    stats_schem_save,
+    stats_img_sync,
+
+    stats_phase_cnt
+};
+
+/* Counted system calls */
+enum stats_call {
+    stats_call_read,
+    stats_call_write,
+    stats_call_fsync,
+    stats_call_mmap,
+    stats_call_munmap,
+    stats_call_uring_enter,
+
+    stats_call_cnt
+};
+
+struct stats_phase_val {
+    /* Number of times, phase was entered */
+    pu64 cnt;
+
+    /* Total time, spent in phase, in nanoseconds */
+    pu64 ns;
+};
+
+struct stats_call_val {
+    /* Number of calls (requests for io_uring reads and writes) */
+    pu64 cnt;
+
+    /* Number of bytes moved */
+    pu64 bytes;
+};
+
+struct stats {
+    struct stats_phase_val phases[stats_phase_cnt];
+    struct stats_call_val calls[stats_call_cnt];
+};
+
+/* Statistics are collected only after they are enabled */
+void stats_enable(pflag enable);
+
+/* Returns monotonic clock time, in nanoseconds */
+pu64 stats_now(void);
+
+/* Returns phase start time, which is passed to stats_end(), or 0, if
+ * statistics are disabled. Phase is also recorded as a trace step */
+pu64 stats_begin(enum stats_phase phase);
+
+void stats_end(enum stats_phase phase, pu64 start);
+
+void stats_call(enum stats_call call, pu64 bytes);
+
+/* Copies collected statistics */
+void stats_get(struct stats *stats);
+
+const char *stats_phase_name(enum stats_phase phase);
+
+const char *stats_call_name(enum stats_call call);
+
+#endif
+
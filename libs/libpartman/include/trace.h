@@ -0,0 +1,22 @@
+#ifndef LIBPARTMAN_TRACE_H
+#define LIBPARTMAN_TRACE_H
+
+#include "partman_types.h"
+
+/* Starts recording events into a ring buffer, which holds up to event_cnt
+ * latest events. Calling thread gets thread ID 1 */
+pres trace_start(pu32 event_cnt);
+
+/* Records begin/end of a step. Name must be a static string */
+void trace_begin(const char *name);
+
+void trace_end(const char *name);
+
+/* Writes recorded events in Chrome trace-event JSON format */
+pres trace_save(const char *path);
+
+/* Stops recording and frees the ring buffer */
+void trace_stop(void);
+
+#endif
+
@@ -1,11 +1,222 @@
+#include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
 
 #include "crc32.h"
 #include "log.h"
 
-/* Initialized to 0s */
-static pcrc32 crc_table[256];
+/* Carry-less multiplication kernel is only built for x86-64 with a GCC
+ * compatible compiler. Other targets always use the portable table code */
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(CRC32_NO_CLMUL)
+#define CRC32_CLMUL 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+enum {
+    /* Number of bytes, processed by a single slicing step */
+    crc_slice_sz = 8,
+
+    /* Minimum buffer size, in bytes, for the folding kernel */
+    crc_clmul_min_sz = 64,
+
+    /* Minimum buffer part size, in bytes, worth a separate thread */
+    crc_par_min_sz = 256 * 1024
+};
+
+/* Buffer part, processed by a single thread */
+struct crc32_part {
+    /* Worker thread */
+    pthread_t thread;
+
+    /* Set, if worker thread was started */
+    pflag started;
+
+    /* Part start */
+    const pu8 *buf;
+
+    /* Part length, in bytes */
+    size_t len;
+
+    /* Finalized part CRC32 */
+    pcrc32 crc32;
+};
+
+/* Slicing-by-8 lookup tables. Table 0 is the classic byte-wise table, table
+ * N is the CRC of a byte, followed by N zero bytes. Initialized to 0s */
+static pcrc32 crc_table[crc_slice_sz][256];
+
+/* Table of x^(2^n) modulo CRC32 polynomial, used for combining CRCs */
+static pcrc32 crc_x2n_table[32];
+
+/* Set, if the CPU supports carry-less multiplication (PCLMULQDQ) */
+static pflag crc_has_clmul;
+
+#ifdef CRC32_CLMUL
+static void crc32_detect_cpu(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+
+    crc_has_clmul = (ecx & bit_PCLMUL) != 0;
+
+    if(crc_has_clmul) {
+        plog_dbg("CRC32 PCLMULQDQ kernel enabled");
+    }
+}
+
+/* Folds the buffer with 4 parallel 128-bit accumulators and reduces the
+ * result with Barrett reduction (Intel, "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction"). Constants are for the
+ * bit-reflected polynomial 0xEDB88320. Length must be a multiple of 16 and
+ * at least 64 bytes */
+__attribute__((target("pclmul,sse2")))
+static pcrc32 crc32_compute_clmul(pcrc32 crc32, const pu8 *buf, size_t len)
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    __m128i k1k2, k3k4, k5k0, poly, mask;
+
+    k1k2 = _mm_set_epi64x(0x01C6E41596LL, 0x0154442BD4LL);
+    k3k4 = _mm_set_epi64x(0x00CCAA009ELL, 0x01751997D0LL);
+    k5k0 = _mm_set_epi64x(0x0000000000LL, 0x0163CD6124LL);
+    poly = _mm_set_epi64x(0x01F7011641LL, 0x01DB710641LL);
+    mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc32));
+
+    buf += 64;
+    len -= 64;
+
+    /* Parallel fold of 64-byte blocks */
+    x0 = k1k2;
+    while(len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    /* Fold 4 accumulators into a single 128-bit value */
+    x0 = k3k4;
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* Single fold of remaining 16-byte blocks */
+    while(len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *) buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    /* Fold 128 bits to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = k5k0;
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = poly;
+
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (pcrc32) (unsigned int) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+
+/* Multiplies polynomials a(x) and b(x) modulo CRC32 polynomial. Both values
+ * use reflected bit order, a(x) must not be zero */
+static pcrc32 crc32_multmodp(pcrc32 a, pcrc32 b)
+{
+    pcrc32 m, p;
+
+    m = (pcrc32) 1 << 31;
+    p = 0;
+
+    for(;;) {
+        if(a & m) {
+            p ^= b;
+            if((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+
+    return p;
+}
+
+/* Returns x^(n * 2^k) modulo CRC32 polynomial */
+static pcrc32 crc32_x2nmodp(pu64 n, unsigned int k)
+{
+    pcrc32 p;
+
+    /* x^0 */
+    p = (pcrc32) 1 << 31;
+
+    while(n) {
+        if(n & 1) {
+            p = crc32_multmodp(crc_x2n_table[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+
+    return p;
+}
 
 static void crc32_init_table(void)
 {
@@ -17,11 +228,36 @@ static void crc32_init_table(void)
     for(i = 128; i; i >>= 1) {
         crc32 = (crc32 >> 1) ^ (crc32 & 1 ? 0xEDB88320 : 0);
         for(j = 0; j < 256; j += 2 * i) {
-            crc_table[i + j] = crc32 ^ crc_table[j];
+            crc_table[0][i + j] = crc32 ^ crc_table[0][j];
         }
     }
 
+    /* Extend each table entry with one more zero byte */
+    for(i = 1; i < crc_slice_sz; i++) {
+        for(j = 0; j < 256; j++) {
+            crc32 = crc_table[i - 1][j];
+            crc_table[i][j] = (crc32 >> 8) ^ crc_table[0][crc32 & 0xFF];
+        }
+    }
+
+    /* x^1, then repeatedly squared */
+    crc_x2n_table[0] = crc32 = (pcrc32) 1 << 30;
+    for(i = 1; i < ARRAY_SIZE(crc_x2n_table); i++) {
+        crc_x2n_table[i] = crc32 = crc32_multmodp(crc32, crc32);
+    }
+
     plog_dbg("CRC32 table generated");
+
+#ifdef CRC32_CLMUL
+    crc32_detect_cpu();
+#endif
+}
+
+void crc32_prepare(void)
+{
+    if(crc_table[0][255] == 0) {
+        crc32_init_table();
+    }
 }
 
 pcrc32 crc32_init(void)
@@ -38,12 +274,12 @@ void crc32_finalize(pcrc32 *crc32)
 
 void crc32_compute8(pcrc32 *crc32, pu8 i)
 {
-    if(crc_table[255] == 0) {
+    if(crc_table[0][255] == 0) {
         crc32_init_table();
     }
 
     *crc32 ^= i;
-    *crc32 = (*crc32 >> 8) ^ crc_table[*crc32 & 0xFF];
+    *crc32 = (*crc32 >> 8) ^ crc_table[0][*crc32 & 0xFF];
 }
 
 void crc32_compute16(pcrc32 *crc32, pu16 i)
@@ -72,3 +308,149 @@ void crc32_compute64(pcrc32 *crc32, pu64 i)
     crc32_compute8(crc32, (i >> 56) & 0xFF);
 }
 
+static pcrc32 crc32_compute_table(pcrc32 c, const pu8 *buf, size_t len)
+{
+    /* Slicing-by-8 main loop. Bytes are combined manually, so the result
+     * does not depend on host endianness or alignment */
+    while(len >= crc_slice_sz) {
+        c ^= ((pcrc32) buf[0] << 0 ) |
+             ((pcrc32) buf[1] << 8 ) |
+             ((pcrc32) buf[2] << 16) |
+             ((pcrc32) buf[3] << 24);
+
+        c = crc_table[7][(c >> 0 ) & 0xFF] ^
+            crc_table[6][(c >> 8 ) & 0xFF] ^
+            crc_table[5][(c >> 16) & 0xFF] ^
+            crc_table[4][(c >> 24) & 0xFF] ^
+            crc_table[3][buf[4]] ^
+            crc_table[2][buf[5]] ^
+            crc_table[1][buf[6]] ^
+            crc_table[0][buf[7]];
+
+        buf += crc_slice_sz;
+        len -= crc_slice_sz;
+    }
+
+    /* Remaining tail bytes */
+    while(len--) {
+        c ^= *buf++;
+        c = (c >> 8) ^ crc_table[0][c & 0xFF];
+    }
+
+    return c;
+}
+
+void crc32_compute_buf(pcrc32 *crc32, const pu8 *buf, size_t len)
+{
+    pcrc32 c;
+
+    /* Table presence is checked once per buffer, not once per byte */
+    if(crc_table[0][255] == 0) {
+        crc32_init_table();
+    }
+
+    c = *crc32 & 0xFFFFFFFFu;
+
+#ifdef CRC32_CLMUL
+    /* Fold all whole 16-byte blocks, leave the tail to the table code */
+    if(crc_has_clmul && len >= crc_clmul_min_sz) {
+        size_t fold_len;
+
+        fold_len = len & ~(size_t) 15;
+        c = crc32_compute_clmul(c, buf, fold_len);
+        buf += fold_len;
+        len -= fold_len;
+    }
+#endif
+
+    *crc32 = crc32_compute_table(c, buf, len);
+}
+
+pcrc32 crc32_combine(pcrc32 crc1, pcrc32 crc2, pu64 len2)
+{
+    if(crc_table[0][255] == 0) {
+        crc32_init_table();
+    }
+
+    /* Shift first CRC by len2 zero bytes (x^(8 * len2)) and add the second */
+    return crc32_multmodp(crc32_x2nmodp(len2, 3), crc1 & 0xFFFFFFFFu) ^
+           (crc2 & 0xFFFFFFFFu);
+}
+
+static void *crc32_part_compute(void *arg)
+{
+    struct crc32_part *part;
+
+    part = arg;
+
+    part->crc32 = crc32_init();
+    crc32_compute_buf(&part->crc32, part->buf, part->len);
+    crc32_finalize(&part->crc32);
+
+    return NULL;
+}
+
+void crc32_compute_buf_par(pcrc32 *crc32, const pu8 *buf, size_t len,
+                           pu32 thread_cnt)
+{
+    struct crc32_part *parts;
+    size_t part_sz;
+    pcrc32 c;
+    pu32 i;
+
+    /* Do not split buffer into parts, which are too small */
+    if(thread_cnt > len / crc_par_min_sz) {
+        thread_cnt = len / crc_par_min_sz;
+    }
+
+    if(thread_cnt <= 1) {
+        crc32_compute_buf(crc32, buf, len);
+        return;
+    }
+
+    parts = calloc(thread_cnt, sizeof(*parts));
+    if(parts == NULL) {
+        crc32_compute_buf(crc32, buf, len);
+        return;
+    }
+
+    /* Tables must be ready before workers start */
+    if(crc_table[0][255] == 0) {
+        crc32_init_table();
+    }
+
+    part_sz = len / thread_cnt;
+
+    for(i = 0; i < thread_cnt; i++) {
+        parts[i].buf = buf + i * part_sz;
+        parts[i].len = i + 1 < thread_cnt ? part_sz : len - i * part_sz;
+    }
+
+    /* First part is processed by the calling thread */
+    for(i = 1; i < thread_cnt; i++) {
+        parts[i].started = pthread_create(&parts[i].thread, NULL,
+                                          &crc32_part_compute,
+                                          &parts[i]) == 0;
+    }
+
+    crc32_part_compute(&parts[0]);
+
+    /* Parts, which failed to start a worker, are processed here */
+    for(i = 1; i < thread_cnt; i++) {
+        if(parts[i].started) {
+            pthread_join(parts[i].thread, NULL);
+        } else {
+            crc32_part_compute(&parts[i]);
+        }
+    }
+
+    /* Running value corresponds to finalized CRC32 of the preceding data,
+     * so parts are appended to it in order */
+    c = (*crc32 ^ 0xFFFFFFFFu) & 0xFFFFFFFFu;
+    for(i = 0; i < thread_cnt; i++) {
+        c = crc32_combine(c, parts[i].crc32, parts[i].len);
+    }
+    *crc32 = c ^ 0xFFFFFFFFu;
+
+    free(parts);
+}
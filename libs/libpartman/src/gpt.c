@@ -1,14 +1,15 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
-#include <unistd.h>
 #include <string.h>
-#include <sys/mman.h>
 
 #include "gpt.h"
 #include "log.h"
 #include "memutils.h"
 #include "crc32.h"
+#include "schem_blob.h"
+#include "stats.h"
+#include "trace.h"
 
 #define GPT_SIG "EFI PART"
 
@@ -109,151 +110,40 @@ struct gpt {
 
     /* In-memory GPT secondary table structure */
     struct gpt_part_ent *table_sec;
-};
-
-static long byte_to_page(pu64 bytes, pflag round_up)
-{
-    long pg_sz = sysconf(_SC_PAGESIZE);
-    return bytes / pg_sz + (round_up && (bytes % pg_sz) ? 1 : 0);
-}
-
-static pu64 page_to_byte(long pages)
-{
-    return pages * sysconf(_SC_PAGESIZE);
-}
-
-static pres unmap_secs(pu8 *reg, const struct img_ctx *ctx, plba off_lba,
-                       plba secs_cnt)
-{
-    int c;
-    pu64 off_bytes;
-    long off_pages;
-    long align_off;
-    long len_pages;
-
-    /* Memory region offset, in bytes */
-    off_bytes = lba_to_byte(ctx, off_lba);
-
-    /* Memory region offset, in pages (aligned, to lower) */
-    off_pages = byte_to_page(off_bytes, 0);
-
-    /* Alignment offset, in bytes (how many bytes offset moved back) */
-    align_off = off_bytes - page_to_byte(off_pages);
-
-    /* Memory region length, in pages (aligned, to higher)  */
-    len_pages = byte_to_page(lba_to_byte(ctx, secs_cnt) + align_off, 1);
-
-    c = munmap(reg - align_off, len_pages);
-    if(c == -1) {
-        perror("munmap()");
-        return pres_fail;
-    }
-
-    return pres_ok;
-}
-
-static pu8 *map_secs(const struct img_ctx *ctx, plba off_lba, plba secs_cnt)
-{
-    pu8 *reg;
-    pu64 off_bytes;
-    long off_pages;
-    long align_off;
-    long len_pages;
-
-    /* Memory region offset, in bytes */
-    off_bytes = lba_to_byte(ctx, off_lba);
-
-    /* Memory region offset, in pages (aligned, to lower) */
-    off_pages = byte_to_page(off_bytes, 0);
 
-    /* Alignment offset, in bytes (how many bytes offset moved back) */
-    align_off = off_bytes - page_to_byte(off_pages);
+    /* On-disk GPT primary partition entry array, with entry extension bytes */
+    pu8 *ent_buf_prim;
 
-    /* Memory region length, in pages (aligned, to higher)  */
-    len_pages = byte_to_page(lba_to_byte(ctx, secs_cnt) + align_off, 1);
-
-    reg = mmap(NULL, page_to_byte(len_pages), PROT_READ|PROT_WRITE,
-               MAP_SHARED, ctx->img_fd, page_to_byte(off_pages));
-    if(reg == MAP_FAILED) {
-        perror("mmap()");
-        return NULL;
-    }
-
-    /* Return address moved forward with alignment offset */
-    return reg + align_off;
-}
-
-static void gpt_part_ent_crc_compute(pcrc32 *crc32,
-                                     const struct gpt_part_ent *entry)
-{
-    int i;
-
-    guid_crc_compute(crc32, &entry->type_guid);
-    guid_crc_compute(crc32, &entry->unique_guid);
-    crc32_compute64(crc32, entry->start_lba);
-    crc32_compute64(crc32, entry->end_lba);
-    crc32_compute64(crc32, entry->attr);
-
-    for(i = 0; i < ARRAY_SIZE(entry->name); i++) {
-        crc32_compute16(crc32, entry->name[i]);
-    }
-}
-
-static pcrc32 gpt_table_crc_create(const struct gpt_part_ent table[],
-                                   pu32 table_len)
-{
-    pu32 i;
-    pcrc32 crc32;
-
-    crc32 = crc32_init();
-
-    for(i = 0; i < table_len; i++) {
-        gpt_part_ent_crc_compute(&crc32, &table[i]);
-    }
+    /* On-disk GPT secondary partition entry array, with entry extension
+     * bytes */
+    pu8 *ent_buf_sec;
 
-    crc32_finalize(&crc32);
-
-    return crc32;
-}
-
-static pcrc32 gpt_hdr_crc_create(const struct gpt_hdr *hdr)
-{
-    pcrc32 crc32;
-    int i;
-
-    crc32 = crc32_init();
-
-    /* Signature */
-    for(i = 0; i < ARRAY_SIZE(GPT_SIG) - 1 ; i++) {
-        crc32_compute8(&crc32, GPT_SIG[i]);
-    }
-
-    crc32_compute32(&crc32, hdr->rev);
-    crc32_compute32(&crc32, hdr->hdr_sz);
-
-    /* Header CRC32 field counts as 0 during CRC32 evaluation */
-    crc32_compute32(&crc32, 0);
+    /* Status of primary and secondary copies, as they were loaded */
+    enum schem_gpt_copy copy_status[2];
+};
 
-    /* Reserved, 4 bytes */
-    crc32_compute32(&crc32, 0);
+/* GPT partition entry array CRC32 cache. Kept in scheme private data between
+ * load and save, so only changed entries get hashed again. Also keeps bytes
+ * of entries larger, than 128 bytes, which are not known to the scheme */
+struct gpt_cache {
+    /* Number of cached partition entries */
+    pu32 ent_cnt;
 
-    crc32_compute64(&crc32, hdr->my_lba);
-    crc32_compute64(&crc32, hdr->alt_lba);
-    crc32_compute64(&crc32, hdr->first_usable_lba);
-    crc32_compute64(&crc32, hdr->last_usable_lba);
+    /* Partition entry size, in bytes */
+    pu32 ent_sz;
 
-    /* Disk GUID */
-    guid_crc_compute(&crc32, &hdr->disk_guid);
+    /* Serialized partition entries, as of last CRC32 computation */
+    pu8 *ent_buf;
 
-    crc32_compute64(&crc32, hdr->part_table_lba);
-    crc32_compute32(&crc32, hdr->part_table_entry_cnt);
-    crc32_compute32(&crc32, hdr->part_entry_sz);
-    crc32_compute32(&crc32, hdr->part_table_crc32);
+    /* CRC32 checksum of each partition entry */
+    pcrc32 *ent_crc32;
 
-    crc32_finalize(&crc32);
+    /* CRC32 checksum of the whole partition entry array */
+    pcrc32 table_crc32;
 
-    return crc32;
-}
+    /* Status of primary and secondary copies, as of last load or save */
+    enum schem_gpt_copy copy_status[2];
+};
 
 static void gpt_part_ent_write(pu8 *buf, const struct gpt_part_ent *entry)
 {
@@ -270,7 +160,7 @@ static void gpt_part_ent_write(pu8 *buf, const struct gpt_part_ent *entry)
     write_pu64(buf + 48, entry->attr);
 
     for(i = 0; i < ARRAY_SIZE(entry->name); i++) {
-        write_pu16(buf + 56 + i, entry->name[i]);
+        write_pu16(buf + 56 + i * 2, entry->name[i]);
     }
 }
 
@@ -289,18 +179,7 @@ static void gpt_part_ent_read(const pu8 *buf, struct gpt_part_ent *entry)
     entry->attr      = read_pu64(buf + 48);
 
     for(i = 0; i < ARRAY_SIZE(entry->name); i++) {
-        entry->name[i] = read_pu16(buf + 56 + i);
-    }
-}
-
-static void gpt_table_write(pu8 *buf, const struct gpt_part_ent table[],
-                            pu32 table_len, pu32 entry_sz)
-{
-    pu32 i;
-
-    /* Maximum supported number of partitions limit */
-    for(i = 0; i < table_len && i < gpt_max_part_cnt; i++) {
-        gpt_part_ent_write(&buf[i * entry_sz], &table[i]);
+        entry->name[i] = read_pu16(buf + 56 + i * 2);
     }
 }
 
@@ -309,9 +188,8 @@ static void gpt_table_read(const pu8 *buf, struct gpt_part_ent table[],
 {
     pu32 i;
 
-    /* Maximum supported number of partitions limit */
-    for(i = 0; i < table_len && i < gpt_max_part_cnt; i++) {
-        gpt_part_ent_read(&buf[i * entry_sz], &table[i]);
+    for(i = 0; i < table_len; i++) {
+        gpt_part_ent_read(&buf[(size_t) i * entry_sz], &table[i]);
     }
 }
 
@@ -377,30 +255,221 @@ static void gpt_hdr_read(const pu8 *buf, struct gpt_hdr *hdr)
     hdr->part_table_crc32     = read_pu32(buf + 88);
 }
 
+static pcrc32 gpt_hdr_crc_compute(const pu8 *buf, pu32 hdr_sz)
+{
+    pcrc32 crc32;
+
+    crc32 = crc32_init();
+
+    /* Header CRC32 field counts as 0 during CRC32 evaluation */
+    crc32_compute_buf(&crc32, buf, 16);
+    crc32_compute32(&crc32, 0);
+    crc32_compute_buf(&crc32, buf + 20, hdr_sz - 20);
+
+    crc32_finalize(&crc32);
+
+    return crc32;
+}
+
+static pcrc32 gpt_hdr_crc_create(const struct gpt_hdr *hdr)
+{
+    pu8 buf[gpt_hdr_sz];
+
+    /* Serialize header and compute CRC over its on-disk representation */
+    gpt_hdr_write(buf, hdr);
+
+    return gpt_hdr_crc_compute(buf, gpt_hdr_sz);
+}
+
+static void gpt_cache_free(struct gpt_cache *cache)
+{
+    if(!cache) {
+        return;
+    }
+
+    free(cache->ent_buf);
+    free(cache->ent_crc32);
+    free(cache);
+}
+
+/* Creates cache over serialized partition entry array. On success, cache
+ * takes ownership of the array buffer, so it is not copied */
+static struct gpt_cache *gpt_cache_create(pu8 *ent_buf, pu32 ent_cnt,
+                                          pu32 ent_sz)
+{
+    struct gpt_cache *cache;
+    pu32 i;
+    pu64 t;
+
+    cache = calloc(1, sizeof(*cache));
+    if(cache == NULL) {
+        return NULL;
+    }
+
+    cache->ent_crc32 = malloc(ent_cnt * sizeof(pcrc32));
+    if(cache->ent_crc32 == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->ent_cnt = ent_cnt;
+    cache->ent_sz = ent_sz;
+    cache->ent_buf = ent_buf;
+
+    t = stats_begin(stats_crc);
+
+    /* Hash each entry */
+    for(i = 0; i < ent_cnt; i++) {
+        cache->ent_crc32[i] = crc32_init();
+        crc32_compute_buf(&cache->ent_crc32[i],
+                          &ent_buf[(size_t) i * ent_sz], ent_sz);
+        crc32_finalize(&cache->ent_crc32[i]);
+    }
+
+    /* Hash the whole entry array in one pass */
+    cache->table_crc32 = crc32_init();
+    crc32_compute_buf(&cache->table_crc32, ent_buf, (size_t) ent_cnt * ent_sz);
+    crc32_finalize(&cache->table_crc32);
+
+    stats_end(stats_crc, t);
+
+    return cache;
+}
+
+static pu32 gpt_cache_ent_sz(const struct gpt_cache *cache)
+{
+    /* Without cache, extension bytes are not known */
+    return cache ? cache->ent_sz : gpt_part_ent_sz;
+}
+
+static void gpt_cache_update(struct gpt_cache *cache, pu32 index,
+                             const pu8 *buf)
+{
+    pu8 *ent_buf;
+    pcrc32 crc32;
+    pu64 tail_sz;
+
+    ent_buf = &cache->ent_buf[(size_t) index * cache->ent_sz];
+
+    /* Entry is not changed */
+    if(memcmp(ent_buf, buf, cache->ent_sz) == 0) {
+        return;
+    }
+
+    crc32 = crc32_init();
+    crc32_compute_buf(&crc32, buf, cache->ent_sz);
+    crc32_finalize(&crc32);
+
+    /* CRC32 is linear, so for equal length arrays, difference of array
+     * CRCs is difference of entry CRCs, shifted by the bytes after entry */
+    tail_sz = (pu64) (cache->ent_cnt - index - 1) * cache->ent_sz;
+    cache->table_crc32 ^= crc32_combine(cache->ent_crc32[index] ^ crc32, 0,
+                                        tail_sz);
+
+    cache->ent_crc32[index] = crc32;
+    memcpy(ent_buf, buf, cache->ent_sz);
+}
+
+static pcrc32 gpt_table_stage(pu8 *buf, const struct gpt_part_ent table[],
+                              pu32 table_len, pu32 ent_sz,
+                              struct gpt_cache *cache)
+{
+    pu32 i;
+    pu8 *ent_buf;
+    pcrc32 crc32;
+    pflag use_cache;
+    pu64 t;
+
+    t = stats_begin(stats_crc);
+
+    /* Without a suitable cache, CRC is computed from scratch */
+    use_cache = cache && cache->ent_cnt == table_len &&
+                cache->ent_sz == ent_sz;
+
+    crc32 = crc32_init();
+
+    /* Serialize each entry and hash it, while it is still hot */
+    for(i = 0; i < table_len; i++) {
+        ent_buf = &buf[(size_t) i * ent_sz];
+
+        /* Extension bytes are kept as they were loaded */
+        if(use_cache) {
+            memcpy(ent_buf + gpt_part_ent_sz,
+                   &cache->ent_buf[(size_t) i * ent_sz + gpt_part_ent_sz],
+                   ent_sz - gpt_part_ent_sz);
+        }
+
+        gpt_part_ent_write(ent_buf, &table[i]);
+
+        if(use_cache) {
+            gpt_cache_update(cache, i, ent_buf);
+        } else {
+            crc32_compute_buf(&crc32, ent_buf, ent_sz);
+        }
+    }
+
+    if(use_cache) {
+        crc32 = cache->table_crc32;
+    } else {
+        crc32_finalize(&crc32);
+    }
+
+    stats_end(stats_crc, t);
+
+    return crc32;
+}
+
+static void gpt_hdr_stage(pu8 *buf, struct gpt_hdr *hdr)
+{
+    gpt_hdr_write(buf, hdr);
+
+    hdr->hdr_crc32 = gpt_hdr_crc_compute(buf, hdr->hdr_sz);
+    write_pu32(buf + 16, hdr->hdr_crc32);
+}
+
 static void gpt_free(struct gpt *gpt)
 {
     free(gpt->table_prim);
     free(gpt->table_sec);
+    free(gpt->ent_buf_prim);
+    free(gpt->ent_buf_sec);
 }
 
-static void gpt_restore(struct gpt *gpt, plba table_dst_lba,
+static pres gpt_restore(struct gpt *gpt, plba table_dst_lba,
                         pflag restore_primary)
 {
-    pu32 i;
-
     struct gpt_hdr *hdr_dst, *hdr_src;
-    struct gpt_part_ent *table_dst, *table_src;
+    struct gpt_part_ent **table_dst, *table_src;
+    pu8 **ent_buf_dst, *ent_buf_src;
+    size_t ent_buf_sz;
 
     if(restore_primary) {
         hdr_dst = &gpt->hdr_prim;
         hdr_src = &gpt->hdr_sec;
-        table_dst = gpt->table_prim;
+        table_dst = &gpt->table_prim;
         table_src = gpt->table_sec;
+        ent_buf_dst = &gpt->ent_buf_prim;
+        ent_buf_src = gpt->ent_buf_sec;
     } else {
         hdr_dst = &gpt->hdr_sec;
         hdr_src = &gpt->hdr_prim;
-        table_dst = gpt->table_sec;
+        table_dst = &gpt->table_sec;
         table_src = gpt->table_prim;
+        ent_buf_dst = &gpt->ent_buf_sec;
+        ent_buf_src = gpt->ent_buf_prim;
+    }
+
+    ent_buf_sz = (size_t) hdr_src->part_table_entry_cnt *
+                 hdr_src->part_entry_sz;
+
+    /* Destination table may be missing or may have a different size */
+    free(*table_dst);
+    free(*ent_buf_dst);
+    *table_dst = malloc(hdr_src->part_table_entry_cnt *
+                        sizeof(struct gpt_part_ent));
+    *ent_buf_dst = malloc(ent_buf_sz);
+    if(*table_dst == NULL || *ent_buf_dst == NULL) {
+        return pres_fail;
     }
 
     memcpy(hdr_dst, hdr_src, sizeof(*hdr_src));
@@ -408,23 +477,43 @@ static void gpt_restore(struct gpt *gpt, plba table_dst_lba,
     hdr_dst->alt_lba = hdr_src->my_lba;
     hdr_dst->part_table_lba = table_dst_lba;
 
-    for(i = 0; i < hdr_src->part_table_entry_cnt; i++) {
-        memcpy(&table_dst[i], &table_src[i], sizeof(table_src[i]));
-    }
+    memcpy(*table_dst, table_src,
+           hdr_src->part_table_entry_cnt * sizeof(struct gpt_part_ent));
+    memcpy(*ent_buf_dst, ent_buf_src, ent_buf_sz);
 
     hdr_dst->hdr_crc32 = gpt_hdr_crc_create(hdr_dst);
+
+    return pres_ok;
 }
 
-static pflag gpt_table_is_valid(const struct gpt_hdr *hdr,
-                         const struct gpt_part_ent table[])
+static pflag gpt_table_is_valid(const struct gpt_hdr *hdr, const pu8 *buf,
+                                const struct img_ctx *img_ctx)
 {
-    return hdr->part_table_crc32 ==
-           gpt_table_crc_create(table, hdr->part_table_entry_cnt);
+    pcrc32 crc32;
+    pu64 t;
+
+    t = stats_begin(stats_crc);
+
+    /* CRC is computed over on-disk bytes, exactly as they are stored */
+    crc32 = crc32_init();
+    crc32_compute_buf_par(&crc32, buf, (size_t) hdr->part_table_entry_cnt *
+                          hdr->part_entry_sz, img_ctx->threads);
+    crc32_finalize(&crc32);
+
+    stats_end(stats_crc, t);
+
+    return hdr->part_table_crc32 == crc32;
 }
 
-static pflag gpt_hdr_is_valid(const struct gpt_hdr *hdr, plba hdr_lba)
+static pflag gpt_hdr_is_valid(const struct gpt_hdr *hdr, const pu8 *buf,
+                              plba hdr_lba, const struct img_ctx *img_ctx)
 {
-    return hdr->hdr_crc32 == gpt_hdr_crc_create(hdr) &&
+    /* Header must fit into a single sector */
+    if(hdr->hdr_sz < gpt_hdr_sz || hdr->hdr_sz > img_ctx->sec_sz) {
+        return 0;
+    }
+
+    return hdr->hdr_crc32 == gpt_hdr_crc_compute(buf, hdr->hdr_sz) &&
            hdr->my_lba == hdr_lba;
 }
 
@@ -438,143 +527,92 @@ static pflag gpt_is_present(const pu8 *buf)
     return 0 == strncmp((const char *) buf, GPT_SIG, ARRAY_SIZE(GPT_SIG) - 1);
 }
 
-static pres
-gpt_pair_save(const struct gpt_hdr *hdr, const struct gpt_part_ent table[],
-              const struct img_ctx *img_ctx)
-{
-    pres save_res;
-    pres res;
-    pu8 *hdr_reg = NULL;
-    pu8 *table_reg = NULL;
-    plba hdr_sz_secs;
-    plba table_sz_secs;
-    plba hdr_lba;
-    plba table_lba;
-
-    /* Get GPT header LBA and size */
-    hdr_lba = hdr->my_lba;
-    hdr_sz_secs = 1;
-
-    /* Map GPT header sector */
-    hdr_reg = map_secs(img_ctx, hdr_lba, hdr_sz_secs);
-    if(hdr_reg == NULL) {
-        plog_err("Failed to map GPT header at sector %llu", hdr_lba);
-        save_res = pres_fail;
-        goto exit;
-    }
-
-    /* Write GPT header */
-    gpt_hdr_write(hdr_reg, hdr);
-
-    /* Get GPT table LBA and size */
-    table_lba = hdr->part_table_lba;
-    table_sz_secs = byte_to_lba(img_ctx, hdr->part_table_entry_cnt *
-                                hdr->part_entry_sz, 1);
-
-    /* Map GPT table sectors */
-    table_reg = map_secs(img_ctx, table_lba, table_sz_secs);
-    if(table_reg == NULL) {
-        plog_err("Failed to map GPT table at sector %llu", table_lba);
-        save_res = pres_fail;
-        goto exit;
-    }
-
-    /* Write GPT table */
-    gpt_table_write(table_reg, table, hdr->part_table_entry_cnt,
-                    hdr->part_entry_sz);
-
-    plog_dbg("Saved GPT: header/table %llu/%llu", hdr_lba, table_lba);
-
-    /* Saved successfully */
-    save_res = pres_ok;
-
-exit:
-    /* If mapped, unmap GPT header sector */
-    if(hdr_reg) {
-        res = unmap_secs(hdr_reg, img_ctx, hdr_lba, hdr_sz_secs);
-        if(!res) {
-            plog_err("Failed to unmap GPT header at sector %llu", hdr_lba);
-            return pres_fail;
-        }
-    }
-
-    /* If mapped, unmap GPT table sectors */
-    if(table_reg) {
-        res = unmap_secs(table_reg, img_ctx, table_lba, table_sz_secs);
-        if(!res) {
-            plog_err("Failed to unmap GPT table at sector %llu", table_lba);
-            return pres_fail;
-        }
-    }
-
-    return save_res;
-}
-
 static enum gpt_pair_load_res
-gpt_pair_load(struct gpt_hdr *hdr, struct gpt_part_ent table[],
-              const struct img_ctx *img_ctx, plba hdr_lba)
+gpt_pair_load(struct gpt_hdr *hdr, struct gpt_part_ent **table,
+              pu8 **ent_buf, const struct img_ctx *img_ctx, plba hdr_lba)
 {
     enum gpt_pair_load_res load_res;
     pres res;
-    pu8 *hdr_reg = NULL;
-    pu8 *table_reg = NULL;
-    plba hdr_sz_secs;
+    pu8 *hdr_buf;
     plba table_sz_secs;
     plba table_lba;
 
-    /* GPT header size */
-    hdr_sz_secs = 1;
+    /* GPT header takes a single sector */
+    hdr_buf = malloc(img_ctx->sec_sz);
+    if(hdr_buf == NULL) {
+        plog_err("Failed to allocate GPT header buffer");
+        return gpt_pair_load_fatal;
+    }
 
-    /* Map GPT header sector */
-    hdr_reg = map_secs(img_ctx, hdr_lba, hdr_sz_secs);
-    if(hdr_reg == NULL) {
-        plog_err("Failed to map GPT header at sector %llu", hdr_lba);
+    /* Read GPT header sector */
+    res = img_read_secs(img_ctx, hdr_lba, 1, hdr_buf);
+    if(!res) {
+        plog_err("Failed to read GPT header at sector %llu", hdr_lba);
         load_res = gpt_pair_load_fatal;
         goto exit;
     }
 
     /* Check GPT header signature */
-    if(!gpt_is_present(hdr_reg)) {
+    if(!gpt_is_present(hdr_buf)) {
         load_res = gpt_pair_load_hdr_inv;
         goto exit;
     }
 
     /* Read GPT header */
-    gpt_hdr_read(hdr_reg, hdr);
+    gpt_hdr_read(hdr_buf, hdr);
 
     /* Check GPT header CRC */
-    if(!gpt_hdr_is_valid(hdr, hdr_lba)) {
+    if(!gpt_hdr_is_valid(hdr, hdr_buf, hdr_lba, img_ctx)) {
         load_res = gpt_pair_load_hdr_inv;
         goto exit;
     }
 
-    if(hdr->part_table_entry_cnt > gpt_max_part_cnt) {
-        plog_err("GPT table partition count (%lu) is greater, than "
-                 "maximum supported (%lu)", hdr->part_table_entry_cnt,
-                 gpt_max_part_cnt);
-        load_res = gpt_pair_load_fatal;
-        goto exit;
-    }
-
     /* Get GPT table LBA and size */
     table_lba = hdr->part_table_lba;
-    table_sz_secs = byte_to_lba(img_ctx, hdr->part_table_entry_cnt *
+    table_sz_secs = byte_to_lba(img_ctx, (pu64) hdr->part_table_entry_cnt *
                                 hdr->part_entry_sz, 1);
 
-    /* Map GPT table sectors */
-    table_reg = map_secs(img_ctx, table_lba, table_sz_secs);
-    if(table_reg == NULL) {
-        plog_err("Failed to map GPT table at sector %llu", table_lba);
+    /* Table must be non-empty, entry size must be a multiple of 128 and
+     * table must fit into the image */
+    if(
+        hdr->part_table_entry_cnt == 0 ||
+        hdr->part_entry_sz < gpt_part_ent_sz ||
+        hdr->part_entry_sz % gpt_part_ent_sz != 0 ||
+        table_lba + table_sz_secs > byte_to_lba(img_ctx, img_ctx->img_sz, 0)
+    ) {
+        plog_warn("GPT header at sector %llu describes invalid partition "
+                  "table (%lu entries of %lu bytes at sector %llu)", hdr_lba,
+                  hdr->part_table_entry_cnt, hdr->part_entry_sz, table_lba);
+        load_res = gpt_pair_load_hdr_inv;
+        goto exit;
+    }
+
+    /* Allocate table to fit all entries, keep on-disk entries as well, since
+     * their extension bytes are not parsed. On-disk entries are read as
+     * a whole number of sectors */
+    *table = calloc(hdr->part_table_entry_cnt, sizeof(struct gpt_part_ent));
+    *ent_buf = malloc(lba_to_byte(img_ctx, table_sz_secs));
+    if(*table == NULL || *ent_buf == NULL) {
+        plog_err("Failed to allocate GPT table of %lu entries",
+                 hdr->part_table_entry_cnt);
+        load_res = gpt_pair_load_fatal;
+        goto exit;
+    }
+
+    /* Read GPT table sectors */
+    res = img_read_secs(img_ctx, table_lba, table_sz_secs, *ent_buf);
+    if(!res) {
+        plog_err("Failed to read GPT table at sector %llu", table_lba);
         load_res = gpt_pair_load_fatal;
         goto exit;
     }
 
     /* Read GPT table */
-    gpt_table_read(table_reg, table, hdr->part_table_entry_cnt,
+    gpt_table_read(*ent_buf, *table, hdr->part_table_entry_cnt,
                    hdr->part_entry_sz);
 
     /* Check GPT table CRC */
-    if(!gpt_table_is_valid(hdr, table)) {
+    if(!gpt_table_is_valid(hdr, *ent_buf, img_ctx)) {
         load_res = gpt_pair_load_table_inv;
         goto exit;
     }
@@ -585,46 +623,90 @@ gpt_pair_load(struct gpt_hdr *hdr, struct gpt_part_ent table[],
     load_res = gpt_pair_load_ok;
 
 exit:
-    /* If mapped, unmap GPT header sector */
-    if(hdr_reg) {
-        res = unmap_secs(hdr_reg, img_ctx, hdr_lba, hdr_sz_secs);
-        if(!res) {
-            plog_err("Failed to unmap GPT header at sector %llu", hdr_lba);
-            return gpt_pair_load_fatal;
-        }
-    }
-
-    /* If mapped, unmap GPT table sectors */
-    if(table_reg) {
-        res = unmap_secs(table_reg, img_ctx, table_lba, table_sz_secs);
-        if(!res) {
-            plog_err("Failed to unmap GPT table at sector %llu", table_lba);
-            return gpt_pair_load_fatal;
-        }
-    }
+    free(hdr_buf);
 
     return load_res;
 }
 
-static pres gpt_save(const struct gpt *gpt, const struct img_ctx *img_ctx)
+static pres gpt_save(struct gpt *gpt, struct gpt_cache *cache,
+                     const struct img_ctx *img_ctx)
 {
     pres res;
+    pu8 *buf;
+    pu8 *hdr_sec_buf;
+    plba table_sz_secs;
+    plba table_lba_sec;
+    pu64 sec_sz;
+
+    sec_sz = img_ctx->sec_sz;
+    table_sz_secs = byte_to_lba(img_ctx, gpt->hdr_prim.part_table_entry_cnt *
+                                gpt->hdr_prim.part_entry_sz, 1);
+
+    /* Staging buffer holds primary header, partition entry array and
+     * secondary header. Primary GPT is its first (table_sz_secs + 1) sectors,
+     * secondary GPT is its last (table_sz_secs + 1) sectors */
+    buf = calloc(table_sz_secs + 2, sec_sz);
+    if(buf == NULL) {
+        plog_err("Failed to allocate GPT staging buffer");
+        return pres_fail;
+    }
+
+    /* Serialize partition entry array and compute its CRC in one pass */
+    gpt->hdr_prim.part_table_crc32 =
+        gpt_table_stage(buf + sec_sz, gpt->table_prim,
+                        gpt->hdr_prim.part_table_entry_cnt,
+                        gpt->hdr_prim.part_entry_sz, cache);
+
+    /* Serialize primary header */
+    gpt_hdr_stage(buf, &gpt->hdr_prim);
+
+    /* Secondary header is the primary one with swapped LBA fields */
+    table_lba_sec = gpt->hdr_prim.alt_lba - table_sz_secs;
+    hdr_sec_buf = buf + lba_to_byte(img_ctx, table_sz_secs + 1);
+
+    memcpy(hdr_sec_buf, buf, sec_sz);
+    write_pu64(hdr_sec_buf + 24, gpt->hdr_prim.alt_lba);
+    write_pu64(hdr_sec_buf + 32, gpt->hdr_prim.my_lba);
+    write_pu64(hdr_sec_buf + 72, table_lba_sec);
+    write_pu32(hdr_sec_buf + 16,
+               gpt_hdr_crc_compute(hdr_sec_buf, gpt->hdr_prim.hdr_sz));
 
     /* UEFI specification requires to update secondary GPT first */
-    res = gpt_pair_save(&gpt->hdr_sec, gpt->table_sec, img_ctx);
-    if(!res) {
-        return pres_fail;
+    res = img_write_secs(img_ctx, table_lba_sec, table_sz_secs + 1,
+                         buf + sec_sz);
+    if(res) {
+        res = img_write_secs(img_ctx, gpt->hdr_prim.my_lba, table_sz_secs + 1,
+                             buf);
     }
 
-    res = gpt_pair_save(&gpt->hdr_prim, gpt->table_prim, img_ctx);
+    free(buf);
+
     if(!res) {
+        plog_err("Failed to save GPT");
         return pres_fail;
     }
 
-    plog_dbg("Saved GPT");
+    plog_dbg("Saved GPT: sectors %llu-%llu and %llu-%llu",
+             gpt->hdr_prim.my_lba, gpt->hdr_prim.my_lba + table_sz_secs,
+             table_lba_sec, table_lba_sec + table_sz_secs);
+
     return pres_ok;
 }
 
+static enum schem_gpt_copy gpt_copy_status(enum gpt_pair_load_res res)
+{
+    switch(res) {
+        case gpt_pair_load_ok:
+            return schem_gpt_copy_ok;
+
+        case gpt_pair_load_table_inv:
+            return schem_gpt_copy_table_inv;
+
+        default:
+            return schem_gpt_copy_hdr_inv;
+    }
+}
+
 static enum schem_load_res
 gpt_load(struct gpt *gpt, const struct img_ctx *img_ctx)
 {
@@ -633,9 +715,13 @@ gpt_load(struct gpt *gpt, const struct img_ctx *img_ctx)
     enum gpt_pair_load_res gpt_res_sec;
     plba gpt_lba_sec;
     plba gpt_table_lba;
+    pu64 t;
 
     /* Load primary GPT, located at LBA 1 */
-    gpt_res_prim = gpt_pair_load(&gpt->hdr_prim, gpt->table_prim, img_ctx, 1);
+    t = stats_begin(stats_gpt_pair_load);
+    gpt_res_prim = gpt_pair_load(&gpt->hdr_prim, &gpt->table_prim,
+                                 &gpt->ent_buf_prim, img_ctx, 1);
+    stats_end(stats_gpt_pair_load, t);
     if(gpt_res_prim == gpt_pair_load_fatal) {
         plog_err("Error while loading primary GPT");
         res = schem_load_fatal;
@@ -651,14 +737,19 @@ gpt_load(struct gpt *gpt, const struct img_ctx *img_ctx)
     }
 
     /* Load secondary GPT */
-    gpt_res_sec = gpt_pair_load(&gpt->hdr_sec, gpt->table_sec, img_ctx,
-                                gpt_lba_sec);
+    t = stats_begin(stats_gpt_pair_load);
+    gpt_res_sec = gpt_pair_load(&gpt->hdr_sec, &gpt->table_sec,
+                                &gpt->ent_buf_sec, img_ctx, gpt_lba_sec);
+    stats_end(stats_gpt_pair_load, t);
     if(gpt_res_sec == gpt_pair_load_fatal) {
         plog_err("Error while loading secondary GPT");
         res = schem_load_fatal;
         goto exit;
     }
 
+    gpt->copy_status[0] = gpt_copy_status(gpt_res_prim);
+    gpt->copy_status[1] = gpt_copy_status(gpt_res_sec);
+
     /* Both GPTs are not present or are corrupted */
     if(gpt_res_prim != gpt_pair_load_ok && gpt_res_sec != gpt_pair_load_ok) {
         res = schem_load_not_found;
@@ -676,9 +767,8 @@ gpt_load(struct gpt *gpt, const struct img_ctx *img_ctx)
                                     gpt->hdr_prim.part_table_entry_cnt *
                                     gpt->hdr_prim.part_entry_sz, 1);
         /* Restore secondary GPT */
-        gpt_restore(gpt, gpt_table_lba, 0);
-
-        res = schem_load_ok;
+        res = gpt_restore(gpt, gpt_table_lba, 0) ? schem_load_ok
+                                                  : schem_load_fatal;
         goto exit;
     }
 
@@ -691,9 +781,8 @@ gpt_load(struct gpt *gpt, const struct img_ctx *img_ctx)
         gpt_table_lba = gpt->hdr_sec.alt_lba + 1;
 
         /* Restore primary GPT */
-        gpt_restore(gpt, gpt_table_lba, 1);
-
-        res = schem_load_ok;
+        res = gpt_restore(gpt, gpt_table_lba, 1) ? schem_load_ok
+                                                  : schem_load_fatal;
         goto exit;
     }
 
@@ -709,7 +798,7 @@ exit:
     return res;
 }
 
-static void gpt_calc_pos(const struct img_ctx *img_ctx,
+static void gpt_calc_pos(const struct img_ctx *img_ctx, pu32 part_cnt,
                          plba *hdr_lba_prim, plba *hdr_lba_sec,
                          plba *table_lba_prim, plba *table_lba_sec,
                          plba *table_sz)
@@ -722,7 +811,7 @@ static void gpt_calc_pos(const struct img_ctx *img_ctx,
 
     if(table_sz && table_lba_prim && table_lba_sec) {
         /* GPT table size */
-        *table_sz = byte_to_lba(img_ctx, gpt_max_part_cnt * gpt_part_ent_sz,
+        *table_sz = byte_to_lba(img_ctx, (pu64) part_cnt * gpt_part_ent_sz,
                                 1);
 
         /* Primary GPT table is located after primary GPT header */
@@ -734,7 +823,7 @@ static void gpt_calc_pos(const struct img_ctx *img_ctx,
 }
 
 static void gpt_from_schem(const struct schem *schem, struct gpt *gpt,
-                           const struct img_ctx *img_ctx)
+                           pu32 ent_sz, const struct img_ctx *img_ctx)
 {
     plba hdr_lba_prim;
     plba hdr_lba_sec;
@@ -745,8 +834,8 @@ static void gpt_from_schem(const struct schem *schem, struct gpt *gpt,
     struct gpt_part_ent *part_gpt;
     const struct schem_part *part;
 
-    gpt_calc_pos(img_ctx, &hdr_lba_prim, &hdr_lba_sec, &table_lba_prim,
-                 &table_lba_sec, &table_sz);
+    gpt_calc_pos(img_ctx, schem->part_cnt, &hdr_lba_prim, &hdr_lba_sec,
+                 &table_lba_prim, &table_lba_sec, &table_sz);
 
     /* Convert scheme details */
     gpt->hdr_prim.rev = gpt_hdr_rev;
@@ -757,7 +846,7 @@ static void gpt_from_schem(const struct schem *schem, struct gpt *gpt,
     gpt->hdr_prim.last_usable_lba = schem->last_usable_lba;
     gpt->hdr_prim.part_table_lba = table_lba_prim;
     gpt->hdr_prim.part_table_entry_cnt = schem->part_cnt;
-    gpt->hdr_prim.part_entry_sz = gpt_part_ent_sz;
+    gpt->hdr_prim.part_entry_sz = ent_sz;
 
     memcpy(&gpt->hdr_prim.disk_guid, &schem->id.guid, sizeof(struct guid));
 
@@ -781,32 +870,27 @@ static void gpt_from_schem(const struct schem *schem, struct gpt *gpt,
         memcpy(&part_gpt->name, &part->name, sizeof(part_gpt->name));
     }
 
-    /* Compute GPT table CRC */
-    gpt->hdr_prim.part_table_crc32 =
-        gpt_table_crc_create(gpt->table_prim,
-                             gpt->hdr_prim.part_table_entry_cnt);
-
-    /* Compute GPT header CRC */
-    gpt->hdr_prim.hdr_crc32 = gpt_hdr_crc_create(&gpt->hdr_prim);
-
-    /* Restore GPT secondary header and table */
-    gpt_restore(gpt, table_lba_sec, 0);
+    /* Header and table CRCs are computed, when GPT is serialized */
 }
 
-static void gpt_to_schem(struct schem *schem, const struct gpt *gpt)
+static pres gpt_to_schem(struct schem *schem, const struct gpt *gpt)
 {
     pu32 i;
     const struct gpt_part_ent *part_gpt;
     struct schem_part *part;
+    pres res;
+
+    /* Allocate scheme table to fit all GPT entries */
+    res = schem_table_alloc(schem, gpt->hdr_prim.part_table_entry_cnt);
+    if(!res) {
+        return pres_fail;
+    }
 
     /* Convert scheme details */
     schem->type = schem_type_gpt;
     memcpy(&schem->id.guid, &gpt->hdr_prim.disk_guid, sizeof(struct guid));
     schem->first_usable_lba = gpt->hdr_prim.first_usable_lba;
     schem->last_usable_lba = gpt->hdr_prim.last_usable_lba;
-    schem->part_cnt = gpt->hdr_prim.part_table_entry_cnt;
-
-    memset(schem->table, 0, sizeof(*schem->table) * schem->part_cnt);
 
     /* Convert partitions */
     for(i = 0; i < schem->part_cnt; i++) {
@@ -828,26 +912,56 @@ static void gpt_to_schem(struct schem *schem, const struct gpt *gpt)
 
         memcpy(&part->name, &part_gpt->name, sizeof(part_gpt->name));
     }
+
+    return pres_ok;
 }
 
-void schem_init_gpt(struct schem *schem, const struct img_ctx *img_ctx)
+pres schem_init_gpt(struct schem *schem, const struct img_ctx *img_ctx)
 {
     plba hdr_lba_prim;
     plba hdr_lba_sec;
     plba table_lba_prim;
     plba table_lba_sec;
     plba table_sz;
+    pu8 *ent_buf;
+    pres res;
 
-    gpt_calc_pos(img_ctx, &hdr_lba_prim, &hdr_lba_sec, &table_lba_prim,
-                 &table_lba_sec, &table_sz);
+    gpt_calc_pos(img_ctx, img_ctx->gpt_part_cnt, &hdr_lba_prim, &hdr_lba_sec,
+                 &table_lba_prim, &table_lba_sec, &table_sz);
+
+    /* Protective MBR, both headers, both tables and at least one usable
+     * sector must fit into the image */
+    if(table_sz * 2 + 3 >= hdr_lba_sec + 1) {
+        plog_err("GPT with %lu partition entries does not fit into the "
+                 "image", img_ctx->gpt_part_cnt);
+        return pres_fail;
+    }
+
+    res = schem_table_alloc(schem, img_ctx->gpt_part_cnt);
+    if(!res) {
+        return pres_fail;
+    }
 
     schem->type = schem_type_gpt;
     schem->first_usable_lba = table_lba_prim + table_sz;
     schem->last_usable_lba = table_lba_sec - 1;
-    schem->part_cnt = gpt_max_part_cnt;
     guid_create(&schem->id.guid);
 
-    memset(schem->table, 0, sizeof(*schem->table) * schem->part_cnt);
+    /* Empty table cache. On allocation failure, table CRC is computed from
+     * scratch on save */
+    gpt_cache_free(schem->priv);
+    schem->priv = NULL;
+
+    ent_buf = calloc(schem->part_cnt, gpt_part_ent_sz);
+    if(ent_buf) {
+        schem->priv = gpt_cache_create(ent_buf, schem->part_cnt,
+                                       gpt_part_ent_sz);
+    }
+    if(schem->priv == NULL) {
+        free(ent_buf);
+    }
+
+    return pres_ok;
 }
 
 void schem_part_init_gpt(struct schem_part *part)
@@ -862,30 +976,72 @@ pflag schem_part_is_used_gpt(const struct schem_part *part)
     return !guid_is_zero(&part->type.guid);
 }
 
+pu32 schem_probe_gpt(const struct img_ctx *img_ctx, struct img_range *ranges)
+{
+    plba hdr_lba_prim;
+    plba hdr_lba_sec;
+    plba table_lba_prim;
+    plba table_lba_sec;
+    plba table_sz;
+
+    /* Headers and tables at their usual locations. Tables, located
+     * elsewhere, are read on load */
+    gpt_calc_pos(img_ctx, img_ctx->gpt_part_cnt, &hdr_lba_prim, &hdr_lba_sec,
+                 &table_lba_prim, &table_lba_sec, &table_sz);
+
+    ranges[0].lba = hdr_lba_prim;
+    ranges[0].secs_cnt = table_sz + 1;
+
+    ranges[1].lba = table_lba_sec;
+    ranges[1].secs_cnt = table_sz + 1;
+
+    return 2;
+}
+
 enum schem_load_res
 schem_load_gpt(struct schem *schem, const struct img_ctx *img_ctx)
 {
     struct gpt gpt;
     enum schem_load_res res;
+    pres res_conv;
+    pu64 t;
 
+    /* Tables are allocated, when GPT headers are loaded */
     memset(&gpt, 0, sizeof(gpt));
 
-    /* Allocate tables */
-    gpt.table_prim = calloc(gpt_max_part_cnt, sizeof(struct gpt_part_ent));
-    gpt.table_sec = calloc(gpt_max_part_cnt, sizeof(struct gpt_part_ent));
-
-    if(gpt.table_prim == NULL || gpt.table_sec == NULL) {
-        return schem_load_fatal;
-    }
-
     /* Load GPT */
+    trace_begin("gpt_load");
     res = gpt_load(&gpt, img_ctx);
+    trace_end("gpt_load");
     if(res != schem_load_ok) {
         goto exit;
     }
 
     /* Convert GPT to general scheme */
-    gpt_to_schem(schem, &gpt);
+    t = stats_begin(stats_schem_conv);
+    res_conv = gpt_to_schem(schem, &gpt);
+    stats_end(stats_schem_conv, t);
+
+    if(!res_conv) {
+        res = schem_load_fatal;
+        goto exit;
+    }
+
+    /* Cache loaded table CRC and entry extension bytes. Cache takes the
+     * loaded entry array as is */
+    gpt_cache_free(schem->priv);
+    schem->priv = gpt_cache_create(gpt.ent_buf_prim,
+                                   gpt.hdr_prim.part_table_entry_cnt,
+                                   gpt.hdr_prim.part_entry_sz);
+    if(schem->priv == NULL) {
+        plog_err("Failed to allocate GPT table cache");
+        res = schem_load_fatal;
+        goto exit;
+    }
+    gpt.ent_buf_prim = NULL;
+
+    memcpy(((struct gpt_cache *) schem->priv)->copy_status, gpt.copy_status,
+           sizeof(gpt.copy_status));
 
     res = schem_load_ok;
 
@@ -899,23 +1055,36 @@ exit:
 pres schem_save_gpt(const struct schem *schem, const struct img_ctx *img_ctx)
 {
     struct gpt gpt;
+    struct gpt_cache *cache;
     pres res;
+    pu64 t;
 
     memset(&gpt, 0, sizeof(gpt));
 
-    /* Allocate tables */
-    gpt.table_prim = calloc(gpt_max_part_cnt, sizeof(struct gpt_part_ent));
-    gpt.table_sec = calloc(gpt_max_part_cnt, sizeof(struct gpt_part_ent));
+    /* Allocate primary table. Secondary GPT is derived from the primary one
+     * while serializing */
+    gpt.table_prim = calloc(schem->part_cnt, sizeof(struct gpt_part_ent));
 
-    if(gpt.table_prim == NULL || gpt.table_sec == NULL) {
+    if(gpt.table_prim == NULL) {
         return pres_fail;
     }
 
     /* Convert general scheme to GPT */
-    gpt_from_schem(schem, &gpt, img_ctx);
+    t = stats_begin(stats_schem_conv);
+    gpt_from_schem(schem, &gpt, gpt_cache_ent_sz(schem->priv), img_ctx);
+    stats_end(stats_schem_conv, t);
 
     /* Save GPT */
-    res = gpt_save(&gpt, img_ctx);
+    trace_begin("gpt_save");
+    res = gpt_save(&gpt, schem->priv, img_ctx);
+    trace_end("gpt_save");
+
+    /* Both copies are written from the same data */
+    if(res && schem->priv) {
+        cache = schem->priv;
+        cache->copy_status[0] = schem_gpt_copy_ok;
+        cache->copy_status[1] = schem_gpt_copy_ok;
+    }
 
     /* Free tables */
     gpt_free(&gpt);
@@ -923,50 +1092,135 @@ pres schem_save_gpt(const struct schem *schem, const struct img_ctx *img_ctx)
     return res;
 }
 
+static pres gpt_hdr_erase(const struct img_ctx *img_ctx, plba hdr_lba)
+{
+    pu8 *hdr_buf;
+    pres res;
+
+    hdr_buf = malloc(img_ctx->sec_sz);
+    if(hdr_buf == NULL) {
+        return pres_fail;
+    }
+
+    /* Rewrite GPT header sector without signature */
+    res = img_read_secs(img_ctx, hdr_lba, 1, hdr_buf);
+    if(res) {
+        gpt_hdr_erase_sig(hdr_buf);
+        res = img_write_secs(img_ctx, hdr_lba, 1, hdr_buf);
+    }
+
+    free(hdr_buf);
+
+    if(!res) {
+        plog_err("Failed to erase GPT header signature at sector %llu",
+                 hdr_lba);
+        return pres_fail;
+    }
+
+    return pres_ok;
+}
+
 pres schem_remove_gpt(const struct img_ctx *img_ctx)
 {
     plba hdr_lba_prim;
     plba hdr_lba_sec;
-    pu8 *hdr_reg;
-    pres res;
 
-    gpt_calc_pos(img_ctx, &hdr_lba_prim, &hdr_lba_sec, NULL, NULL, NULL);
+    gpt_calc_pos(img_ctx, 0, &hdr_lba_prim, &hdr_lba_sec, NULL, NULL, NULL);
 
-    /* Map first sector of GPT primary header */
-    hdr_reg = map_secs(img_ctx, hdr_lba_prim, 1);
-    if(hdr_reg == NULL) {
-        plog_err("Failed to map GPT header at sector %llu to erase sig",
-                 hdr_lba_prim);
+    if(!gpt_hdr_erase(img_ctx, hdr_lba_prim)) {
         return pres_fail;
     }
 
-    gpt_hdr_erase_sig(hdr_reg);
+    return gpt_hdr_erase(img_ctx, hdr_lba_sec);
+}
+
+void schem_release_gpt(struct schem *schem)
+{
+    gpt_cache_free(schem->priv);
+    schem->priv = NULL;
+}
 
-    /* Unmap first sector of GPT primary header */
-    res = unmap_secs(hdr_reg, img_ctx, hdr_lba_prim, 1);
-    if(!res) {
-        plog_err("Failed to unmap GPT header at sector %llu to erase sig",
-                 hdr_lba_prim);
+pres schem_regen_gpt(struct schem_blob *blob,
+                      const struct schem_regen *regen)
+{
+    struct gpt_hdr hdr;
+    struct guid guid;
+    pu8 *hdr_buf[2];
+    pu8 *table_buf[2];
+    plba table_sz;
+    pu64 table_len;
+    pcrc32 crc32;
+    pu32 i;
+    int j;
+
+    /* Primary header is located at LBA 1, the secondary one is found by
+     * its alternate LBA field */
+    hdr_buf[0] = schem_blob_secs(blob, 1, 1);
+    if(hdr_buf[0] == NULL) {
         return pres_fail;
     }
 
-    /* Map first sector of GPT secondary header */
-    hdr_reg = map_secs(img_ctx, hdr_lba_sec, 1);
-    if(hdr_reg == NULL) {
-        plog_err("Failed to map GPT header at sector %llu", hdr_lba_sec);
+    gpt_hdr_read(hdr_buf[0], &hdr);
+
+    hdr_buf[1] = schem_blob_secs(blob, hdr.alt_lba, 1);
+    if(hdr_buf[1] == NULL) {
         return pres_fail;
     }
 
-    gpt_hdr_erase_sig(hdr_reg);
+    table_len = (pu64) hdr.part_table_entry_cnt * hdr.part_entry_sz;
+    table_sz = (table_len + blob->sec_sz - 1) / blob->sec_sz;
 
-    /* Unmap first sector of GPT secondary header */
-    res = unmap_secs(hdr_reg, img_ctx, hdr_lba_sec, 1);
-    if(!res) {
-        plog_err("Failed to unmap GPT header at sector %llu to erase sig",
-                 hdr_lba_sec);
+    table_buf[0] = schem_blob_secs(blob, hdr.part_table_lba, table_sz);
+    table_buf[1] = schem_blob_secs(blob, read_pu64(hdr_buf[1] + 72), table_sz);
+    if(table_buf[0] == NULL || table_buf[1] == NULL) {
         return pres_fail;
     }
 
-    return res;
+    /* New partition GUIDs, same in both tables */
+    for(i = 0; i < hdr.part_table_entry_cnt; i++) {
+        guid_read(table_buf[0] + (size_t) i * hdr.part_entry_sz, &guid);
+        if(guid_is_zero(&guid)) {
+            continue;
+        }
+
+        if(i < regen->keep_part_cnt && regen->keep_part_ids[i]) {
+            continue;
+        }
+
+        guid_create(&guid);
+        for(j = 0; j < 2; j++) {
+            guid_write(table_buf[j] + (size_t) i * hdr.part_entry_sz + 16,
+                       &guid);
+        }
+    }
+
+    crc32 = crc32_init();
+    crc32_compute_buf(&crc32, table_buf[0], table_len);
+    crc32_finalize(&crc32);
+
+    /* New disk GUID and checksums */
+    guid_create(&guid);
+    for(j = 0; j < 2; j++) {
+        if(!regen->keep_id) {
+            guid_write(hdr_buf[j] + 56, &guid);
+        }
+        write_pu32(hdr_buf[j] + 88, crc32);
+        write_pu32(hdr_buf[j] + 16,
+                   gpt_hdr_crc_compute(hdr_buf[j], hdr.hdr_sz));
+    }
+
+    return pres_ok;
 }
 
+enum schem_gpt_copy
+schem_gpt_copy_status(const struct schem *schem, pflag is_sec)
+{
+    const struct gpt_cache *cache;
+
+    cache = schem->priv;
+    if(cache == NULL) {
+        return schem_gpt_copy_unknown;
+    }
+
+    return cache->copy_status[is_sec ? 1 : 0];
+}
@@ -5,21 +5,13 @@
 #include "memutils.h"
 #include "rand.h"
 
-void guid_create(struct guid *guid)
-{
-    /* Create a random Version 4 Variant 2 GUID */
-    int i;
-
-    guid->time_lo       = rand_32();
-    guid->time_mid      = rand_16();
-    guid->time_hi_ver   = rand_16();
-    guid->cl_seq_hi_res = rand_8();
-    guid->cl_seq_lo     = rand_8();
-
-    for(i = 0; i < ARRAY_SIZE(guid->nodes); i++) {
-        guid->nodes[i] = rand_8();
-    }
+enum {
+    /* Number of GUIDs, which random bytes are generated for at once */
+    guid_batch_cnt = 64
+};
 
+static void guid_set_ver(struct guid *guid)
+{
     /* Version 4 */
     guid->time_hi_ver &= ~(0xF << 12);
     guid->time_hi_ver |=  (0x4 << 12);
@@ -29,6 +21,33 @@ void guid_create(struct guid *guid)
     guid->cl_seq_hi_res |=  (0x6 << 5);
 }
 
+void guid_create(struct guid *guid)
+{
+    /* Create a random Version 4 Variant 2 GUID */
+    guid_create_n(guid, 1);
+}
+
+void guid_create_n(struct guid *guids, pu32 cnt)
+{
+    pu8 buf[guid_batch_cnt * guid_sz];
+    pu32 batch;
+    pu32 i;
+
+    while(cnt > 0) {
+        batch = cnt < guid_batch_cnt ? cnt : guid_batch_cnt;
+
+        rand_fill(buf, batch * guid_sz);
+
+        for(i = 0; i < batch; i++) {
+            guid_read(buf + i * guid_sz, &guids[i]);
+            guid_set_ver(&guids[i]);
+        }
+
+        guids += batch;
+        cnt -= batch;
+    }
+}
+
 void guid_read(const pu8 *buf, struct guid *guid)
 {
     int i;
@@ -1,29 +1,262 @@
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "img_ctx.h"
+#include "img_uring.h"
 #include "log.h"
+#include "stats.h"
+#include "trace.h"
 
 enum {
     /* Minimum image size, in bytes - 512KiB */
-    img_min_sz = 1024*512
+    img_min_sz = 1024*512,
+
+    /* Initial number of sector cache buckets, must be power of 2 */
+    img_cache_bucket_cnt = 64,
+
+    /* Maximum number of buffers per write (IOV_MAX on Linux) */
+    img_iov_max = 1024,
+
+    /* Number of io_uring submission queue entries */
+    img_uring_depth = 64
 };
 
-void img_ctx_init(struct img_ctx *ctx, const char *img_name, int img_fd,
-                  pu64 img_sz)
+/* Cached image sector */
+struct img_sec {
+    /* Sector LBA */
+    plba lba;
+
+    /* Sector was written since the last flush */
+    pflag written;
+
+    /* Sector data differs from the on-disk one and is not flushed yet */
+    pflag dirty;
+
+    /* On-disk sector data is known */
+    pflag on_disk;
+
+    /* Sector data */
+    pu8 *buf;
+
+    /* On-disk sector data, used to skip writes of unchanged sectors */
+    pu8 *disk_buf;
+
+    /* Next sector in the same bucket */
+    struct img_sec *next;
+};
+
+/* Image sector cache, keyed by LBA */
+struct img_cache {
+    /* Hash table buckets */
+    struct img_sec **buckets;
+
+    /* Number of hash table buckets */
+    pu32 bucket_cnt;
+
+    /* Number of cached sectors */
+    pu32 sec_cnt;
+};
+
+static int img_sec_cmp(const void *a, const void *b)
+{
+    plba lba_a = (*(struct img_sec * const *) a)->lba;
+    plba lba_b = (*(struct img_sec * const *) b)->lba;
+
+    return lba_a < lba_b ? -1 : lba_a > lba_b;
+}
+
+static struct img_sec *img_cache_find(const struct img_cache *cache, plba lba)
+{
+    struct img_sec *sec;
+
+    if(cache->bucket_cnt == 0) {
+        return NULL;
+    }
+
+    sec = cache->buckets[lba & (cache->bucket_cnt - 1)];
+    while(sec && sec->lba != lba) {
+        sec = sec->next;
+    }
+
+    return sec;
+}
+
+static pres img_cache_grow(struct img_cache *cache)
+{
+    struct img_sec **buckets;
+    struct img_sec *sec, *next;
+    pu32 bucket_cnt;
+    pu32 i;
+
+    bucket_cnt = cache->bucket_cnt ? cache->bucket_cnt * 2
+                                   : img_cache_bucket_cnt;
+
+    buckets = calloc(bucket_cnt, sizeof(*buckets));
+    if(buckets == NULL) {
+        return pres_fail;
+    }
+
+    /* Move cached sectors to new buckets */
+    for(i = 0; i < cache->bucket_cnt; i++) {
+        for(sec = cache->buckets[i]; sec; sec = next) {
+            next = sec->next;
+            sec->next = buckets[sec->lba & (bucket_cnt - 1)];
+            buckets[sec->lba & (bucket_cnt - 1)] = sec;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_cnt = bucket_cnt;
+
+    return pres_ok;
+}
+
+static struct img_sec *img_cache_insert(struct img_cache *cache, plba lba,
+                                        pu64 sec_sz)
+{
+    struct img_sec *sec;
+    pres res;
+
+    /* Keep average bucket length below 2 */
+    if(cache->sec_cnt >= cache->bucket_cnt * 2) {
+        res = img_cache_grow(cache);
+        if(!res) {
+            return NULL;
+        }
+    }
+
+    /* Sector data and on-disk data are allocated together with the sector */
+    sec = malloc(sizeof(*sec) + sec_sz * 2);
+    if(sec == NULL) {
+        return NULL;
+    }
+
+    sec->lba = lba;
+    sec->written = 0;
+    sec->dirty = 0;
+    sec->on_disk = 0;
+    sec->buf = (pu8 *) (sec + 1);
+    sec->disk_buf = sec->buf + sec_sz;
+    sec->next = cache->buckets[lba & (cache->bucket_cnt - 1)];
+
+    cache->buckets[lba & (cache->bucket_cnt - 1)] = sec;
+    cache->sec_cnt++;
+
+    return sec;
+}
+
+static void img_cache_free(struct img_cache *cache)
+{
+    struct img_sec *sec, *next;
+    pu32 i;
+
+    for(i = 0; i < cache->bucket_cnt; i++) {
+        for(sec = cache->buckets[i]; sec; sec = next) {
+            next = sec->next;
+            free(sec);
+        }
+    }
+
+    free(cache->buckets);
+    free(cache);
+}
+
+static pres img_ctx_init_common(struct img_ctx *ctx, const char *img_name)
 {
     memset(ctx, 0, sizeof(*ctx));
 
+    ctx->cache = calloc(1, sizeof(*ctx->cache));
+    if(ctx->cache == NULL) {
+        return pres_fail;
+    }
+
     ctx->img_name = img_name;
-    ctx->img_fd = img_fd;
-    ctx->img_sz = img_sz;
+    ctx->img_fd = -1;
 
     /* Default values */
     ctx->sec_sz = 512;                       /* 512 bytes per sector   */
     ctx->align  = 1024*1024*1 / ctx->sec_sz; /* 1 MiB alignment        */
     ctx->hpc    = 255;                       /* 255 heads per cylinder */
     ctx->spt    = 63;                        /* 63 sectors per track   */
+    ctx->threads = 1;                        /* Single thread          */
+    ctx->gpt_part_cnt = 128;                 /* 128 GPT entries        */
+
+    return pres_ok;
+}
+
+pres img_ctx_init(struct img_ctx *ctx, const char *img_name, int img_fd,
+                  pu64 img_sz)
+{
+    if(!img_ctx_init_common(ctx, img_name)) {
+        return pres_fail;
+    }
+
+    ctx->ops = &img_file_ops;
+    ctx->img_fd = img_fd;
+    ctx->img_sz = img_sz;
+
+    return pres_ok;
+}
+
+pres img_ctx_init_mem(struct img_ctx *ctx, const char *img_name, pu8 *buf,
+                      pu64 buf_sz)
+{
+    if(!img_ctx_init_common(ctx, img_name)) {
+        return pres_fail;
+    }
+
+    ctx->ops = &img_mem_ops;
+    ctx->priv = buf;
+    ctx->img_sz = buf_sz;
+
+    return pres_ok;
+}
+
+pres img_ctx_init_ops(struct img_ctx *ctx, const char *img_name,
+                      const struct img_ops *ops, void *priv)
+{
+    if(!img_ctx_init_common(ctx, img_name)) {
+        return pres_fail;
+    }
+
+    ctx->ops = ops;
+    ctx->priv = priv;
+    ctx->img_sz = ops->size(ctx);
+
+    return pres_ok;
+}
+
+void img_ctx_free(struct img_ctx *ctx)
+{
+    if(ctx->cache) {
+        img_cache_free(ctx->cache);
+        ctx->cache = NULL;
+    }
+
+    img_uring_free(ctx->uring);
+    ctx->uring = NULL;
+}
+
+void img_ctx_uring_enable(struct img_ctx *ctx)
+{
+    if(ctx->uring) {
+        return;
+    }
+
+    /* io_uring works with file descriptors only */
+    if(ctx->ops != &img_file_ops) {
+        plog_info("io_uring is only supported for image files");
+        return;
+    }
+
+    trace_begin("img_uring_create");
+    ctx->uring = img_uring_create(img_uring_depth);
+    trace_end("img_uring_create");
+    if(ctx->uring == NULL) {
+        plog_info("io_uring is not available, synchronous I/O is used");
+    }
 }
 
 pres img_ctx_validate(const struct img_ctx *ctx)
@@ -55,20 +288,372 @@ pres img_ctx_validate(const struct img_ctx *ctx)
         return pres_fail;
     }
 
+    if(ctx->threads < 1) {
+        plog_err("Thread count must be at least 1");
+        return pres_fail;
+    }
+
+    if(ctx->gpt_part_cnt < 1) {
+        plog_err("GPT partition entry count must be at least 1");
+        return pres_fail;
+    }
+
     return pres_ok;
 
 }
 
-pres img_ctx_sync(const struct img_ctx *ctx)
+static void img_flush_plan(const struct img_ctx *ctx, struct img_sec **secs,
+                           pu32 secs_cnt, struct iovec *iov,
+                           struct img_io *ios, pu32 *ios_cnt)
+{
+    pu32 start, end;
+    pu32 i;
+    plba mid_lba;
+    pflag backup_seen;
+
+    mid_lba = byte_to_lba(ctx, ctx->img_sz, 0) / 2;
+    backup_seen = 0;
+
+    /* Runs of contiguous sectors are planned from the image end to its
+     * start, so backup structures (secondary GPT) are updated before
+     * primary ones */
+    *ios_cnt = 0;
+    end = secs_cnt;
+    while(end > 0) {
+        start = end - 1;
+        while(
+            start > 0 && end - start < img_iov_max &&
+            secs[start - 1]->lba + 1 == secs[start]->lba
+        ) {
+            start--;
+        }
+
+        for(i = start; i < end; i++) {
+            iov[i].iov_base = secs[i]->buf;
+            iov[i].iov_len = ctx->sec_sz;
+        }
+
+        ios[*ios_cnt].iov = &iov[start];
+        ios[*ios_cnt].iov_cnt = end - start;
+        ios[*ios_cnt].off = lba_to_byte(ctx, secs[start]->lba);
+        ios[*ios_cnt].write = 1;
+        ios[*ios_cnt].res = 0;
+
+        /* First write to the image first half waits for backup writes */
+        ios[*ios_cnt].barrier = backup_seen && secs[start]->lba < mid_lba;
+        backup_seen = secs[start]->lba >= mid_lba;
+
+        (*ios_cnt)++;
+        end = start;
+    }
+}
+
+pres img_ctx_flush(const struct img_ctx *ctx, pu32 *written_cnt)
 {
-    int res;
+    struct img_sec **secs;
+    struct img_sec *sec;
+    struct iovec *iov;
+    struct img_io *ios;
+    pu32 secs_cnt;
+    pu32 unchanged_cnt;
+    pu32 ios_cnt;
+    pu32 i;
+    pres res;
+
+    *written_cnt = 0;
+
+    /* Gather dirty sectors. Written sectors, which match on-disk data, are
+     * not written again */
+    secs_cnt = 0;
+    unchanged_cnt = 0;
+    for(i = 0; i < ctx->cache->bucket_cnt; i++) {
+        for(sec = ctx->cache->buckets[i]; sec; sec = sec->next) {
+            secs_cnt += sec->dirty ? 1 : 0;
+            unchanged_cnt += sec->written && !sec->dirty ? 1 : 0;
+            sec->written = 0;
+        }
+    }
+
+    if(secs_cnt == 0) {
+        plog_dbg("Flushed 0 sectors, %lu unchanged sectors skipped",
+                 unchanged_cnt);
+        return pres_ok;
+    }
 
-    res = fsync(ctx->img_fd);
-    if(res == -1) {
-        perror("fsync()");
+    if(ctx->read_only) {
+        plog_err("Image is opened in read-only mode, %lu changed sectors "
+                 "are not written", secs_cnt);
         return pres_fail;
     }
 
+    secs = malloc(secs_cnt * sizeof(*secs));
+    iov = malloc(secs_cnt * sizeof(*iov));
+    ios = malloc(secs_cnt * sizeof(*ios));
+    if(secs == NULL || iov == NULL || ios == NULL) {
+        plog_err("Failed to allocate sector write plan");
+        res = pres_fail;
+        goto exit;
+    }
+
+    secs_cnt = 0;
+    for(i = 0; i < ctx->cache->bucket_cnt; i++) {
+        for(sec = ctx->cache->buckets[i]; sec; sec = sec->next) {
+            if(sec->dirty) {
+                secs[secs_cnt++] = sec;
+            }
+        }
+    }
+
+    /* Order sectors by LBA, so contiguous sectors become a single write */
+    qsort(secs, secs_cnt, sizeof(*secs), &img_sec_cmp);
+
+    img_flush_plan(ctx, secs, secs_cnt, iov, ios, &ios_cnt);
+
+    trace_begin("img write");
+
+    /* Submit all writes at once. Writes, which failed, were incomplete or
+     * were not submitted after a failed backup write, are repeated
+     * synchronously in order, so primary structures are never written
+     * before backup ones */
+    if(ctx->uring) {
+        img_uring_submit(ctx->uring, ctx->img_fd, ios, ios_cnt);
+    }
+
+    res = pres_ok;
+    for(i = 0; i < ios_cnt && res; i++) {
+        if(ios[i].res == (p64) lba_to_byte(ctx, ios[i].iov_cnt)) {
+            continue;
+        }
+
+        res = ctx->ops->write_secs(ctx, byte_to_lba(ctx, ios[i].off, 0),
+                                   ios[i].iov, ios[i].iov_cnt);
+        if(!res) {
+            plog_err("Failed to write sectors %llu-%llu",
+                     byte_to_lba(ctx, ios[i].off, 0),
+                     byte_to_lba(ctx, ios[i].off, 0) + ios[i].iov_cnt - 1);
+        }
+    }
+
+    trace_end("img write");
+
+    if(!res) {
+        goto exit;
+    }
+
+    for(i = 0; i < secs_cnt; i++) {
+        memcpy(secs[i]->disk_buf, secs[i]->buf, ctx->sec_sz);
+        secs[i]->on_disk = 1;
+        secs[i]->dirty = 0;
+    }
+
+    *written_cnt = secs_cnt;
+
+    plog_dbg("Flushed %lu sectors in %lu writes, %lu unchanged sectors "
+             "skipped", secs_cnt, ios_cnt, unchanged_cnt);
+
+exit:
+    free(secs);
+    free(iov);
+    free(ios);
+
+    return res;
+}
+
+pres img_ctx_sync(const struct img_ctx *ctx)
+{
+    pu64 t;
+    pu32 written_cnt;
+    pres res;
+
+    t = stats_begin(stats_img_sync);
+
+    /* Write cached sectors first. If nothing was written, there is nothing
+     * to flush */
+    trace_begin("img_ctx_flush");
+    res = img_ctx_flush(ctx, &written_cnt);
+    trace_end("img_ctx_flush");
+
+    if(res && written_cnt > 0) {
+        trace_begin("img fsync");
+        res = ctx->ops->flush(ctx);
+        trace_end("img fsync");
+    }
+
+    stats_end(stats_img_sync, t);
+
+    return res;
+}
+
+void img_prefetch_secs(const struct img_ctx *ctx,
+                       const struct img_range *ranges, pu32 ranges_cnt)
+{
+    struct img_io *ios;
+    struct iovec *iov;
+    struct img_sec *sec;
+    pu8 *buf;
+    pu32 ios_cnt;
+    pu32 i;
+    plba j;
+    plba lba;
+    plba secs_cnt;
+    plba last_lba;
+    pres res;
+
+    if(ctx->uring == NULL || ranges_cnt == 0) {
+        return;
+    }
+
+    last_lba = byte_to_lba(ctx, ctx->img_sz, 0) - 1;
+
+    /* Ranges outside the image are not read */
+    secs_cnt = 0;
+    for(i = 0; i < ranges_cnt; i++) {
+        if(ranges[i].lba + ranges[i].secs_cnt - 1 <= last_lba) {
+            secs_cnt += ranges[i].secs_cnt;
+        }
+    }
+
+    ios = malloc(ranges_cnt * sizeof(*ios));
+    iov = malloc(ranges_cnt * sizeof(*iov));
+    buf = malloc(lba_to_byte(ctx, secs_cnt));
+    if(ios == NULL || iov == NULL || buf == NULL) {
+        goto exit;
+    }
+
+    /* Build a read request per range */
+    ios_cnt = 0;
+    secs_cnt = 0;
+    for(i = 0; i < ranges_cnt; i++) {
+        if(ranges[i].lba + ranges[i].secs_cnt - 1 > last_lba) {
+            continue;
+        }
+
+        iov[ios_cnt].iov_base = buf + lba_to_byte(ctx, secs_cnt);
+        iov[ios_cnt].iov_len = lba_to_byte(ctx, ranges[i].secs_cnt);
+
+        ios[ios_cnt].iov = &iov[ios_cnt];
+        ios[ios_cnt].iov_cnt = 1;
+        ios[ios_cnt].off = lba_to_byte(ctx, ranges[i].lba);
+        ios[ios_cnt].write = 0;
+        ios[ios_cnt].barrier = 0;
+        ios[ios_cnt].res = 0;
+
+        secs_cnt += ranges[i].secs_cnt;
+        ios_cnt++;
+    }
+
+    trace_begin("img prefetch");
+    res = img_uring_submit(ctx->uring, ctx->img_fd, ios, ios_cnt);
+    trace_end("img prefetch");
+
+    if(!res) {
+        goto exit;
+    }
+
+    /* Cache sectors of complete reads. Other sectors are read synchronously
+     * on access */
+    for(i = 0; i < ios_cnt; i++) {
+        if(ios[i].res != (p64) iov[i].iov_len) {
+            continue;
+        }
+
+        lba = byte_to_lba(ctx, ios[i].off, 0);
+
+        for(j = 0; j < byte_to_lba(ctx, iov[i].iov_len, 0); j++) {
+            if(img_cache_find(ctx->cache, lba + j)) {
+                continue;
+            }
+
+            sec = img_cache_insert(ctx->cache, lba + j, ctx->sec_sz);
+            if(sec) {
+                memcpy(sec->buf, (pu8 *) iov[i].iov_base +
+                       lba_to_byte(ctx, j), ctx->sec_sz);
+                memcpy(sec->disk_buf, sec->buf, ctx->sec_sz);
+                sec->on_disk = 1;
+            }
+        }
+    }
+
+    plog_dbg("Prefetched %lu sector ranges", ios_cnt);
+
+exit:
+    free(ios);
+    free(iov);
+    free(buf);
+}
+
+pres img_read_secs(const struct img_ctx *ctx, plba lba, plba secs_cnt,
+                   pu8 *buf)
+{
+    struct img_sec *sec;
+    plba i, j;
+    pres res;
+
+    i = 0;
+    while(i < secs_cnt) {
+        sec = img_cache_find(ctx->cache, lba + i);
+        if(sec) {
+            memcpy(buf + lba_to_byte(ctx, i), sec->buf, ctx->sec_sz);
+            i++;
+            continue;
+        }
+
+        /* Read the whole run of sectors, which are not cached, at once */
+        for(j = i + 1; j < secs_cnt; j++) {
+            if(img_cache_find(ctx->cache, lba + j)) {
+                break;
+            }
+        }
+
+        trace_begin("img read");
+        res = ctx->ops->read_secs(ctx, lba + i, j - i,
+                                  buf + lba_to_byte(ctx, i));
+        trace_end("img read");
+        if(!res) {
+            plog_err("Failed to read sectors %llu-%llu", lba + i, lba + j - 1);
+            return pres_fail;
+        }
+
+        /* Cache read sectors. If caching fails, sectors are read again on
+         * the next access */
+        for(; i < j; i++) {
+            sec = img_cache_insert(ctx->cache, lba + i, ctx->sec_sz);
+            if(sec) {
+                memcpy(sec->buf, buf + lba_to_byte(ctx, i), ctx->sec_sz);
+                memcpy(sec->disk_buf, sec->buf, ctx->sec_sz);
+                sec->on_disk = 1;
+            }
+        }
+    }
+
+    return pres_ok;
+}
+
+pres img_write_secs(const struct img_ctx *ctx, plba lba, plba secs_cnt,
+                    const pu8 *buf)
+{
+    struct img_sec *sec;
+    plba i;
+
+    for(i = 0; i < secs_cnt; i++) {
+        sec = img_cache_find(ctx->cache, lba + i);
+        if(sec == NULL) {
+            sec = img_cache_insert(ctx->cache, lba + i, ctx->sec_sz);
+        }
+
+        if(sec == NULL) {
+            plog_err("Failed to cache sector %llu", lba + i);
+            return pres_fail;
+        }
+
+        memcpy(sec->buf, buf + lba_to_byte(ctx, i), ctx->sec_sz);
+        sec->written = 1;
+
+        /* Sector is written on flush only if it differs from on-disk one */
+        sec->dirty = !sec->on_disk ||
+                     memcmp(sec->buf, sec->disk_buf, ctx->sec_sz) != 0;
+    }
+
     return pres_ok;
 }
 
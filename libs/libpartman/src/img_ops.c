@@ -0,0 +1,169 @@
+/* For pread() */
+#define _XOPEN_SOURCE 500
+/* For pwritev() */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "img_ctx.h"
+#include "log.h"
+#include "stats.h"
+
+static pres img_file_read_secs(const struct img_ctx *ctx, plba lba,
+                               plba secs_cnt, pu8 *buf)
+{
+    ssize_t c;
+    pu64 len;
+    pu64 off;
+
+    len = lba_to_byte(ctx, secs_cnt);
+    off = lba_to_byte(ctx, lba);
+
+    while(len > 0) {
+        c = pread(ctx->img_fd, buf, len, off);
+        if(c == -1) {
+            perror("pread()");
+            return pres_fail;
+        }
+
+        stats_call(stats_call_read, c);
+
+        /* Unexpected end of image */
+        if(c == 0) {
+            return pres_fail;
+        }
+
+        buf += c;
+        len -= c;
+        off += c;
+    }
+
+    return pres_ok;
+}
+
+static pres img_file_write_secs(const struct img_ctx *ctx, plba lba,
+                                struct iovec *iov, int iov_cnt)
+{
+    ssize_t c;
+    pu64 off;
+
+    off = lba_to_byte(ctx, lba);
+
+    while(iov_cnt > 0) {
+        c = pwritev(ctx->img_fd, iov, iov_cnt, off);
+        if(c == -1) {
+            perror("pwritev()");
+            return pres_fail;
+        }
+
+        stats_call(stats_call_write, c);
+
+        off += c;
+
+        /* Skip buffers, which were written completely */
+        while(iov_cnt > 0 && (size_t) c >= iov->iov_len) {
+            c -= iov->iov_len;
+            iov++;
+            iov_cnt--;
+        }
+
+        /* Continue partially written buffer */
+        if(iov_cnt > 0) {
+            iov->iov_base = (pu8 *) iov->iov_base + c;
+            iov->iov_len -= c;
+        }
+    }
+
+    return pres_ok;
+}
+
+static pres img_file_flush(const struct img_ctx *ctx)
+{
+    int res;
+
+    res = fsync(ctx->img_fd);
+    stats_call(stats_call_fsync, 0);
+    if(res == -1) {
+        perror("fsync()");
+        return pres_fail;
+    }
+
+    return pres_ok;
+}
+
+static pu64 img_file_size(const struct img_ctx *ctx)
+{
+    off_t sz;
+
+    sz = lseek(ctx->img_fd, 0, SEEK_END);
+    if(sz == -1) {
+        perror("lseek()");
+        return 0;
+    }
+
+    return sz;
+}
+
+static pres img_mem_read_secs(const struct img_ctx *ctx, plba lba,
+                              plba secs_cnt, pu8 *buf)
+{
+    /* Unexpected end of image */
+    if(lba_to_byte(ctx, lba + secs_cnt) > ctx->img_sz) {
+        return pres_fail;
+    }
+
+    memcpy(buf, (pu8 *) ctx->priv + lba_to_byte(ctx, lba),
+           lba_to_byte(ctx, secs_cnt));
+
+    return pres_ok;
+}
+
+static pres img_mem_write_secs(const struct img_ctx *ctx, plba lba,
+                               struct iovec *iov, int iov_cnt)
+{
+    pu8 *reg;
+    int i;
+
+    reg = (pu8 *) ctx->priv + lba_to_byte(ctx, lba);
+
+    for(i = 0; i < iov_cnt; i++) {
+        /* Unexpected end of image */
+        if(reg + iov[i].iov_len > (pu8 *) ctx->priv + ctx->img_sz) {
+            return pres_fail;
+        }
+
+        memcpy(reg, iov[i].iov_base, iov[i].iov_len);
+        reg += iov[i].iov_len;
+    }
+
+    return pres_ok;
+}
+
+static pres img_mem_flush(const struct img_ctx *ctx)
+{
+    /* Nothing to do, buffer is always up to date */
+    (void) ctx;
+
+    return pres_ok;
+}
+
+static pu64 img_mem_size(const struct img_ctx *ctx)
+{
+    return ctx->img_sz;
+}
+
+const struct img_ops img_file_ops = {
+    &img_file_read_secs,
+    &img_file_write_secs,
+    &img_file_flush,
+    &img_file_size
+};
+
+const struct img_ops img_mem_ops = {
+    &img_mem_read_secs,
+    &img_mem_write_secs,
+    &img_mem_flush,
+    &img_mem_size
+};
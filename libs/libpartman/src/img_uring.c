@@ -0,0 +1,375 @@
+/* For syscall(), mmap() flags */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "img_uring.h"
+#include "log.h"
+#include "stats.h"
+
+/* io_uring is only used on Linux with a GCC compatible compiler (for atomic
+ * builtins). Other targets always use synchronous I/O */
+#if defined(__linux__) && defined(__GNUC__) && !defined(IMG_NO_URING)
+#define IMG_URING 1
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef IMG_URING
+
+/* Submission or completion queue ring, mapped from the kernel */
+struct img_uring_queue {
+    /* Mapped ring memory */
+    void *reg;
+
+    /* Mapped ring memory length, in bytes */
+    size_t reg_sz;
+
+    /* Ring head and tail indexes */
+    unsigned int *head;
+    unsigned int *tail;
+
+    /* Ring index mask */
+    unsigned int mask;
+};
+
+struct img_uring {
+    /* io_uring file descriptor */
+    int fd;
+
+    /* Number of submission queue entries */
+    pu32 depth;
+
+    /* Submission queue */
+    struct img_uring_queue sq;
+
+    /* Submission queue index array */
+    unsigned int *sq_array;
+
+    /* Submission queue entries */
+    struct io_uring_sqe *sqes;
+
+    /* Submission queue entries memory length, in bytes */
+    size_t sqes_sz;
+
+    /* Completion queue */
+    struct img_uring_queue cq;
+
+    /* Completion queue entries */
+    struct io_uring_cqe *cqes;
+
+    /* Requests may still be in flight after a failed wait, so the ring is
+     * not used anymore */
+    pflag broken;
+};
+
+static pres img_uring_map(struct img_uring *ring,
+                          const struct io_uring_params *p)
+{
+    pu8 *sq_reg;
+    pu8 *cq_reg;
+
+    ring->sq.reg_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    ring->cq.reg_sz = p->cq_off.cqes +
+                      p->cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Both rings may share a single mapping */
+    if(p->features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq.reg_sz > ring->sq.reg_sz) {
+            ring->sq.reg_sz = ring->cq.reg_sz;
+        }
+        ring->cq.reg_sz = 0;
+    }
+
+    ring->sq.reg = mmap(NULL, ring->sq.reg_sz, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    stats_call(stats_call_mmap, ring->sq.reg_sz);
+    if(ring->sq.reg == MAP_FAILED) {
+        ring->sq.reg = NULL;
+        return pres_fail;
+    }
+
+    if(ring->cq.reg_sz) {
+        ring->cq.reg = mmap(NULL, ring->cq.reg_sz, PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        stats_call(stats_call_mmap, ring->cq.reg_sz);
+        if(ring->cq.reg == MAP_FAILED) {
+            ring->cq.reg = NULL;
+            return pres_fail;
+        }
+        cq_reg = ring->cq.reg;
+    } else {
+        cq_reg = ring->sq.reg;
+    }
+
+    ring->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    stats_call(stats_call_mmap, ring->sqes_sz);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return pres_fail;
+    }
+
+    sq_reg = ring->sq.reg;
+
+    ring->sq.head = (unsigned int *) (sq_reg + p->sq_off.head);
+    ring->sq.tail = (unsigned int *) (sq_reg + p->sq_off.tail);
+    ring->sq.mask = *(unsigned int *) (sq_reg + p->sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq_reg + p->sq_off.array);
+
+    ring->cq.head = (unsigned int *) (cq_reg + p->cq_off.head);
+    ring->cq.tail = (unsigned int *) (cq_reg + p->cq_off.tail);
+    ring->cq.mask = *(unsigned int *) (cq_reg + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_reg + p->cq_off.cqes);
+
+    return pres_ok;
+}
+
+struct img_uring *img_uring_create(pu32 depth)
+{
+    struct img_uring *ring;
+    struct io_uring_params p;
+
+    ring = calloc(1, sizeof(*ring));
+    if(ring == NULL) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if(ring->fd == -1) {
+        plog_dbg("io_uring setup failed (errno %d)", errno);
+        free(ring);
+        return NULL;
+    }
+
+    ring->depth = p.sq_entries;
+
+    if(!img_uring_map(ring, &p)) {
+        plog_dbg("io_uring ring mapping failed (errno %d)", errno);
+        img_uring_free(ring);
+        return NULL;
+    }
+
+    plog_dbg("io_uring backend enabled, %lu entries", ring->depth);
+
+    return ring;
+}
+
+void img_uring_free(struct img_uring *ring)
+{
+    if(!ring) {
+        return;
+    }
+
+    if(ring->sqes) {
+        munmap(ring->sqes, ring->sqes_sz);
+        stats_call(stats_call_munmap, ring->sqes_sz);
+    }
+
+    if(ring->cq.reg) {
+        munmap(ring->cq.reg, ring->cq.reg_sz);
+        stats_call(stats_call_munmap, ring->cq.reg_sz);
+    }
+
+    if(ring->sq.reg) {
+        munmap(ring->sq.reg, ring->sq.reg_sz);
+        stats_call(stats_call_munmap, ring->sq.reg_sz);
+    }
+
+    close(ring->fd);
+    free(ring);
+}
+
+static void img_uring_prep(struct img_uring *ring, int fd,
+                           const struct img_io *io, pu32 index)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+    unsigned int i;
+
+    tail = *ring->sq.tail;
+    i = tail & ring->sq.mask;
+
+    sqe = &ring->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = io->off;
+    sqe->addr = (unsigned long) io->iov;
+    sqe->len = io->iov_cnt;
+    sqe->user_data = index;
+
+    ring->sq_array[i] = i;
+
+    /* Entry must be visible to the kernel before the new tail */
+    __atomic_store_n(ring->sq.tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static pu32 img_uring_reap(struct img_uring *ring, struct img_io *ios)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    unsigned int tail;
+    pu32 cnt;
+
+    head = *ring->cq.head;
+    tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+
+    for(cnt = 0; head != tail; head++, cnt++) {
+        cqe = &ring->cqes[head & ring->cq.mask];
+        ios[cqe->user_data].res = cqe->res;
+
+        stats_call(ios[cqe->user_data].write ? stats_call_write
+                                             : stats_call_read,
+                   cqe->res > 0 ? cqe->res : 0);
+    }
+
+    __atomic_store_n(ring->cq.head, head, __ATOMIC_RELEASE);
+
+    return cnt;
+}
+
+/* Waits for completion of requests, which were already submitted, after
+ * submission failed. Entries, which were not consumed by the kernel, are
+ * taken back. Buffers of the requests may be released only after this */
+static void img_uring_drain(struct img_uring *ring, struct img_io *ios,
+                            pu32 submitted, pu32 completed)
+{
+    long c;
+
+    /* Kernel consumes entries only in io_uring_enter() */
+    __atomic_store_n(ring->sq.tail,
+                     __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+
+    while(completed < submitted) {
+        c = syscall(__NR_io_uring_enter, ring->fd, 0, submitted - completed,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_call(stats_call_uring_enter, 0);
+        if(c == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if(c == -1) {
+            perror("io_uring_enter()");
+            ring->broken = 1;
+            return;
+        }
+
+        completed += img_uring_reap(ring, ios);
+    }
+}
+
+/* Returns non-zero, if all requests transferred every byte */
+static pflag img_uring_complete(const struct img_io *ios, pu32 ios_cnt)
+{
+    pu64 len;
+    pu32 i;
+    int j;
+
+    for(i = 0; i < ios_cnt; i++) {
+        len = 0;
+        for(j = 0; j < ios[i].iov_cnt; j++) {
+            len += ios[i].iov[j].iov_len;
+        }
+
+        if(ios[i].res != (p64) len) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+pres img_uring_submit(struct img_uring *ring, int fd, struct img_io *ios,
+                      pu32 ios_cnt)
+{
+    pu32 chunk;
+    pu32 i;
+    pu32 submitted;
+    pu32 completed;
+    long c;
+
+    if(ring->broken) {
+        return pres_fail;
+    }
+
+    /* Requests, which do not fit into the ring, are submitted in the next
+     * batch, after the previous one is completed. Barrier request starts a
+     * new batch, which is submitted only if all previous requests succeeded.
+     * Otherwise it is left to the caller, along with the failed ones */
+    for(chunk = 0; chunk < ios_cnt; chunk = i) {
+        if(ios[chunk].barrier && !img_uring_complete(ios, chunk)) {
+            return pres_fail;
+        }
+
+        for(i = chunk; i < ios_cnt && i < chunk + ring->depth; i++) {
+            if(i > chunk && ios[i].barrier) {
+                break;
+            }
+
+            img_uring_prep(ring, fd, &ios[i], i);
+        }
+
+        submitted = 0;
+        completed = 0;
+        while(completed < i - chunk) {
+            c = syscall(__NR_io_uring_enter, ring->fd, i - chunk - submitted,
+                        i - chunk - completed, IORING_ENTER_GETEVENTS,
+                        NULL, 0);
+            stats_call(stats_call_uring_enter, 0);
+            if(c == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if(c == -1) {
+                perror("io_uring_enter()");
+                img_uring_drain(ring, ios, submitted,
+                                completed + img_uring_reap(ring, ios));
+                return pres_fail;
+            }
+
+            submitted += c;
+            completed += img_uring_reap(ring, ios);
+        }
+    }
+
+    return pres_ok;
+}
+
+#else
+
+struct img_uring *img_uring_create(pu32 depth)
+{
+    (void) depth;
+
+    return NULL;
+}
+
+void img_uring_free(struct img_uring *ring)
+{
+    (void) ring;
+}
+
+pres img_uring_submit(struct img_uring *ring, int fd, struct img_io *ios,
+                      pu32 ios_cnt)
+{
+    (void) ring;
+    (void) fd;
+    (void) ios;
+    (void) ios_cnt;
+
+    return pres_fail;
+}
+
+#endif
@@ -16,7 +16,7 @@ void plog(const char *level, const char *format, va_list args)
 
     vfprintf(stderr, format, args);
 
-    fputc('\n', stdout);
+    fputc('\n', stderr);
 }
 
 void pprint(const char *format, ...)
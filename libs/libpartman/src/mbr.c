@@ -1,12 +1,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/mman.h>
 
 #include "mbr.h"
 #include "log.h"
 #include "memutils.h"
 #include "rand.h"
+#include "schem_blob.h"
+#include "stats.h"
+#include "trace.h"
 
 enum {
     /* MBR size, in bytes */
@@ -52,42 +54,6 @@ struct mbr {
     struct mbr_part partitions[4];
 };
 
-static pres mbr_unmap(pu8 *reg, const struct img_ctx *img_ctx)
-{
-    pu64 len;
-    int c;
-
-    /* MBR length, aligned to sectors, in bytes */
-    len = lba_to_byte(img_ctx, byte_to_lba(img_ctx, mbr_sz, 1));
-
-    c = munmap(reg, len);
-    if(c == -1) {
-        perror("munmap()");
-        return pres_fail;
-    }
-
-    return pres_ok;
-}
-
-static pu8 *mbr_map(const struct img_ctx *img_ctx)
-{
-    pu64 len;
-    pu8 *r;
-
-    /* MBR length, aligned to sectors, in bytes.
-     * MBR could possibly take less or more than 1 sector */
-    len = lba_to_byte(img_ctx, byte_to_lba(img_ctx, mbr_sz, 1));
-
-    /* Map sector(s), containing MBR, located at offset 0 */
-    r = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, img_ctx->img_fd, 0);
-    if(r == MAP_FAILED) {
-        perror("mmap()");
-        return NULL;
-    }
-
-    return r;
-}
-
 static void mbr_part_write(pu8 *buf, const struct mbr_part *mbr_part)
 {
     write_pu8 (buf,      mbr_part->boot_ind);
@@ -149,8 +115,15 @@ static pflag mbr_is_present(const pu8 *buf)
     return read_pu16(buf + 510) == mbr_boot_sig;
 }
 
-static void mbr_init_schem(struct schem *schem, const struct img_ctx *img_ctx)
+static pres mbr_init_schem(struct schem *schem, const struct img_ctx *img_ctx)
 {
+    pres res;
+
+    res = schem_table_alloc(schem, mbr_max_part_cnt);
+    if(!res) {
+        return pres_fail;
+    }
+
     schem->type = schem_type_mbr;
     schem->first_usable_lba = byte_to_lba(img_ctx, mbr_sz, 1);
     schem->last_usable_lba = byte_to_lba(img_ctx, img_ctx->img_sz, 0) - 1;
@@ -158,35 +131,43 @@ static void mbr_init_schem(struct schem *schem, const struct img_ctx *img_ctx)
     if(schem->last_usable_lba > 0xFFFFFFFF) {
         schem->last_usable_lba = 0xFFFFFFFF;
     }
-    schem->part_cnt = mbr_max_part_cnt;
 
-    memset(schem->table, 0, sizeof(*schem->table) * schem->part_cnt);
+    return pres_ok;
 }
 
 static pres mbr_save(const struct mbr *mbr, const struct img_ctx *img_ctx)
 {
     pres res;
-    pu8 *reg;
+    pu8 *buf;
+    plba secs_cnt;
+
+    /* MBR could possibly take less or more than 1 sector */
+    secs_cnt = byte_to_lba(img_ctx, mbr_sz, 1);
 
-    /* Map MBR sector */
-    reg = mbr_map(img_ctx);
-    if(reg == NULL) {
-        plog_err("Failed to map image MBR");
+    buf = malloc(lba_to_byte(img_ctx, secs_cnt));
+    if(buf == NULL) {
+        plog_err("Failed to allocate MBR buffer");
         return pres_fail;
     }
 
-    /* Write MBR */
-    mbr_write(reg, mbr);
+    /* Read MBR sector(s), located at offset 0, to keep bootstrap code */
+    res = img_read_secs(img_ctx, 0, secs_cnt, buf);
+    if(res) {
+        /* Write MBR */
+        mbr_write(buf, mbr);
 
-    plog_dbg("Saved MBR");
+        res = img_write_secs(img_ctx, 0, secs_cnt, buf);
+    }
+
+    free(buf);
 
-    /* Unmap MBR sector */
-    res = mbr_unmap(reg, img_ctx);
     if(!res) {
-        plog_err("Failed to unmap image MBR");
+        plog_err("Failed to save image MBR");
         return pres_fail;
     }
 
+    plog_dbg("Saved MBR");
+
     return pres_ok;
 }
 
@@ -194,18 +175,29 @@ static enum schem_load_res mbr_load(struct mbr *mbr, const struct img_ctx *img_c
 {
     enum schem_load_res load_res;
     pres res;
-    pu8 *reg;
+    pu8 *buf;
+    plba secs_cnt;
+
+    /* MBR could possibly take less or more than 1 sector */
+    secs_cnt = byte_to_lba(img_ctx, mbr_sz, 1);
 
-    /* Map MBR sector */
-    reg = mbr_map(img_ctx);
-    if(reg == NULL) {
-        plog_err("Failed to map image MBR");
+    buf = malloc(lba_to_byte(img_ctx, secs_cnt));
+    if(buf == NULL) {
+        plog_err("Failed to allocate MBR buffer");
+        return schem_load_fatal;
+    }
+
+    /* Read MBR sector(s), located at offset 0 */
+    res = img_read_secs(img_ctx, 0, secs_cnt, buf);
+    if(!res) {
+        plog_err("Failed to read image MBR");
+        free(buf);
         return schem_load_fatal;
     }
 
     /* Check signature and read MBR */
-    if(mbr_is_present(reg)) {
-        mbr_read(reg, mbr);
+    if(mbr_is_present(buf)) {
+        mbr_read(buf, mbr);
         load_res = schem_load_ok;
 
         plog_dbg("Loaded MBR");
@@ -213,12 +205,7 @@ static enum schem_load_res mbr_load(struct mbr *mbr, const struct img_ctx *img_c
         load_res = schem_load_not_found;
     }
 
-    /* Unmap MBR sector */
-    res = mbr_unmap(reg, img_ctx);
-    if(!res) {
-        plog_err("Failed to unmap image MBR");
-        return schem_load_fatal;
-    }
+    free(buf);
 
     return load_res;
 }
@@ -256,7 +243,7 @@ static void mbr_from_schem(const struct schem *schem, struct mbr *mbr,
     }
 }
 
-static void mbr_to_schem(struct schem *schem, const struct mbr *mbr,
+static pres mbr_to_schem(struct schem *schem, const struct mbr *mbr,
                          const struct img_ctx *img_ctx)
 {
     pu32 i;
@@ -264,7 +251,9 @@ static void mbr_to_schem(struct schem *schem, const struct mbr *mbr,
     struct schem_part *part;
 
     /* Convert scheme details */
-    mbr_init_schem(schem, img_ctx);
+    if(!mbr_init_schem(schem, img_ctx)) {
+        return pres_fail;
+    }
     schem->id.i = mbr->disk_sig;
 
     /* Convert partitions */
@@ -282,12 +271,19 @@ static void mbr_to_schem(struct schem *schem, const struct mbr *mbr,
         part->end_lba = part_mbr->start_lba + part_mbr->sz_lba - 1;
         part->boot_ind = part_mbr->boot_ind;
     }
+
+    return pres_ok;
 }
 
-void schem_init_mbr(struct schem *schem, const struct img_ctx *img_ctx)
+pres schem_init_mbr(struct schem *schem, const struct img_ctx *img_ctx)
 {
-    mbr_init_schem(schem, img_ctx);
+    if(!mbr_init_schem(schem, img_ctx)) {
+        return pres_fail;
+    }
+
     schem->id.i = rand_32();
+
+    return pres_ok;
 }
 
 void schem_part_init_mbr(struct schem_part *part)
@@ -301,20 +297,40 @@ pflag schem_part_is_used_mbr(const struct schem_part *part)
     return part->type.i != 0;
 }
 
+pu32 schem_probe_mbr(const struct img_ctx *img_ctx, struct img_range *ranges)
+{
+    /* MBR sector(s), located at offset 0 */
+    ranges[0].lba = 0;
+    ranges[0].secs_cnt = byte_to_lba(img_ctx, mbr_sz, 1);
+
+    return 1;
+}
+
 enum schem_load_res
 schem_load_mbr(struct schem *schem, const struct img_ctx *img_ctx)
 {
     struct mbr mbr;
     enum schem_load_res res;
+    pres res_conv;
+    pu64 t;
 
     memset(&mbr, 0, sizeof(mbr));
 
+    trace_begin("mbr_load");
     res = mbr_load(&mbr, img_ctx);
+    trace_end("mbr_load");
+
     if(res != schem_load_ok) {
         return res;
     }
 
-    mbr_to_schem(schem, &mbr, img_ctx);
+    t = stats_begin(stats_schem_conv);
+    res_conv = mbr_to_schem(schem, &mbr, img_ctx);
+    stats_end(stats_schem_conv, t);
+
+    if(!res_conv) {
+        return schem_load_fatal;
+    }
 
     return schem_load_ok;
 }
@@ -322,12 +338,20 @@ schem_load_mbr(struct schem *schem, const struct img_ctx *img_ctx)
 pres schem_save_mbr(const struct schem *schem, const struct img_ctx *img_ctx)
 {
     struct mbr mbr;
+    pres res;
+    pu64 t;
 
     memset(&mbr, 0, sizeof(mbr));
 
+    t = stats_begin(stats_schem_conv);
     mbr_from_schem(schem, &mbr, img_ctx);
+    stats_end(stats_schem_conv, t);
 
-    return mbr_save(&mbr, img_ctx);
+    trace_begin("mbr_save");
+    res = mbr_save(&mbr, img_ctx);
+    trace_end("mbr_save");
+
+    return res;
 }
 
 pres schem_remove_mbr(const struct img_ctx *img_ctx)
@@ -339,6 +363,52 @@ pres schem_remove_mbr(const struct img_ctx *img_ctx)
     return mbr_save(&mbr, img_ctx);
 }
 
+void schem_release_mbr(struct schem *schem)
+{
+    /* MBR keeps no scheme specific data */
+    schem->priv = NULL;
+}
+
+pres schem_mbr_keep_boot(struct schem_blob *blob,
+                         const struct img_ctx *img_ctx)
+{
+    struct mbr mbr;
+    pu8 *blob_buf;
+    pu8 *buf;
+    plba secs_cnt;
+    pres res;
+
+    secs_cnt = byte_to_lba(img_ctx, mbr_sz, 1);
+
+    blob_buf = schem_blob_secs(blob, 0, secs_cnt);
+    if(blob_buf == NULL) {
+        return pres_fail;
+    }
+
+    buf = malloc(lba_to_byte(img_ctx, secs_cnt));
+    if(buf == NULL) {
+        plog_err("Failed to allocate MBR buffer");
+        return pres_fail;
+    }
+
+    /* Rendered MBR is written over the image sector(s), same as on save */
+    res = img_read_secs(img_ctx, 0, secs_cnt, buf);
+    if(res) {
+        mbr_read(blob_buf, &mbr);
+        mbr_write(buf, &mbr);
+        memcpy(blob_buf, buf, lba_to_byte(img_ctx, secs_cnt));
+    }
+
+    free(buf);
+
+    if(!res) {
+        plog_err("Failed to read image MBR");
+        return pres_fail;
+    }
+
+    return pres_ok;
+}
+
 void schem_mbr_set_prot(struct schem *schem)
 {
     struct schem_part *part;
@@ -351,6 +421,8 @@ void schem_mbr_set_prot(struct schem *schem)
     part->start_lba = schem->first_usable_lba;
     part->end_lba = schem->last_usable_lba;
     part->boot_ind = 0x0;
+
+    schem_table_changed(schem);
 }
 
 pflag schem_mbr_is_prot(const struct schem *schem)
@@ -363,3 +435,22 @@ pflag schem_mbr_part_is_prot(const struct schem_part *part)
     return part->type.i == mbr_part_type_prot;
 }
 
+pres schem_regen_mbr(struct schem_blob *blob,
+                      const struct schem_regen *regen)
+{
+    pu8 *buf;
+
+    if(regen->keep_id) {
+        return pres_ok;
+    }
+
+    buf = schem_blob_secs(blob, 0, 1);
+    if(buf == NULL) {
+        return pres_fail;
+    }
+
+    /* Disk signature is the only identifier of MBR */
+    write_pu32(buf + 440, rand_32());
+
+    return pres_ok;
+}
@@ -21,3 +21,30 @@ pu32 rand_32(void)
            (((pu32) rand_8()) << 24);
 }
 
+
+void rand_fill(pu8 *buf, pu32 cnt)
+{
+    pu32 val_bytes;
+    pu32 val_div;
+    pu32 val;
+    pu32 i;
+
+    /* Number of whole random bytes, which rand() returns. Upper bits are
+     * used, like in rand_8() */
+    val_bytes = 1;
+    val_div = RAND_MAX / 0x100 + 1;
+    while(val_bytes < 4 && val_div > 0xFF) {
+        val_bytes++;
+        val_div >>= 8;
+    }
+
+    val = 0;
+    for(i = 0; i < cnt; i++) {
+        if(i % val_bytes == 0) {
+            val = rand() / val_div;
+        }
+
+        buf[i] = val & 0xFF;
+        val >>= 8;
+    }
+}
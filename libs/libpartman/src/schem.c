@@ -6,48 +6,237 @@
 #include "log.h"
 #include "mbr.h"
 #include "gpt.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Used partition extent */
+struct schem_ext {
+    plba start_lba;
+    plba end_lba;
+
+    /* Partition index in the table */
+    pu32 part;
+};
+
+/* Search index of used partitions */
+struct schem_index {
+    /* Extents, sorted by start LBA, then by partition index */
+    struct schem_ext *exts;
+
+    /* Maximum end LBA of extents up to the same position. Partitions of a
+     * damaged table may overlap, so end LBAs are not always sorted */
+    plba *max_end;
+
+    /* Start LBA of each partition, as it was indexed. Used to find extent of
+     * a partition, which was changed in the table since */
+    plba *part_start;
+
+    /* Number of extents */
+    pu32 cnt;
+
+    /* Extents match the table */
+    pflag valid;
+};
 
 static void schem_free(struct schem *schem)
 {
+    schem->funcs.release(schem);
     free(schem->table);
+
+    if(schem->index) {
+        free(schem->index->exts);
+        free(schem->index->max_end);
+        free(schem->index->part_start);
+        free(schem->index);
+        schem->index = NULL;
+    }
 }
 
-static pu32 schem_get_max_part_cnt(enum schem_type type)
+static int schem_ext_cmp(const void *a, const void *b)
 {
-    switch(type) {
-        case schem_type_mbr:
-            return mbr_max_part_cnt;
+    const struct schem_ext *ext_a = a;
+    const struct schem_ext *ext_b = b;
 
-        case schem_type_gpt:
-            return gpt_max_part_cnt;
+    if(ext_a->start_lba != ext_b->start_lba) {
+        return ext_a->start_lba < ext_b->start_lba ? -1 : 1;
+    }
 
-        case schem_cnt:
+    return ext_a->part < ext_b->part ? -1 : ext_a->part > ext_b->part;
+}
+
+static void schem_index_max_end(struct schem_index *index, pu32 pos)
+{
+    pu32 i;
+
+    for(i = pos; i < index->cnt; i++) {
+        index->max_end[i] = index->exts[i].end_lba;
+        if(i > 0 && index->max_end[i - 1] > index->max_end[i]) {
+            index->max_end[i] = index->max_end[i - 1];
+        }
+    }
+}
+
+/* Returns search index, rebuilt from the table, if it is outdated */
+static struct schem_index *schem_index_get(const struct schem *schem)
+{
+    struct schem_index *index;
+    const struct schem_part *part;
+    pu32 i;
+
+    index = schem->index;
+    if(index->valid) {
+        return index;
+    }
+
+    index->cnt = 0;
+    for(i = 0; i < schem->part_cnt; i++) {
+        part = &schem->table[i];
+
+        if(!schem->funcs.part_is_used(part)) {
+            continue;
+        }
+
+        index->exts[index->cnt].start_lba = part->start_lba;
+        index->exts[index->cnt].end_lba = part->end_lba;
+        index->exts[index->cnt].part = i;
+        index->part_start[i] = part->start_lba;
+        index->cnt++;
+    }
+
+    qsort(index->exts, index->cnt, sizeof(*index->exts), &schem_ext_cmp);
+    schem_index_max_end(index, 0);
+
+    index->valid = 1;
+
+    return index;
+}
+
+/* Returns position of the first extent, which starts after LBA */
+static pu32 schem_index_upper(const struct schem_index *index, plba lba)
+{
+    pu32 lo, hi, mid;
+
+    lo = 0;
+    hi = index->cnt;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if(index->exts[mid].start_lba <= lba) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Returns extent of a used partition, other than part_ign, which contains
+ * LBA. Of overlapping partitions, the one, which ends last, is returned */
+static const struct schem_ext *
+schem_index_find(const struct schem_index *index, plba lba, p32 part_ign)
+{
+    const struct schem_ext *ext;
+    const struct schem_ext *found;
+    pu32 i;
+
+    found = NULL;
+
+    /* Extents, which start before LBA, are checked backwards, until none of
+     * the remaining ones reaches LBA */
+    for(i = schem_index_upper(index, lba); i > 0; i--) {
+        if(index->max_end[i - 1] < lba) {
             break;
+        }
+
+        ext = &index->exts[i - 1];
+
+        if((p32) ext->part == part_ign || ext->end_lba < lba) {
+            continue;
+        }
+
+        if(found == NULL || ext->end_lba > found->end_lba) {
+            found = ext;
+        }
     }
 
-    /* This should never happen */
-    return 0;
+    return found;
+}
+
+static void schem_index_remove(struct schem_index *index, pu32 part)
+{
+    struct schem_ext key;
+    struct schem_ext *ext;
+    pu32 i;
+
+    /* Extents are sorted by start LBA and partition index, so the extent is
+     * found by its indexed start. Partitions, which were not used, are not
+     * found */
+    key.start_lba = index->part_start[part];
+    key.end_lba = 0;
+    key.part = part;
+
+    ext = bsearch(&key, index->exts, index->cnt, sizeof(*index->exts),
+                  &schem_ext_cmp);
+    if(ext == NULL) {
+        return;
+    }
+
+    i = ext - index->exts;
+
+    index->cnt--;
+    memmove(&index->exts[i], &index->exts[i + 1],
+            (index->cnt - i) * sizeof(*index->exts));
+
+    schem_index_max_end(index, i);
+}
+
+static void schem_index_insert(struct schem_index *index,
+                               const struct schem_ext *ext)
+{
+    pu32 i;
+
+    /* Position before extents with the same start and higher index */
+    i = schem_index_upper(index, ext->start_lba);
+    while(i > 0 && schem_ext_cmp(&index->exts[i - 1], ext) > 0) {
+        i--;
+    }
+
+    memmove(&index->exts[i + 1], &index->exts[i],
+            (index->cnt - i) * sizeof(*index->exts));
+    index->exts[i] = *ext;
+    index->part_start[ext->part] = ext->start_lba;
+    index->cnt++;
+
+    schem_index_max_end(index, i);
 }
 
-static void schem_map_funcs(struct schem_funcs *funcs, enum schem_type type)
+
+void schem_map_funcs(struct schem_funcs *funcs, enum schem_type type)
 {
     switch(type) {
         case schem_type_mbr:
             funcs->init         = &schem_init_mbr;
             funcs->part_init    = &schem_part_init_mbr;
             funcs->part_is_used = &schem_part_is_used_mbr;
+            funcs->probe        = &schem_probe_mbr;
             funcs->load         = &schem_load_mbr;
             funcs->save         = &schem_save_mbr;
             funcs->remove       = &schem_remove_mbr;
+            funcs->release      = &schem_release_mbr;
+            funcs->regen        = &schem_regen_mbr;
             break;
 
         case schem_type_gpt:
             funcs->init         = &schem_init_gpt;
             funcs->part_init    = &schem_part_init_gpt;
             funcs->part_is_used = &schem_part_is_used_gpt;
+            funcs->probe        = &schem_probe_gpt;
             funcs->load         = &schem_load_gpt;
             funcs->save         = &schem_save_gpt;
             funcs->remove       = &schem_remove_gpt;
+            funcs->release      = &schem_release_gpt;
+            funcs->regen        = &schem_regen_gpt;
             break;
 
         case schem_cnt:
@@ -58,22 +247,15 @@ static void schem_map_funcs(struct schem_funcs *funcs, enum schem_type type)
 static pres schem_new(struct schem *schem, const struct img_ctx *img_ctx,
                       enum schem_type type, pflag init)
 {
+    /* Scheme table is allocated on init or load, when its size is known */
     memset(schem, 0, sizeof(*schem));
 
-    /* Allocate new scheme table */
-    schem->table = calloc(schem_get_max_part_cnt(type),
-                          sizeof(struct schem_part));
-
-    if(schem->table == NULL) {
-        return pres_fail;
-    }
-
     /* Map new scheme functions */
     schem_map_funcs(&schem->funcs, type);
 
     /* Init new scheme if requested */
     if(init) {
-        schem->funcs.init(schem, img_ctx);
+        return schem->funcs.init(schem, img_ctx);
     }
 
     return pres_ok;
@@ -140,18 +322,35 @@ pres schem_ctx_new(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx,
     return pres_fail;
 }
 
-pres schem_ctx_load(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
+static pres schem_ctx_load_schemes(struct schem_ctx *schem_ctx,
+                                   const struct img_ctx *img_ctx)
 {
     int i;
     struct schem schem;
     pres res_new;
     enum schem_load_res res_load;
+    struct schem_funcs funcs;
+    struct img_range ranges[schem_cnt * schem_probe_max_ranges];
+    pu32 ranges_cnt;
 
     plog_dbg("Schemes detection and loading started");
 
     /* Reset context and any previous schemes */
     schem_ctx_reset(schem_ctx, 0);
 
+    trace_begin("schem probe");
+
+    /* Read sectors, which are probed by all schemes, at once */
+    ranges_cnt = 0;
+    for(i = 0; i < schem_cnt; i++) {
+        schem_map_funcs(&funcs, i);
+        ranges_cnt += funcs.probe(img_ctx, &ranges[ranges_cnt]);
+    }
+
+    img_prefetch_secs(img_ctx, ranges, ranges_cnt);
+
+    trace_end("schem probe");
+
     for(i = 0; i < schem_cnt; i++) {
         /* Create new scheme, do not initialize */
         res_new = schem_new(&schem, img_ctx, i, 0);
@@ -215,12 +414,30 @@ pres schem_ctx_load(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
     return pres_ok;
 }
 
-pres schem_ctx_save(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
+pres schem_ctx_load(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
+{
+    pu64 t;
+    pres res;
+
+    t = stats_begin(stats_schem_load);
+    res = schem_ctx_load_schemes(schem_ctx, img_ctx);
+    stats_end(stats_schem_load, t);
+
+    return res;
+}
+
+static pres schem_ctx_save_schemes(struct schem_ctx *schem_ctx,
+                                   const struct img_ctx *img_ctx)
 {
     int i;
     pres r;
     struct schem_funcs funcs;
 
+    if(img_ctx->read_only) {
+        plog_err("Image is opened in read-only mode");
+        return pres_fail;
+    }
+
     plog_dbg("Schemes save started");
 
     /* Remove schemes in image */
@@ -234,7 +451,10 @@ pres schem_ctx_save(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
             plog_dbg("Removing scheme #%d", i);
 
             schem_map_funcs(&funcs, i);
+
+            trace_begin("schem remove");
             r = funcs.remove(img_ctx);
+            trace_end("schem remove");
             if(!r) {
                 return pres_fail;
             }
@@ -267,6 +487,74 @@ pres schem_ctx_save(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
     return img_ctx_sync(img_ctx);
 }
 
+pres schem_ctx_save(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
+{
+    pu64 t;
+    pres res;
+
+    t = stats_begin(stats_schem_save);
+    res = schem_ctx_save_schemes(schem_ctx, img_ctx);
+    stats_end(stats_schem_save, t);
+
+    return res;
+}
+
+pres schem_remove_found(const struct img_ctx *img_ctx, const pflag *keep)
+{
+    int i;
+    struct schem schem;
+    enum schem_load_res res_load;
+    pres res;
+    struct schem_funcs funcs;
+    struct img_range ranges[schem_cnt * schem_probe_max_ranges];
+    pu32 ranges_cnt;
+
+    /* Read sectors, which are probed by the removed schemes, at once */
+    ranges_cnt = 0;
+    for(i = 0; i < schem_cnt; i++) {
+        if(keep[i]) {
+            continue;
+        }
+
+        schem_map_funcs(&funcs, i);
+        ranges_cnt += funcs.probe(img_ctx, &ranges[ranges_cnt]);
+    }
+
+    img_prefetch_secs(img_ctx, ranges, ranges_cnt);
+
+    for(i = 0; i < schem_cnt; i++) {
+        if(keep[i]) {
+            continue;
+        }
+
+        if(!schem_new(&schem, img_ctx, i, 0)) {
+            return pres_fail;
+        }
+
+        res_load = schem.funcs.load(&schem, img_ctx);
+        schem_free(&schem);
+
+        if(res_load == schem_load_fatal) {
+            return pres_fail;
+        }
+
+        if(res_load == schem_load_not_found) {
+            continue;
+        }
+
+        plog_dbg("Removing scheme #%d", i);
+
+        trace_begin("schem remove");
+        res = schem.funcs.remove(img_ctx);
+        trace_end("schem remove");
+        if(!res) {
+            return pres_fail;
+        }
+    }
+
+    return pres_ok;
+}
+
 enum schem_type schem_ctx_get_type(const struct schem_ctx *schem_ctx)
 {
     /* Check for GPT first, so we return GPT instead of protected MBR */
@@ -306,46 +594,125 @@ void schem_ctx_reset(struct schem_ctx *schem_ctx, pflag keep_scheme_flags)
     }
 }
 
-void schem_part_delete(struct schem_part *part)
+pres schem_table_alloc(struct schem *schem, pu32 part_cnt)
 {
-    memset(part, 0, sizeof(*part));
+    struct schem_part *table;
+    struct schem_index *index;
+    struct schem_ext *exts;
+    plba *max_end;
+    plba *part_start;
+
+    if(schem->index == NULL) {
+        schem->index = calloc(1, sizeof(*schem->index));
+        if(schem->index == NULL) {
+            return pres_fail;
+        }
+    }
+
+    index = schem->index;
+    index->valid = 0;
+
+    /* Index has room for every partition, so it is never reallocated
+     * during searches */
+    exts = realloc(index->exts, part_cnt * sizeof(*exts));
+    if(exts == NULL) {
+        return pres_fail;
+    }
+    index->exts = exts;
+
+    max_end = realloc(index->max_end, part_cnt * sizeof(*max_end));
+    if(max_end == NULL) {
+        return pres_fail;
+    }
+    index->max_end = max_end;
+
+    part_start = realloc(index->part_start, part_cnt * sizeof(*part_start));
+    if(part_start == NULL) {
+        return pres_fail;
+    }
+    index->part_start = part_start;
+
+    table = realloc(schem->table, part_cnt * sizeof(struct schem_part));
+    if(table == NULL) {
+        return pres_fail;
+    }
+
+    memset(table, 0, part_cnt * sizeof(struct schem_part));
+
+    schem->table = table;
+    schem->part_cnt = part_cnt;
+
+    return pres_ok;
+}
+
+void schem_part_changed(struct schem *schem, pu32 index)
+{
+    const struct schem_part *part;
+    struct schem_ext ext;
+
+    /* Outdated index is rebuilt as a whole anyway */
+    if(!schem->index->valid) {
+        return;
+    }
+
+    schem_index_remove(schem->index, index);
+
+    part = &schem->table[index];
+    if(!schem->funcs.part_is_used(part)) {
+        return;
+    }
+
+    ext.start_lba = part->start_lba;
+    ext.end_lba = part->end_lba;
+    ext.part = index;
+
+    schem_index_insert(schem->index, &ext);
+}
+
+void schem_table_changed(struct schem *schem)
+{
+    schem->index->valid = 0;
+}
+
+void schem_part_delete(struct schem *schem, pu32 index)
+{
+    memset(&schem->table[index], 0, sizeof(schem->table[index]));
+
+    schem_part_changed(schem, index);
 }
 
 p32 schem_find_overlap(const struct schem *schem, plba start_lba, plba end_lba,
                        p32 part_ign)
 {
+    const struct schem_index *index;
+    const struct schem_ext *ext;
     pu32 i;
-    const struct schem_part *part;
+    p32 found;
 
-    for(i = 0; i < schem->part_cnt; i++) {
-        if(i == part_ign) {
-            continue;
-        }
+    index = schem_index_get(schem);
 
-        part = &schem->table[i];
-
-        if(!schem->funcs.part_is_used(part)) {
-            continue;
+    /* Partitions, which start after the end LBA, can not overlap. Others
+     * are checked backwards, until none of the remaining ones reaches
+     * the start LBA */
+    found = -1;
+    for(i = schem_index_upper(index, end_lba); i > 0; i--) {
+        if(index->max_end[i - 1] < start_lba) {
+            break;
         }
 
-        /* Start LBA is inside of the partition */
-        if(start_lba >= part->start_lba && start_lba <= part->end_lba) {
-            return i;
-        }
+        ext = &index->exts[i - 1];
 
-        /* End LBA is inside of the partition */
-        if(end_lba >= part->start_lba && end_lba <= part->end_lba) {
-            return i;
+        if((p32) ext->part == part_ign || ext->end_lba < start_lba) {
+            continue;
         }
 
-        /* Partition is inside of the boundaries */
-        if(start_lba < part->start_lba && end_lba > part->end_lba) {
-            return i;
+        /* Lowest partition index is reported */
+        if(found == -1 || (p32) ext->part < found) {
+            found = ext->part;
         }
     }
 
-    /* No overlap detected */
-    return -1;
+    return found;
 }
 
 p32 schem_find_part_index(const struct schem *schem, pflag part_used)
@@ -364,11 +731,12 @@ p32 schem_find_part_index(const struct schem *schem, pflag part_used)
 plba_res schem_find_start_sector(const struct schem *schem,
                                  const struct img_ctx *img_ctx, p32 part_ign)
 {
+    const struct schem_index *index;
+    const struct schem_ext *ext;
     plba lba;
     plba lba_no_align;
-    pu32 i;
-    const struct schem_part *part;
-    pflag pos_changed;
+
+    index = schem_index_get(schem);
 
     lba_no_align = schem->first_usable_lba;
     lba = lba_align(img_ctx, lba_no_align, 1);
@@ -379,87 +747,62 @@ plba_res schem_find_start_sector(const struct schem *schem,
         lba_no_align = 0;
     }
 
-    do {
-        pos_changed = 0;
-
-        for(i = 0; i < schem->part_cnt; i++) {
-            if(i == part_ign) {
-                continue;
-            }
-
-            part = &schem->table[i];
-
-            if(!schem->funcs.part_is_used(part)) {
-                continue;
-            }
-
-            if(lba < part->start_lba || lba > part->end_lba) {
-                continue;
-            }
-
-            /* If current LBA intersects with partition */
+    for(;;) {
+        ext = schem_index_find(index, lba, part_ign);
 
-            pos_changed = 1;
-
-            /* If there is no align LBA from previous iteration, test it */
-            if(lba_no_align != 0) {
-                lba = lba_no_align;
-                lba_no_align = 0;
-                break;
-            }
+        /* Current LBA does not intersect with any partition */
+        if(ext == NULL) {
+            return lba;
+        }
 
-            /* Set no align LBA in case aligned LBA will intersect */
-            lba_no_align = part->end_lba + 1;
+        /* If there is no align LBA from previous iteration, test it */
+        if(lba_no_align != 0) {
+            lba = lba_no_align;
+            lba_no_align = 0;
+            continue;
+        }
 
-            /* If we reached the end of the usable space */
-            if(lba_no_align > schem->last_usable_lba) {
-                return -1;
-            }
+        /* Set no align LBA in case aligned LBA will intersect */
+        lba_no_align = ext->end_lba + 1;
 
-            /* Set aligned LBA for next iteration */
-            lba = lba_align(img_ctx, lba_no_align, 1);
+        /* If we reached the end of the usable space */
+        if(lba_no_align > schem->last_usable_lba) {
+            return -1;
+        }
 
-            /* If aligned LBA is after the end of usable space */
-            if(lba > schem->last_usable_lba) {
-                lba = lba_no_align;
-                lba_no_align = 0;
-            }
+        /* Set aligned LBA for next iteration */
+        lba = lba_align(img_ctx, lba_no_align, 1);
 
-            /* Break internal cycle */
-            break;
+        /* If aligned LBA is after the end of usable space */
+        if(lba > schem->last_usable_lba) {
+            lba = lba_no_align;
+            lba_no_align = 0;
         }
-    } while(pos_changed);
-
-    return lba;
+    }
 }
 
 plba_res schem_find_last_sector(const struct schem *schem,
                                 const struct img_ctx *img_ctx, p32 part_ign,
                                 plba first_lba)
 {
+    const struct schem_index *index;
     plba next_lba_bound;
     pu32 i;
-    const struct schem_part *part;
     plba test_end_lba;
 
-    next_lba_bound = schem->last_usable_lba;
+    index = schem_index_get(schem);
 
-    for(i = 0; i < schem->part_cnt; i++) {
-        if(i == part_ign) {
-            continue;
-        }
-
-        part = &schem->table[i];
+    next_lba_bound = schem->last_usable_lba;
 
-        if(!schem->funcs.part_is_used(part)) {
-            continue;
-        }
+    /* First partition, which is located further than first LBA */
+    i = schem_index_upper(index, first_lba);
+    while(i < index->cnt && (p32) index->exts[i].part == part_ign) {
+        i++;
+    }
 
-        /* If partition is located further than first LBA and LBA bound
-         * is less, than partition start */
-        if(part->start_lba > first_lba && part->start_lba < next_lba_bound) {
-            next_lba_bound = part->start_lba - 1;
-        }
+    /* If LBA bound is less, than partition start */
+    if(i < index->cnt && index->exts[i].start_lba < next_lba_bound) {
+        next_lba_bound = index->exts[i].start_lba - 1;
     }
 
     /* End LBA can not be less, than first LBA */
@@ -488,3 +831,395 @@ plba_res schem_find_last_sector(const struct schem *schem,
     return next_lba_bound;
 }
 
+
+pres schem_validate(const struct schem *schem, const struct img_ctx *img_ctx,
+                    pflag strict_align)
+{
+    const struct schem_index *index;
+    const struct schem_part *part;
+    const struct schem_ext *ext;
+    pu32 i, j;
+    pres res;
+
+    res = pres_ok;
+
+    for(i = 0; i < schem->part_cnt; i++) {
+        part = &schem->table[i];
+
+        if(!schem->funcs.part_is_used(part)) {
+            continue;
+        }
+
+        if(part->end_lba < part->start_lba) {
+            plog_err("Partition #%lu: end sector %llu is less, than start "
+                     "sector %llu", i + 1, part->end_lba, part->start_lba);
+            res = pres_fail;
+        }
+
+        if(
+            part->start_lba < schem->first_usable_lba ||
+            part->end_lba > schem->last_usable_lba
+        ) {
+            plog_err("Partition #%lu: sectors %llu-%llu are out of usable "
+                     "range (%llu-%llu)", i + 1, part->start_lba,
+                     part->end_lba, schem->first_usable_lba,
+                     schem->last_usable_lba);
+            res = pres_fail;
+        }
+
+        if(strict_align && part->start_lba % img_ctx->align != 0) {
+            plog_err("Partition #%lu: start sector %llu is not aligned to "
+                     "%llu sectors", i + 1, part->start_lba, img_ctx->align);
+            res = pres_fail;
+        }
+    }
+
+    /* Extent overlaps some previous one, if it starts before the maximum
+     * end LBA of them. The previous one is searched only then */
+    index = schem_index_get(schem);
+    for(i = 1; i < index->cnt; i++) {
+        ext = &index->exts[i];
+
+        if(ext->start_lba > index->max_end[i - 1]) {
+            continue;
+        }
+
+        for(j = i; j > 0; j--) {
+            if(index->exts[j - 1].end_lba >= ext->start_lba) {
+                break;
+            }
+        }
+
+        plog_err("Partition #%lu: overlap detected with partition #%lu",
+                 ext->part + 1, index->exts[j - 1].part + 1);
+        res = pres_fail;
+    }
+
+    return res;
+}
+
+static void schem_free_ext_set(struct schem_free_ext *ext,
+                               const struct img_ctx *img_ctx,
+                               plba start_lba, plba end_lba)
+{
+    plba align_end;
+
+    ext->start_lba = start_lba;
+    ext->end_lba = end_lba;
+    ext->secs = end_lba - start_lba + 1;
+
+    /* Aligned range ends before the aligned LBA, which is not after the
+     * end of the extent */
+    ext->align_start_lba = lba_align(img_ctx, start_lba, 1);
+    align_end = lba_align(img_ctx, end_lba + 1, 0);
+
+    if(ext->align_start_lba < align_end) {
+        ext->align_end_lba = align_end - 1;
+        ext->align_secs = align_end - ext->align_start_lba;
+    } else {
+        ext->align_start_lba = 0;
+        ext->align_end_lba = 0;
+        ext->align_secs = 0;
+    }
+}
+
+pres schem_find_free_exts(const struct schem *schem,
+                          const struct img_ctx *img_ctx, p32 part_ign,
+                          struct schem_free_ext **exts, pu32 *ext_cnt)
+{
+    const struct schem_index *index;
+    const struct schem_ext *ext;
+    struct schem_free_ext *free_exts;
+    pu32 cnt;
+    pu32 i;
+    plba lba;
+
+    index = schem_index_get(schem);
+
+    /* There is a free extent before each used partition and one after
+     * the last partition at most */
+    free_exts = malloc((index->cnt + 1) * sizeof(*free_exts));
+    if(free_exts == NULL) {
+        return pres_fail;
+    }
+
+    /* Next LBA, which is not known to be used */
+    lba = schem->first_usable_lba;
+    cnt = 0;
+
+    for(i = 0; i < index->cnt && lba <= schem->last_usable_lba; i++) {
+        ext = &index->exts[i];
+
+        if((p32) ext->part == part_ign) {
+            continue;
+        }
+
+        if(ext->start_lba > lba) {
+            schem_free_ext_set(&free_exts[cnt], img_ctx, lba,
+                               ext->start_lba - 1 < schem->last_usable_lba ?
+                               ext->start_lba - 1 : schem->last_usable_lba);
+            cnt++;
+        }
+
+        /* Partitions may overlap, so end LBA is not always increased */
+        if(ext->end_lba >= lba) {
+            lba = ext->end_lba + 1;
+        }
+    }
+
+    if(lba <= schem->last_usable_lba) {
+        schem_free_ext_set(&free_exts[cnt], img_ctx, lba,
+                           schem->last_usable_lba);
+        cnt++;
+    }
+
+    *exts = free_exts;
+    *ext_cnt = cnt;
+
+    return pres_ok;
+}
+
+void schem_free_stats(const struct schem_free_ext *exts, pu32 ext_cnt,
+                      struct schem_free_stats *stats)
+{
+    pu32 i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    stats->ext_cnt = ext_cnt;
+
+    for(i = 0; i < ext_cnt; i++) {
+        stats->free_secs += exts[i].secs;
+        stats->align_free_secs += exts[i].align_secs;
+
+        if(exts[i].secs > stats->largest_secs) {
+            stats->largest_secs = exts[i].secs;
+        }
+
+        if(exts[i].align_secs > stats->align_largest_secs) {
+            stats->align_largest_secs = exts[i].align_secs;
+        }
+    }
+}
+
+pres schem_alloc_part(const struct schem *schem, const struct img_ctx *img_ctx,
+                      enum schem_alloc_policy policy, plba secs, p32 part_ign,
+                      plba *start_lba, plba *end_lba)
+{
+    struct schem_free_ext *exts;
+    const struct schem_free_ext *ext;
+    const struct schem_free_ext *found;
+    pu32 ext_cnt;
+    pu32 i;
+
+    if(!schem_find_free_exts(schem, img_ctx, part_ign, &exts, &ext_cnt)) {
+        return pres_fail;
+    }
+
+    /* Of equal extents, the first one is chosen */
+    found = NULL;
+    for(i = 0; i < ext_cnt; i++) {
+        ext = &exts[i];
+
+        if(ext->secs < secs) {
+            continue;
+        }
+
+        if(found == NULL) {
+            found = ext;
+        } else if(policy == schem_alloc_first_fit) {
+            break;
+        } else if(policy == schem_alloc_best_fit && ext->secs < found->secs) {
+            found = ext;
+        } else if(policy == schem_alloc_largest && ext->secs > found->secs) {
+            found = ext;
+        }
+    }
+
+    if(found == NULL) {
+        free(exts);
+        return pres_fail;
+    }
+
+    if(secs == 0 && found->align_secs > 0) {
+        /* Whole aligned range */
+        *start_lba = found->align_start_lba;
+        *end_lba = found->align_end_lba;
+    } else if(secs == 0) {
+        *start_lba = found->start_lba;
+        *end_lba = found->end_lba;
+    } else if(lba_align(img_ctx, found->start_lba, 1) + secs - 1 <=
+              found->end_lba) {
+        *start_lba = lba_align(img_ctx, found->start_lba, 1);
+        *end_lba = *start_lba + secs - 1;
+    } else {
+        *start_lba = found->start_lba;
+        *end_lba = *start_lba + secs - 1;
+    }
+
+    free(exts);
+
+    return pres_ok;
+}
+
+static plba schem_align(plba lba, plba align, pflag next_aligned)
+{
+    return (lba / align) * align + (next_aligned && (lba % align) ? align : 0);
+}
+
+/* Places partition at LBA or after it, in free extents from the current
+ * one. Returns 0, if free space is over */
+static pflag schem_place_part(const struct schem_part_req *req, plba align,
+                              const struct schem_free_ext *exts, pu32 ext_cnt,
+                              pu32 *ext_pos, plba *lba, struct schem_ext *ext)
+{
+    const struct schem_free_ext *free_ext;
+    plba start_lba;
+    plba end_lba;
+
+    for(; *ext_pos < ext_cnt; (*ext_pos)++) {
+        free_ext = &exts[*ext_pos];
+
+        if(*lba < free_ext->start_lba) {
+            *lba = free_ext->start_lba;
+        }
+
+        /* Rest of the extent is used */
+        if(*lba > free_ext->end_lba) {
+            continue;
+        }
+
+        /* Aligned start is used, if partition still fits */
+        start_lba = schem_align(*lba, align, 1);
+        if(
+            start_lba > free_ext->end_lba ||
+            free_ext->end_lba - start_lba + 1 < req->secs
+        ) {
+            start_lba = *lba;
+        }
+
+        if(free_ext->end_lba - start_lba + 1 < req->secs) {
+            continue;
+        }
+
+        if(req->secs > 0) {
+            end_lba = start_lba + req->secs - 1;
+        } else {
+            /* Rest of the extent, up to an aligned end, if there is one */
+            end_lba = schem_align(free_ext->end_lba + 1, align, 0);
+            end_lba = end_lba > start_lba ? end_lba - 1 : free_ext->end_lba;
+        }
+
+        ext->start_lba = start_lba;
+        ext->end_lba = end_lba;
+        *lba = end_lba + 1;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+pres schem_add_parts(struct schem *schem, const struct img_ctx *img_ctx,
+                     const struct schem_part_req *reqs, pu32 req_cnt)
+{
+    struct schem_free_ext *exts;
+    struct schem_ext *placed;
+    struct guid *guids;
+    struct schem_part tmpl;
+    struct schem_part *part;
+    pu32 ext_cnt;
+    pu32 ext_pos;
+    pu32 free_cnt;
+    pu32 i, j;
+    plba lba;
+    pres res;
+
+    if(req_cnt == 0) {
+        return pres_ok;
+    }
+
+    free_cnt = 0;
+    for(i = 0; i < schem->part_cnt; i++) {
+        if(!schem->funcs.part_is_used(&schem->table[i])) {
+            free_cnt++;
+        }
+    }
+
+    if(free_cnt < req_cnt) {
+        plog_err("Unable to create %lu partitions, only %lu table entries "
+                 "are free", req_cnt, free_cnt);
+        return pres_fail;
+    }
+
+    if(!schem_find_free_exts(schem, img_ctx, -1, &exts, &ext_cnt)) {
+        return pres_fail;
+    }
+
+    placed = malloc(req_cnt * sizeof(*placed));
+    guids = malloc(req_cnt * sizeof(*guids));
+    if(placed == NULL || guids == NULL) {
+        free(exts);
+        free(placed);
+        free(guids);
+        return pres_fail;
+    }
+
+    /* All partitions are placed, before the table is changed */
+    res = pres_ok;
+    ext_pos = 0;
+    lba = 0;
+    for(i = 0; i < req_cnt; i++) {
+        if(!schem_place_part(&reqs[i],
+                             reqs[i].align ? reqs[i].align : img_ctx->align,
+                             exts, ext_cnt, &ext_pos, &lba, &placed[i])) {
+            plog_err("Unable to find free space for partition %lu of %lu",
+                     i + 1, req_cnt);
+            res = pres_fail;
+            break;
+        }
+    }
+
+    if(res) {
+        /* Partition GUIDs are created at once */
+        if(schem->type == schem_type_gpt) {
+            guid_create_n(guids, req_cnt);
+        }
+
+        schem->funcs.part_init(&tmpl);
+
+        j = 0;
+        for(i = 0; i < req_cnt; i++) {
+            while(schem->funcs.part_is_used(&schem->table[j])) {
+                j++;
+            }
+
+            part = &schem->table[j];
+            memcpy(part, &tmpl, sizeof(*part));
+            part->start_lba = placed[i].start_lba;
+            part->end_lba = placed[i].end_lba;
+
+            if(schem->type == schem_type_gpt) {
+                memcpy(&part->unique_guid, &guids[i], sizeof(guids[i]));
+            }
+
+            if(
+                schem->type == schem_type_gpt &&
+                !guid_is_zero(&reqs[i].type.guid)
+            ) {
+                memcpy(&part->type.guid, &reqs[i].type.guid,
+                       sizeof(part->type.guid));
+            } else if(schem->type == schem_type_mbr && reqs[i].type.i != 0) {
+                part->type.i = reqs[i].type.i;
+            }
+        }
+
+        schem_table_changed(schem);
+    }
+
+    free(exts);
+    free(placed);
+    free(guids);
+
+    return res;
+}
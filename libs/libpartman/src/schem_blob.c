@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "schem_blob.h"
+#include "log.h"
+#include "mbr.h"
+
+static pres schem_blob_read_secs(const struct img_ctx *ctx, plba lba,
+                                 plba secs_cnt, pu8 *buf)
+{
+    /* Blob is rendered for a blank image */
+    (void) lba;
+
+    memset(buf, 0, lba_to_byte(ctx, secs_cnt));
+
+    return pres_ok;
+}
+
+static pres schem_blob_write_secs(const struct img_ctx *ctx, plba lba,
+                                  struct iovec *iov, int iov_cnt)
+{
+    struct schem_blob *blob;
+    struct schem_blob_run *runs;
+    struct schem_blob_run *run;
+    pu64 len;
+    pu8 *buf;
+    int i;
+
+    blob = ctx->priv;
+
+    len = 0;
+    for(i = 0; i < iov_cnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    runs = realloc(blob->runs, (blob->run_cnt + 1) * sizeof(*runs));
+    if(runs == NULL) {
+        return pres_fail;
+    }
+    blob->runs = runs;
+
+    buf = malloc(len);
+    if(buf == NULL) {
+        return pres_fail;
+    }
+
+    run = &blob->runs[blob->run_cnt];
+    run->lba = lba;
+    run->secs_cnt = byte_to_lba(ctx, len, 0);
+    run->buf = buf;
+
+    for(i = 0; i < iov_cnt; i++) {
+        memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+        buf += iov[i].iov_len;
+    }
+
+    blob->run_cnt++;
+
+    return pres_ok;
+}
+
+static pres schem_blob_flush(const struct img_ctx *ctx)
+{
+    (void) ctx;
+
+    return pres_ok;
+}
+
+static pu64 schem_blob_size(const struct img_ctx *ctx)
+{
+    const struct schem_blob *blob;
+
+    blob = ctx->priv;
+
+    return blob->img_sz;
+}
+
+/* Backend, which captures written sectors into a blob */
+static const struct img_ops schem_blob_ops = {
+    &schem_blob_read_secs,
+    &schem_blob_write_secs,
+    &schem_blob_flush,
+    &schem_blob_size
+};
+
+pres schem_blob_render(struct schem_blob *blob, struct schem_ctx *schem_ctx,
+                       const struct img_ctx *img_ctx)
+{
+    struct img_ctx ctx;
+    pres res;
+    int i;
+
+    memset(blob, 0, sizeof(*blob));
+    blob->type = schem_ctx_get_type(schem_ctx);
+    blob->sec_sz = img_ctx->sec_sz;
+    blob->img_sz = img_ctx->img_sz;
+
+    for(i = 0; i < schem_cnt; i++) {
+        blob->schemes[i] = schem_ctx->schemes[i] != NULL;
+    }
+
+    if(blob->type == schem_cnt) {
+        plog_err("No partitioning scheme to render");
+        return pres_fail;
+    }
+
+    if(!img_ctx_init_ops(&ctx, img_ctx->img_name, &schem_blob_ops, blob)) {
+        return pres_fail;
+    }
+
+    /* Geometry must match the one, schemes were created for */
+    ctx.sec_sz = img_ctx->sec_sz;
+    ctx.align = img_ctx->align;
+    ctx.hpc = img_ctx->hpc;
+    ctx.spt = img_ctx->spt;
+    ctx.threads = img_ctx->threads;
+    ctx.gpt_part_cnt = img_ctx->gpt_part_cnt;
+
+    res = schem_ctx_save(schem_ctx, &ctx);
+
+    img_ctx_free(&ctx);
+
+    if(!res) {
+        schem_blob_free(blob);
+        return pres_fail;
+    }
+
+    plog_dbg("Rendered scheme #%d into %lu sector runs", blob->type,
+             blob->run_cnt);
+
+    return pres_ok;
+}
+
+void schem_blob_free(struct schem_blob *blob)
+{
+    pu32 i;
+
+    for(i = 0; i < blob->run_cnt; i++) {
+        free(blob->runs[i].buf);
+    }
+    free(blob->runs);
+
+    blob->runs = NULL;
+    blob->run_cnt = 0;
+}
+
+pflag schem_blob_fits(const struct schem_blob *blob,
+                      const struct img_ctx *img_ctx)
+{
+    return blob->run_cnt > 0 && blob->sec_sz == img_ctx->sec_sz &&
+           blob->img_sz == img_ctx->img_sz;
+}
+
+/* Copies blob runs, so they can be changed for a single image */
+static pres schem_blob_copy(struct schem_blob *dst,
+                            const struct schem_blob *src)
+{
+    pu32 i;
+    size_t len;
+
+    memcpy(dst, src, sizeof(*dst));
+    dst->run_cnt = 0;
+
+    dst->runs = malloc(src->run_cnt * sizeof(*dst->runs));
+    if(dst->runs == NULL) {
+        return pres_fail;
+    }
+
+    for(i = 0; i < src->run_cnt; i++) {
+        len = src->runs[i].secs_cnt * src->sec_sz;
+
+        dst->runs[i] = src->runs[i];
+        dst->runs[i].buf = malloc(len);
+        if(dst->runs[i].buf == NULL) {
+            schem_blob_free(dst);
+            return pres_fail;
+        }
+
+        memcpy(dst->runs[i].buf, src->runs[i].buf, len);
+        dst->run_cnt++;
+    }
+
+    return pres_ok;
+}
+
+pres schem_blob_stamp(const struct schem_blob *blob,
+                      const struct img_ctx *img_ctx,
+                      const struct schem_regen *regen)
+{
+    struct schem_blob copy;
+    struct schem_funcs funcs;
+    pu32 i;
+    pres res;
+
+    if(!schem_blob_fits(blob, img_ctx)) {
+        plog_err("Rendered scheme does not fit the image");
+        return pres_fail;
+    }
+
+    /* Schemes, which are not overwritten by the blob, are removed, same as
+     * on a regular save */
+    if(!schem_remove_found(img_ctx, blob->schemes)) {
+        return pres_fail;
+    }
+
+    if(!schem_blob_copy(&copy, blob)) {
+        return pres_fail;
+    }
+
+    schem_map_funcs(&funcs, blob->type);
+
+    res = funcs.regen(&copy, regen);
+
+    /* Bootstrap code of the image is kept */
+    if(res && blob->schemes[schem_type_mbr]) {
+        res = schem_mbr_keep_boot(&copy, img_ctx);
+    }
+
+    if(!res) {
+        schem_blob_free(&copy);
+        return pres_fail;
+    }
+
+    /* Runs go through the sector cache, so flush planner merges them and
+     * keeps the backup structures first */
+    res = pres_ok;
+    for(i = 0; res && i < copy.run_cnt; i++) {
+        res = img_write_secs(img_ctx, copy.runs[i].lba, copy.runs[i].secs_cnt,
+                             copy.runs[i].buf);
+    }
+
+    schem_blob_free(&copy);
+
+    if(!res) {
+        return pres_fail;
+    }
+
+    return img_ctx_sync(img_ctx);
+}
+
+pu8 *schem_blob_secs(const struct schem_blob *blob, plba lba, plba secs_cnt)
+{
+    const struct schem_blob_run *run;
+    pu32 i;
+
+    for(i = 0; i < blob->run_cnt; i++) {
+        run = &blob->runs[i];
+
+        if(lba >= run->lba && lba + secs_cnt <= run->lba + run->secs_cnt) {
+            return run->buf + (lba - run->lba) * blob->sec_sz;
+        }
+    }
+
+    return NULL;
+}
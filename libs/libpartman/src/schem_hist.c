@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "schem_hist.h"
+
+static void schem_hist_step_free(struct schem_hist_step *step)
+{
+    pu32 i;
+
+    for(i = 0; i < step->chunk_cnt; i++) {
+        free(step->chunks[i]);
+    }
+
+    free(step->chunks);
+    memset(step, 0, sizeof(*step));
+}
+
+/* Drops steps after the current position */
+static void schem_hist_drop_redo(struct schem_hist *hist)
+{
+    while(hist->step_cnt > hist->pos) {
+        hist->step_cnt--;
+        schem_hist_step_free(&hist->steps[hist->step_cnt]);
+    }
+}
+
+/* Returns the current step, which is created on the first change after
+ * snapshot */
+static struct schem_hist_step *schem_hist_step_get(struct schem_hist *hist)
+{
+    struct schem_hist_step *steps;
+    pu32 cap;
+
+    if(!hist->pending) {
+        return &hist->steps[hist->pos - 1];
+    }
+
+    schem_hist_drop_redo(hist);
+
+    /* Oldest step is dropped */
+    if(hist->step_cnt == schem_hist_max_steps) {
+        schem_hist_step_free(&hist->steps[0]);
+        memmove(&hist->steps[0], &hist->steps[1],
+                (hist->step_cnt - 1) * sizeof(*hist->steps));
+        hist->step_cnt--;
+        hist->pos--;
+    }
+
+    if(hist->step_cnt == hist->step_cap) {
+        cap = hist->step_cap ? hist->step_cap * 2 : 16;
+
+        steps = realloc(hist->steps, cap * sizeof(*steps));
+        if(steps == NULL) {
+            return NULL;
+        }
+
+        hist->steps = steps;
+        hist->step_cap = cap;
+    }
+
+    memset(&hist->steps[hist->step_cnt], 0, sizeof(*hist->steps));
+    hist->step_cnt++;
+    hist->pos = hist->step_cnt;
+    hist->pending = 0;
+
+    return &hist->steps[hist->pos - 1];
+}
+
+static pres schem_hist_step_add(struct schem_hist_step *step,
+                                struct schem_hist_chunk *chunk)
+{
+    struct schem_hist_chunk **chunks;
+    pu32 cap;
+
+    if(step->chunk_cnt == step->chunk_cap) {
+        cap = step->chunk_cap ? step->chunk_cap * 2 : 4;
+
+        chunks = realloc(step->chunks, cap * sizeof(*chunks));
+        if(chunks == NULL) {
+            return pres_fail;
+        }
+
+        step->chunks = chunks;
+        step->chunk_cap = cap;
+    }
+
+    step->chunks[step->chunk_cnt++] = chunk;
+
+    return pres_ok;
+}
+
+/* Swaps chunks and identifiers of the step with the current ones */
+static pres schem_hist_step_swap(struct schem_hist *hist,
+                                 struct schem_hist_step *step)
+{
+    struct schem_hist_chunk *chunk;
+    struct schem_part *parts;
+    struct schem_part part;
+    union schem_id id;
+    struct schem *schem;
+    pu32 i, j;
+
+    for(i = 0; i < schem_cnt; i++) {
+        schem = hist->schem_ctx->schemes[i];
+
+        if(!step->has_id[i] || schem == NULL) {
+            continue;
+        }
+
+        memcpy(&id, &schem->id, sizeof(id));
+        memcpy(&schem->id, &step->ids[i], sizeof(id));
+        memcpy(&step->ids[i], &id, sizeof(id));
+    }
+
+    for(i = 0; i < step->chunk_cnt; i++) {
+        chunk = step->chunks[i];
+        schem = hist->schem_ctx->schemes[chunk->type];
+
+        /* Schemes are replaced only after history is cleared */
+        if(schem == NULL) {
+            return pres_fail;
+        }
+
+        parts = &schem->table[chunk->chunk * schem_hist_chunk_parts];
+
+        for(j = 0; j < chunk->part_cnt; j++) {
+            memcpy(&part, &parts[j], sizeof(part));
+            memcpy(&parts[j], &chunk->parts[j], sizeof(part));
+            memcpy(&chunk->parts[j], &part, sizeof(part));
+        }
+
+        schem_table_changed(schem);
+    }
+
+    /* Next change starts a new step */
+    hist->serial++;
+    hist->pending = 1;
+
+    return pres_ok;
+}
+
+void schem_hist_init(struct schem_hist *hist, struct schem_ctx *schem_ctx)
+{
+    memset(hist, 0, sizeof(*hist));
+
+    hist->schem_ctx = schem_ctx;
+
+    /* Chunk snapshot numbers are 0 initially */
+    hist->serial = 1;
+    hist->pending = 1;
+}
+
+void schem_hist_free(struct schem_hist *hist)
+{
+    schem_hist_clear(hist);
+    free(hist->steps);
+    memset(hist, 0, sizeof(*hist));
+}
+
+void schem_hist_clear(struct schem_hist *hist)
+{
+    int i;
+
+    hist->pos = 0;
+    schem_hist_drop_redo(hist);
+
+    for(i = 0; i < schem_cnt; i++) {
+        free(hist->chunk_serial[i]);
+        hist->chunk_serial[i] = NULL;
+        hist->chunk_cnt[i] = 0;
+    }
+
+    hist->serial = 1;
+    hist->pending = 1;
+}
+
+void schem_hist_snap(struct schem_hist *hist)
+{
+    hist->serial++;
+    hist->pending = 1;
+}
+
+pres schem_hist_touch(struct schem_hist *hist, enum schem_type type,
+                      pu32 index)
+{
+    const struct schem *schem;
+    struct schem_hist_step *step;
+    struct schem_hist_chunk *chunk;
+    pu32 chunk_num;
+    pu32 chunk_cnt;
+
+    schem = hist->schem_ctx->schemes[type];
+    chunk_num = index / schem_hist_chunk_parts;
+
+    /* Snapshot numbers are allocated on the first change of the scheme */
+    if(hist->chunk_serial[type] == NULL) {
+        chunk_cnt = (schem->part_cnt + schem_hist_chunk_parts - 1) /
+                    schem_hist_chunk_parts;
+
+        hist->chunk_serial[type] = calloc(chunk_cnt, sizeof(pu32));
+        if(hist->chunk_serial[type] == NULL) {
+            return pres_fail;
+        }
+
+        hist->chunk_cnt[type] = chunk_cnt;
+    }
+
+    if(chunk_num >= hist->chunk_cnt[type]) {
+        return pres_fail;
+    }
+
+    /* Chunk is already copied since the last snapshot */
+    if(hist->chunk_serial[type][chunk_num] == hist->serial) {
+        return pres_ok;
+    }
+
+    step = schem_hist_step_get(hist);
+    if(step == NULL) {
+        return pres_fail;
+    }
+
+    chunk = malloc(sizeof(*chunk));
+    if(chunk == NULL) {
+        return pres_fail;
+    }
+
+    chunk->type = type;
+    chunk->chunk = chunk_num;
+    chunk->part_cnt = schem->part_cnt - chunk_num * schem_hist_chunk_parts;
+    if(chunk->part_cnt > schem_hist_chunk_parts) {
+        chunk->part_cnt = schem_hist_chunk_parts;
+    }
+
+    memcpy(chunk->parts, &schem->table[chunk_num * schem_hist_chunk_parts],
+           chunk->part_cnt * sizeof(*chunk->parts));
+
+    if(!schem_hist_step_add(step, chunk)) {
+        free(chunk);
+        return pres_fail;
+    }
+
+    hist->chunk_serial[type][chunk_num] = hist->serial;
+
+    return pres_ok;
+}
+
+pres schem_hist_touch_all(struct schem_hist *hist, enum schem_type type)
+{
+    const struct schem *schem;
+    struct schem_hist_step *step;
+    pu32 i;
+
+    schem = hist->schem_ctx->schemes[type];
+
+    step = schem_hist_step_get(hist);
+    if(step == NULL) {
+        return pres_fail;
+    }
+
+    if(!step->has_id[type]) {
+        memcpy(&step->ids[type], &schem->id, sizeof(schem->id));
+        step->has_id[type] = 1;
+    }
+
+    for(i = 0; i < schem->part_cnt; i += schem_hist_chunk_parts) {
+        if(!schem_hist_touch(hist, type, i)) {
+            return pres_fail;
+        }
+    }
+
+    return pres_ok;
+}
+
+pflag schem_hist_can_undo(const struct schem_hist *hist)
+{
+    return hist->pos > 0;
+}
+
+pflag schem_hist_can_redo(const struct schem_hist *hist)
+{
+    return hist->pos < hist->step_cnt;
+}
+
+pres schem_hist_undo(struct schem_hist *hist)
+{
+    if(!schem_hist_can_undo(hist)) {
+        return pres_fail;
+    }
+
+    hist->pos--;
+
+    return schem_hist_step_swap(hist, &hist->steps[hist->pos]);
+}
+
+pres schem_hist_redo(struct schem_hist *hist)
+{
+    if(!schem_hist_can_redo(hist)) {
+        return pres_fail;
+    }
+
+    hist->pos++;
+
+    return schem_hist_step_swap(hist, &hist->steps[hist->pos - 1]);
+}
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "schem_txn.h"
+#include "log.h"
+
+static void schem_txn_end(struct schem_txn *txn)
+{
+    free(txn->backup);
+    memset(txn, 0, sizeof(*txn));
+}
+
+static void schem_txn_set_type(const struct schem_txn *txn,
+                               struct schem_part *part,
+                               const struct schem_edit *edit)
+{
+    if(txn->schem->type == schem_type_gpt) {
+        memcpy(&part->type.guid, &edit->type.guid, sizeof(part->type.guid));
+    } else {
+        part->type.i = edit->type.i;
+    }
+}
+
+static pflag schem_txn_type_is_zero(const struct schem_txn *txn,
+                                    const struct schem_edit *edit)
+{
+    if(txn->schem->type == schem_type_gpt) {
+        return guid_is_zero(&edit->type.guid);
+    }
+
+    return edit->type.i == 0;
+}
+
+pres schem_txn_begin(struct schem_txn *txn, struct schem_ctx *schem_ctx,
+                     enum schem_type type)
+{
+    struct schem *schem;
+
+    memset(txn, 0, sizeof(*txn));
+
+    schem = schem_ctx->schemes[type];
+    if(schem == NULL) {
+        plog_err("Unable to start transaction, scheme is not present");
+        return pres_fail;
+    }
+
+    txn->backup = malloc(schem->part_cnt * sizeof(*txn->backup));
+    if(txn->backup == NULL && schem->part_cnt > 0) {
+        return pres_fail;
+    }
+
+    memcpy(txn->backup, schem->table, schem->part_cnt * sizeof(*txn->backup));
+
+    txn->schem_ctx = schem_ctx;
+    txn->schem = schem;
+    txn->backup_cnt = schem->part_cnt;
+
+    return pres_ok;
+}
+
+pres schem_txn_apply(struct schem_txn *txn, const struct schem_edit *edit)
+{
+    struct schem *schem;
+    struct schem_part *part;
+    pflag is_used;
+
+    schem = txn->schem;
+
+    if(edit->index >= schem->part_cnt) {
+        plog_err("Partition #%lu does not exist", edit->index + 1);
+        return pres_fail;
+    }
+
+    part = &schem->table[edit->index];
+    is_used = schem->funcs.part_is_used(part);
+
+    if(edit->op == schem_op_create ? is_used : !is_used) {
+        plog_err("Partition #%lu is %s", edit->index + 1,
+                 is_used ? "already used" : "not used");
+        return pres_fail;
+    }
+
+    switch(edit->op) {
+        case schem_op_create:
+            schem->funcs.part_init(part);
+            if(!schem_txn_type_is_zero(txn, edit)) {
+                schem_txn_set_type(txn, part, edit);
+            }
+            /* Fall through */
+
+        case schem_op_resize:
+            part->start_lba = edit->start_lba;
+            part->end_lba = edit->end_lba;
+            break;
+
+        case schem_op_delete:
+            schem_part_delete(schem, edit->index);
+            txn->edit_cnt++;
+            return pres_ok;
+
+        case schem_op_retype:
+            /* Zero type would delete the partition */
+            if(schem_txn_type_is_zero(txn, edit)) {
+                plog_err("Partition #%lu: type can not be empty",
+                         edit->index + 1);
+                return pres_fail;
+            }
+            schem_txn_set_type(txn, part, edit);
+            break;
+    }
+
+    schem_part_changed(schem, edit->index);
+    txn->edit_cnt++;
+
+    return pres_ok;
+}
+
+pres schem_txn_commit(struct schem_txn *txn, const struct img_ctx *img_ctx,
+                      pflag save)
+{
+    pres res;
+
+    plog_dbg("Committing %lu partition edits", txn->edit_cnt);
+
+    /* Whole table is validated once, after all edits */
+    res = schem_validate(txn->schem, img_ctx, txn->strict_align);
+    res = res && (!save || schem_ctx_save(txn->schem_ctx, img_ctx));
+
+    if(!res) {
+        schem_txn_rollback(txn);
+        return pres_fail;
+    }
+
+    schem_txn_end(txn);
+
+    return pres_ok;
+}
+
+void schem_txn_rollback(struct schem_txn *txn)
+{
+    /* Transaction is already ended */
+    if(txn->schem == NULL) {
+        return;
+    }
+
+    memcpy(txn->schem->table, txn->backup,
+           txn->backup_cnt * sizeof(*txn->backup));
+    schem_table_changed(txn->schem);
+
+    schem_txn_end(txn);
+}
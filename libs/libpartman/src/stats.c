@@ -0,0 +1,114 @@
+/* For clock_gettime() */
+#define _POSIX_C_SOURCE 199309L
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/* Statistics are updated from batch worker threads */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pflag stats_enabled;
+
+static struct stats stats_cur;
+
+static const char *stats_phase_names[stats_phase_cnt] = {
+    "image open",
+    "scheme probe/load",
+    "gpt_pair_load",
+    "GPT table CRC",
+    "scheme conversion",
+    "scheme save",
+    "image sync"
+};
+
+static const char *stats_call_names[stats_call_cnt] = {
+    "read",
+    "write",
+    "fsync",
+    "mmap",
+    "munmap",
+    "io_uring_enter"
+};
+
+void stats_enable(pflag enable)
+{
+    stats_enabled = enable;
+}
+
+pu64 stats_now(void)
+{
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        return 0;
+    }
+
+    return (pu64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+pu64 stats_begin(enum stats_phase phase)
+{
+    trace_begin(stats_phase_names[phase]);
+
+    if(!stats_enabled) {
+        return 0;
+    }
+
+    return stats_now();
+}
+
+void stats_end(enum stats_phase phase, pu64 start)
+{
+    pu64 end;
+
+    trace_end(stats_phase_names[phase]);
+
+    /* Phase was not timed */
+    if(start == 0) {
+        return;
+    }
+
+    end = stats_now();
+    if(end < start) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats_mutex);
+    stats_cur.phases[phase].cnt++;
+    stats_cur.phases[phase].ns += end - start;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_call(enum stats_call call, pu64 bytes)
+{
+    if(!stats_enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats_mutex);
+    stats_cur.calls[call].cnt++;
+    stats_cur.calls[call].bytes += bytes;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_get(struct stats *stats)
+{
+    pthread_mutex_lock(&stats_mutex);
+    memcpy(stats, &stats_cur, sizeof(*stats));
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+const char *stats_phase_name(enum stats_phase phase)
+{
+    return stats_phase_names[phase];
+}
+
+const char *stats_call_name(enum stats_call call)
+{
+    return stats_call_names[call];
+}
+
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "stats.h"
+#include "log.h"
+
+enum {
+    /* Maximum number of distinct threads, other threads get ID 0 */
+    trace_thread_max = 256
+};
+
+struct trace_event {
+    /* Step name, static string */
+    const char *name;
+
+    /* Time since trace start, in nanoseconds */
+    pu64 ts;
+
+    /* Thread ID, assigned by the order of first event */
+    pu32 tid;
+
+    /* Event phase: 'B' (begin) or 'E' (end) */
+    char ph;
+};
+
+/* Events are recorded from batch worker threads */
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Ring buffer, NULL if recording is stopped */
+static struct trace_event *trace_events;
+static pu32 trace_event_cnt;
+
+/* Number of events, recorded since start */
+static pu64 trace_total;
+
+/* Trace start time */
+static pu64 trace_start_ts;
+
+/* Threads, which recorded events, index is thread ID - 1 */
+static pthread_t trace_threads[trace_thread_max];
+static pu32 trace_thread_cnt;
+
+/* Must be called with trace mutex locked */
+static pu32 trace_tid(void)
+{
+    pthread_t self;
+    pu32 i;
+
+    self = pthread_self();
+
+    for(i = 0; i < trace_thread_cnt; i++) {
+        if(pthread_equal(trace_threads[i], self)) {
+            return i + 1;
+        }
+    }
+
+    if(trace_thread_cnt == trace_thread_max) {
+        return 0;
+    }
+
+    trace_threads[trace_thread_cnt++] = self;
+
+    return trace_thread_cnt;
+}
+
+static void trace_record(const char *name, char ph)
+{
+    struct trace_event *ev;
+    pu64 ts;
+
+    /* Recording is started before any worker thread */
+    if(trace_events == NULL) {
+        return;
+    }
+
+    ts = stats_now();
+
+    pthread_mutex_lock(&trace_mutex);
+
+    /* Oldest events are overwritten */
+    ev = &trace_events[trace_total % trace_event_cnt];
+    ev->name = name;
+    ev->ts = ts - trace_start_ts;
+    ev->tid = trace_tid();
+    ev->ph = ph;
+
+    trace_total++;
+
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+pres trace_start(pu32 event_cnt)
+{
+    trace_stop();
+
+    if(event_cnt == 0) {
+        return pres_fail;
+    }
+
+    trace_events = malloc(event_cnt * sizeof(*trace_events));
+    if(trace_events == NULL) {
+        plog_err("Failed to allocate trace buffer");
+        return pres_fail;
+    }
+
+    trace_event_cnt = event_cnt;
+    trace_total = 0;
+    trace_start_ts = stats_now();
+
+    /* Calling thread is the main one */
+    trace_thread_cnt = 0;
+    trace_tid();
+
+    return pres_ok;
+}
+
+void trace_begin(const char *name)
+{
+    trace_record(name, 'B');
+}
+
+void trace_end(const char *name)
+{
+    trace_record(name, 'E');
+}
+
+pres trace_save(const char *path)
+{
+    const struct trace_event *ev;
+    FILE *f;
+    pu64 first;
+    pu64 i;
+    pu32 j;
+    int res;
+
+    if(trace_events == NULL) {
+        return pres_fail;
+    }
+
+    f = fopen(path, "w");
+    if(f == NULL) {
+        perror("fopen()");
+        return pres_fail;
+    }
+
+    pthread_mutex_lock(&trace_mutex);
+
+    first = trace_total > trace_event_cnt ? trace_total - trace_event_cnt : 0;
+    if(first > 0) {
+        plog_info("Trace buffer overflowed, %llu oldest events are lost",
+                  first);
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+
+    /* Thread names */
+    for(j = 1; j <= trace_thread_cnt; j++) {
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%lu,\"args\":{\"name\":\"%s %lu\"}},\n", j,
+                j == 1 ? "main" : "worker", j);
+    }
+
+    for(i = first; i < trace_total; i++) {
+        ev = &trace_events[i % trace_event_cnt];
+
+        /* Timestamps are in microseconds */
+        fprintf(f, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+                "\"pid\":1,\"tid\":%lu},\n", ev->name, ev->ph,
+                ev->ts / 1000, ev->ts % 1000, ev->tid);
+    }
+
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"partman\"}}\n]}\n");
+
+    pthread_mutex_unlock(&trace_mutex);
+
+    res = fclose(f);
+    if(res == EOF) {
+        perror("fclose()");
+        return pres_fail;
+    }
+
+    return pres_ok;
+}
+
+void trace_stop(void)
+{
+    free(trace_events);
+    trace_events = NULL;
+    trace_event_cnt = 0;
+}
+
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "batch.h"
+#include "trace.h"
+
+/* State, shared between all workers of a batch */
+struct batch_pool {
+    batch_func func;
+    void *arg;
+    pres *res;
+    pu32 job_cnt;
+
+    /* Index of the next job to take */
+    pu32 job_next;
+    pthread_mutex_t lock;
+};
+
+static void *batch_worker(void *arg)
+{
+    struct batch_pool *pool;
+    pu32 index;
+
+    pool = arg;
+
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        index = pool->job_next;
+        if(index < pool->job_cnt) {
+            pool->job_next++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        /* No jobs left */
+        if(index >= pool->job_cnt) {
+            return NULL;
+        }
+
+        trace_begin("batch job");
+        pool->res[index] = pool->func(pool->arg, index);
+        trace_end("batch job");
+    }
+}
+
+void batch_run(batch_func func, void *arg, pres *res, pu32 job_cnt,
+               pu32 thread_cnt)
+{
+    struct batch_pool pool;
+    pthread_t *threads;
+    pu32 started;
+
+    pool.func = func;
+    pool.arg = arg;
+    pool.res = res;
+    pool.job_cnt = job_cnt;
+    pool.job_next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    if(thread_cnt > job_cnt) {
+        thread_cnt = job_cnt;
+    }
+
+    /* Calling thread is a worker too */
+    threads = NULL;
+    if(thread_cnt > 1) {
+        threads = malloc((thread_cnt - 1) * sizeof(*threads));
+    }
+
+    started = 0;
+    while(threads && started < thread_cnt - 1) {
+        if(pthread_create(&threads[started], NULL, &batch_worker, &pool)) {
+            break;
+        }
+        started++;
+    }
+
+    batch_worker(&pool);
+
+    while(started > 0) {
+        started--;
+        pthread_join(threads[started], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+}
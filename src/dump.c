@@ -0,0 +1,526 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "dump.h"
+#include "gpt.h"
+#include "log.h"
+
+enum {
+    /* Initial buffer size, in bytes, for disk fields and per partition */
+    dump_disk_sz = 512,
+    dump_part_sz = 384
+};
+
+/* Output buffer. Everything is formatted here and written at once */
+struct dump_buf {
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    /* Set, if memory allocation failed */
+    pflag err;
+};
+
+static pflag dump_reserve(struct dump_buf *b, size_t len)
+{
+    char *buf;
+    size_t cap;
+
+    if(b->err) {
+        return 0;
+    }
+
+    if(b->len + len <= b->cap) {
+        return 1;
+    }
+
+    cap = b->cap ? b->cap : dump_disk_sz;
+    while(cap < b->len + len) {
+        cap *= 2;
+    }
+
+    buf = realloc(b->buf, cap);
+    if(buf == NULL) {
+        b->err = 1;
+        return 0;
+    }
+
+    b->buf = buf;
+    b->cap = cap;
+
+    return 1;
+}
+
+static void dump_chr(struct dump_buf *b, char c)
+{
+    if(dump_reserve(b, 1)) {
+        b->buf[b->len++] = c;
+    }
+}
+
+static void dump_str(struct dump_buf *b, const char *s)
+{
+    size_t len;
+
+    len = strlen(s);
+
+    if(dump_reserve(b, len)) {
+        memcpy(b->buf + b->len, s, len);
+        b->len += len;
+    }
+}
+
+static void dump_u64(struct dump_buf *b, pu64 val)
+{
+    char digits[20];
+    int i;
+
+    i = 0;
+    do {
+        digits[i++] = '0' + val % 10;
+        val /= 10;
+    } while(val);
+
+    if(dump_reserve(b, i)) {
+        while(i > 0) {
+            b->buf[b->len++] = digits[--i];
+        }
+    }
+}
+
+static void dump_hex(struct dump_buf *b, pu64 val, int digit_cnt)
+{
+    static const char digits[] = "0123456789ABCDEF";
+
+    if(dump_reserve(b, digit_cnt)) {
+        while(digit_cnt > 0) {
+            digit_cnt--;
+            b->buf[b->len++] = digits[(val >> (digit_cnt * 4)) & 0xF];
+        }
+    }
+}
+
+/* Registry format GUID string representation, same as guid_to_str() */
+static void dump_guid(struct dump_buf *b, const struct guid *guid)
+{
+    int i;
+
+    dump_hex(b, guid->time_lo, 8);
+    dump_chr(b, '-');
+    dump_hex(b, guid->time_mid, 4);
+    dump_chr(b, '-');
+    dump_hex(b, guid->time_hi_ver, 4);
+    dump_chr(b, '-');
+    dump_hex(b, guid->cl_seq_hi_res, 2);
+    dump_hex(b, guid->cl_seq_lo, 2);
+    dump_chr(b, '-');
+
+    for(i = 0; i < ARRAY_SIZE(guid->nodes); i++) {
+        dump_hex(b, guid->nodes[i], 2);
+    }
+}
+
+/* Appends a character, escaped for JSON string or columnar field */
+static void dump_esc(struct dump_buf *b, pchar_ucs c, enum dump_fmt fmt)
+{
+    if(fmt == dump_fmt_json && (c == '"' || c == '\\')) {
+        dump_chr(b, '\\');
+        dump_chr(b, c);
+        return;
+    }
+
+    if(c < 0x20 || c == 0x7F) {
+        if(fmt == dump_fmt_json) {
+            dump_str(b, "\\u00");
+            dump_hex(b, c, 2);
+        } else {
+            dump_chr(b, '?');
+        }
+        return;
+    }
+
+    /* UCS-2 to UTF-8 */
+    if(c < 0x80) {
+        dump_chr(b, c);
+    } else if(c < 0x800) {
+        dump_chr(b, 0xC0 | (c >> 6));
+        dump_chr(b, 0x80 | (c & 0x3F));
+    } else {
+        dump_chr(b, 0xE0 | ((c >> 12) & 0x0F));
+        dump_chr(b, 0x80 | ((c >> 6) & 0x3F));
+        dump_chr(b, 0x80 | (c & 0x3F));
+    }
+}
+
+static void dump_cstr(struct dump_buf *b, const char *s, enum dump_fmt fmt)
+{
+    for(; *s != '\0'; s++) {
+        /* Multibyte sequences are copied as they are */
+        if((unsigned char) *s >= 0x80) {
+            dump_chr(b, *s);
+        } else {
+            dump_esc(b, (unsigned char) *s, fmt);
+        }
+    }
+}
+
+static void dump_name(struct dump_buf *b, const pchar_ucs *name,
+                      pu32 name_len, enum dump_fmt fmt)
+{
+    pu32 i;
+
+    for(i = 0; i < name_len && name[i] != 0; i++) {
+        dump_esc(b, name[i] & 0xFFFF, fmt);
+    }
+}
+
+static const char *dump_copy_str(enum schem_gpt_copy status)
+{
+    switch(status) {
+        case schem_gpt_copy_ok:
+            return "ok";
+
+        case schem_gpt_copy_hdr_inv:
+            return "header_invalid";
+
+        case schem_gpt_copy_table_inv:
+            return "table_invalid";
+
+        default:
+            return "unknown";
+    }
+}
+
+/* JSON helpers. Key is appended with a leading comma, unless it is the
+ * first one in an object */
+static void dump_json_key(struct dump_buf *b, const char *key, pflag first)
+{
+    if(!first) {
+        dump_chr(b, ',');
+    }
+    dump_chr(b, '"');
+    dump_str(b, key);
+    dump_str(b, "\":");
+}
+
+static void dump_json_u64(struct dump_buf *b, const char *key, pu64 val)
+{
+    dump_json_key(b, key, 0);
+    dump_u64(b, val);
+}
+
+static void dump_json_str(struct dump_buf *b, const char *key, const char *s)
+{
+    dump_json_key(b, key, 0);
+    dump_chr(b, '"');
+    dump_cstr(b, s, dump_fmt_json);
+    dump_chr(b, '"');
+}
+
+static void dump_json_guid(struct dump_buf *b, const char *key,
+                           const struct guid *guid)
+{
+    dump_json_key(b, key, 0);
+    dump_chr(b, '"');
+    dump_guid(b, guid);
+    dump_chr(b, '"');
+}
+
+static void dump_json_bool(struct dump_buf *b, const char *key, pflag val)
+{
+    dump_json_key(b, key, 0);
+    dump_str(b, val ? "true" : "false");
+}
+
+static void dump_json_part(struct dump_buf *b, const struct schem *schem,
+                           const struct img_ctx *img_ctx, pu32 index,
+                           pflag first)
+{
+    const struct schem_part *part;
+    plba secs_cnt;
+
+    part = &schem->table[index];
+    secs_cnt = part->end_lba - part->start_lba + 1;
+
+    if(!first) {
+        dump_chr(b, ',');
+    }
+
+    dump_chr(b, '{');
+    dump_json_key(b, "index", 1);
+    dump_u64(b, index + 1);
+    dump_json_u64(b, "start_lba", part->start_lba);
+    dump_json_u64(b, "end_lba", part->end_lba);
+    dump_json_u64(b, "sectors", secs_cnt);
+    dump_json_u64(b, "size", lba_to_byte(img_ctx, secs_cnt));
+
+    if(schem->type == schem_type_gpt) {
+        dump_json_guid(b, "type", &part->type.guid);
+        dump_json_guid(b, "uuid", &part->unique_guid);
+
+        /* Attribute bits 48-63 exceed double precision of JSON consumers */
+        dump_json_key(b, "attr", 0);
+        dump_str(b, "\"0x");
+        dump_hex(b, part->attr, 16);
+        dump_chr(b, '"');
+
+        dump_json_key(b, "name", 0);
+        dump_chr(b, '"');
+        dump_name(b, part->name, ARRAY_SIZE(part->name), dump_fmt_json);
+        dump_chr(b, '"');
+    } else {
+        dump_json_key(b, "type", 0);
+        dump_str(b, "\"0x");
+        dump_hex(b, part->type.i, 2);
+        dump_chr(b, '"');
+        dump_json_bool(b, "bootable", part->boot_ind & 0x80);
+    }
+
+    dump_json_bool(b, "aligned", part->start_lba % img_ctx->align == 0);
+    dump_chr(b, '}');
+}
+
+static void dump_json(struct dump_buf *b, const struct schem *schem,
+                      const struct img_ctx *img_ctx)
+{
+    pu32 i;
+    pflag first;
+
+    dump_chr(b, '{');
+    dump_json_key(b, "image", 1);
+    dump_chr(b, '"');
+    dump_cstr(b, img_ctx->img_name, dump_fmt_json);
+    dump_chr(b, '"');
+    dump_json_u64(b, "sector_size", img_ctx->sec_sz);
+    dump_json_u64(b, "size", img_ctx->img_sz);
+    dump_json_u64(b, "sectors", byte_to_lba(img_ctx, img_ctx->img_sz, 0));
+    dump_json_u64(b, "alignment", img_ctx->align);
+
+    if(!schem) {
+        dump_json_key(b, "scheme", 0);
+        dump_str(b, "null}\n");
+        return;
+    }
+
+    if(schem->type == schem_type_gpt) {
+        dump_json_str(b, "scheme", "gpt");
+        dump_json_guid(b, "id", &schem->id.guid);
+    } else {
+        dump_json_str(b, "scheme", "mbr");
+        dump_json_key(b, "id", 0);
+        dump_str(b, "\"0x");
+        dump_hex(b, schem->id.i, 8);
+        dump_chr(b, '"');
+    }
+
+    dump_json_u64(b, "first_usable_lba", schem->first_usable_lba);
+    dump_json_u64(b, "last_usable_lba", schem->last_usable_lba);
+    dump_json_u64(b, "table_entries", schem->part_cnt);
+
+    if(schem->type == schem_type_gpt) {
+        dump_json_str(b, "primary",
+                      dump_copy_str(schem_gpt_copy_status(schem, 0)));
+        dump_json_str(b, "secondary",
+                      dump_copy_str(schem_gpt_copy_status(schem, 1)));
+    }
+
+    dump_json_key(b, "partitions", 0);
+    dump_chr(b, '[');
+
+    first = 1;
+    for(i = 0; i < schem->part_cnt; i++) {
+        if(!schem->funcs.part_is_used(&schem->table[i])) {
+            continue;
+        }
+
+        dump_json_part(b, schem, img_ctx, i, first);
+        first = 0;
+    }
+
+    dump_str(b, "]}\n");
+}
+
+static void dump_col_part(struct dump_buf *b, const struct schem *schem,
+                          const struct img_ctx *img_ctx, pu32 index)
+{
+    const struct schem_part *part;
+    plba secs_cnt;
+
+    part = &schem->table[index];
+    secs_cnt = part->end_lba - part->start_lba + 1;
+
+    dump_u64(b, index + 1);
+    dump_chr(b, ' ');
+    dump_u64(b, part->start_lba);
+    dump_chr(b, ' ');
+    dump_u64(b, part->end_lba);
+    dump_chr(b, ' ');
+    dump_u64(b, secs_cnt);
+    dump_chr(b, ' ');
+    dump_u64(b, lba_to_byte(img_ctx, secs_cnt));
+    dump_chr(b, ' ');
+
+    if(schem->type == schem_type_gpt) {
+        dump_guid(b, &part->type.guid);
+        dump_chr(b, ' ');
+        dump_guid(b, &part->unique_guid);
+        dump_str(b, " 0x");
+        dump_hex(b, part->attr, 16);
+        dump_str(b, " - ");
+    } else {
+        dump_str(b, "0x");
+        dump_hex(b, part->type.i, 2);
+        dump_str(b, " - - ");
+        dump_str(b, part->boot_ind & 0x80 ? "yes " : "no ");
+    }
+
+    dump_str(b, part->start_lba % img_ctx->align == 0 ? "yes " : "no ");
+
+    /* Name is the last column, so it may contain spaces */
+    if(schem->type == schem_type_gpt && part->name[0] != 0) {
+        dump_name(b, part->name, ARRAY_SIZE(part->name), dump_fmt_columns);
+    } else {
+        dump_chr(b, '-');
+    }
+
+    dump_chr(b, '\n');
+}
+
+static void dump_columns(struct dump_buf *b, const struct schem *schem,
+                         const struct img_ctx *img_ctx)
+{
+    pu32 i;
+
+    dump_str(b, "image=");
+    dump_cstr(b, img_ctx->img_name, dump_fmt_columns);
+    dump_str(b, " sector_size=");
+    dump_u64(b, img_ctx->sec_sz);
+    dump_str(b, " size=");
+    dump_u64(b, img_ctx->img_sz);
+    dump_str(b, " sectors=");
+    dump_u64(b, byte_to_lba(img_ctx, img_ctx->img_sz, 0));
+    dump_str(b, " alignment=");
+    dump_u64(b, img_ctx->align);
+
+    if(!schem) {
+        dump_str(b, " scheme=none\n");
+        return;
+    }
+
+    if(schem->type == schem_type_gpt) {
+        dump_str(b, " scheme=gpt id=");
+        dump_guid(b, &schem->id.guid);
+    } else {
+        dump_str(b, " scheme=mbr id=0x");
+        dump_hex(b, schem->id.i, 8);
+    }
+
+    dump_str(b, " first_usable_lba=");
+    dump_u64(b, schem->first_usable_lba);
+    dump_str(b, " last_usable_lba=");
+    dump_u64(b, schem->last_usable_lba);
+    dump_str(b, " table_entries=");
+    dump_u64(b, schem->part_cnt);
+
+    if(schem->type == schem_type_gpt) {
+        dump_str(b, " primary=");
+        dump_str(b, dump_copy_str(schem_gpt_copy_status(schem, 0)));
+        dump_str(b, " secondary=");
+        dump_str(b, dump_copy_str(schem_gpt_copy_status(schem, 1)));
+    }
+
+    dump_str(b, "\nindex start_lba end_lba sectors size type uuid attr "
+                "bootable aligned name\n");
+
+    for(i = 0; i < schem->part_cnt; i++) {
+        if(schem->funcs.part_is_used(&schem->table[i])) {
+            dump_col_part(b, schem, img_ctx, i);
+        }
+    }
+}
+
+static pres dump_write(const struct dump_buf *b)
+{
+    const char *buf;
+    size_t len;
+    ssize_t c;
+
+    /* Anything, printed before, must come first */
+    fflush(stdout);
+
+    buf = b->buf;
+    len = b->len;
+
+    while(len > 0) {
+        c = write(STDOUT_FILENO, buf, len);
+        if(c == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if(c == -1) {
+            perror("write()");
+            return pres_fail;
+        }
+
+        buf += c;
+        len -= c;
+    }
+
+    return pres_ok;
+}
+
+pres dump_fmt_parse(const char *str, enum dump_fmt *fmt)
+{
+    if(0 == strcmp(str, "json")) {
+        *fmt = dump_fmt_json;
+        return pres_ok;
+    }
+
+    if(0 == strcmp(str, "columns")) {
+        *fmt = dump_fmt_columns;
+        return pres_ok;
+    }
+
+    return pres_fail;
+}
+
+pres dump_scheme(const struct schem *schem, const struct img_ctx *img_ctx,
+                 enum dump_fmt fmt)
+{
+    struct dump_buf b;
+    pres res;
+
+    memset(&b, 0, sizeof(b));
+
+    /* Buffer is sized for the whole table upfront */
+    dump_reserve(&b, dump_disk_sz +
+                     (schem ? (size_t) schem->part_cnt * dump_part_sz : 0));
+
+    switch(fmt) {
+        case dump_fmt_json:
+            dump_json(&b, schem, img_ctx);
+            break;
+
+        case dump_fmt_columns:
+            dump_columns(&b, schem, img_ctx);
+            break;
+
+        case dump_fmt_none:
+            break;
+    }
+
+    if(b.err) {
+        plog_err("Failed to allocate dump buffer");
+        free(b.buf);
+        return pres_fail;
+    }
+
+    res = dump_write(&b);
+
+    free(b.buf);
+
+    return res;
+}
@@ -0,0 +1,661 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "layout.h"
+#include "schem_txn.h"
+#include "log.h"
+
+enum {
+    /* Maximum layout line length, in bytes */
+    layout_line_sz = 1024,
+
+    /* Initial capacity of layout partition array */
+    layout_parts_init = 8
+};
+
+/* Layout parser state */
+struct layout_parser {
+    /* Layout file path and current line number, used for error messages */
+    const char *path;
+    pu32 line;
+
+    /* Set, if scheme type is already specified */
+    pflag has_label;
+};
+
+static void layout_err(const struct layout_parser *p, const char *msg)
+{
+    plog_err("%s:%lu: %s", p->path, p->line, msg);
+}
+
+static char *layout_str_trim(char *s)
+{
+    int len;
+
+    while(isspace((unsigned char) *s)) {
+        s++;
+    }
+
+    len = strlen(s);
+    while(len > 0 && isspace((unsigned char) s[len - 1])) {
+        len--;
+    }
+    s[len] = '\0';
+
+    return s;
+}
+
+static pres layout_parse_val(const char *s, struct layout_val *val)
+{
+    static const char modifiers[] = { 'K', 'M', 'G', 'T', 'P' };
+
+    int n;
+    int i;
+    int j;
+
+    if(!isdigit((unsigned char) *s)) {
+        return pres_fail;
+    }
+
+    if(sscanf(s, "%llu%n", &val->val, &n) != 1) {
+        return pres_fail;
+    }
+
+    s += n;
+    val->bytes = 0;
+
+    /* Plain value is in sectors */
+    if(*s == '\0') {
+        return pres_ok;
+    }
+
+    /* Size modifier, optionally followed by 'iB' */
+    if(s[1] != '\0' && strcmp(s + 1, "iB") != 0) {
+        return pres_fail;
+    }
+
+    for(i = 0; i < ARRAY_SIZE(modifiers); i++) {
+        if(toupper((unsigned char) *s) != modifiers[i]) {
+            continue;
+        }
+
+        /* Modifier value is 2^(10 * (i + 1)) */
+        for(j = 0; j <= i; j++) {
+            val->val *= 1024;
+        }
+
+        val->bytes = 1;
+        return pres_ok;
+    }
+
+    return pres_fail;
+}
+
+/* Converts UTF-8 string to UCS-2 partition name */
+static pres layout_parse_name(const char *s, pchar_ucs *name, pu32 name_len)
+{
+    const pu8 *c;
+    pu32 i;
+
+    c = (const pu8 *) s;
+
+    for(i = 0; *c != '\0'; i++) {
+        if(i >= name_len) {
+            return pres_fail;
+        }
+
+        if(c[0] < 0x80) {
+            name[i] = c[0];
+            c++;
+        } else if((c[0] & 0xE0) == 0xC0 && (c[1] & 0xC0) == 0x80) {
+            name[i] = (pchar_ucs) (c[0] & 0x1F) << 6 | (c[1] & 0x3F);
+            c += 2;
+        } else if(
+            (c[0] & 0xF0) == 0xE0 && (c[1] & 0xC0) == 0x80 &&
+            (c[2] & 0xC0) == 0x80
+        ) {
+            name[i] = (pchar_ucs) (c[0] & 0x0F) << 12 |
+                      (pchar_ucs) (c[1] & 0x3F) << 6 | (c[2] & 0x3F);
+            c += 3;
+        } else {
+            /* Not representable with UCS-2 */
+            return pres_fail;
+        }
+    }
+
+    return pres_ok;
+}
+
+static pres layout_parse_type(const struct layout *layout, const char *s,
+                              struct layout_part *part)
+{
+    char *end;
+    unsigned long i;
+
+    if(layout->type == schem_type_gpt) {
+        return str_to_guid(s, &part->type.guid) &&
+               !guid_is_zero(&part->type.guid);
+    }
+
+    i = strtoul(s, &end, 16);
+
+    /* Value is not a single non-zero byte */
+    if(*s == '\0' || *end != '\0' || i == 0 || i > 0xFF) {
+        return pres_fail;
+    }
+
+    part->type.i = i;
+
+    return pres_ok;
+}
+
+static pres layout_parse_id(struct layout *layout, const char *s)
+{
+    char *end;
+
+    if(layout->type == schem_type_gpt) {
+        return str_to_guid(s, &layout->id.guid);
+    }
+
+    layout->id.i = strtoul(s, &end, 16);
+
+    return *s != '\0' && *end == '\0' && (layout->id.i & ~0xFFFFFFFFUL) == 0;
+}
+
+static pres layout_parse_header(struct layout_parser *p, struct layout *layout,
+                                const char *key, char *val)
+{
+    val = layout_str_trim(val);
+
+    if(0 == strcmp(key, "label")) {
+        if(p->has_label) {
+            layout_err(p, "Scheme type is already specified");
+            return pres_fail;
+        }
+
+        if(0 == strcmp(val, "gpt")) {
+            layout->type = schem_type_gpt;
+        } else if(0 == strcmp(val, "mbr") || 0 == strcmp(val, "dos")) {
+            layout->type = schem_type_mbr;
+        } else {
+            layout_err(p, "Unknown scheme type");
+            return pres_fail;
+        }
+
+        p->has_label = 1;
+        return pres_ok;
+    }
+
+    if(!p->has_label) {
+        layout_err(p, "Scheme type must be specified first");
+        return pres_fail;
+    }
+
+    if(0 == strcmp(key, "label-id")) {
+        if(!layout_parse_id(layout, val)) {
+            layout_err(p, "Invalid disk identifier");
+            return pres_fail;
+        }
+
+        layout->has_id = 1;
+        return pres_ok;
+    }
+
+    if(0 == strcmp(key, "unit")) {
+        if(0 != strcmp(val, "sectors")) {
+            layout_err(p, "Only sector units are supported");
+            return pres_fail;
+        }
+
+        return pres_ok;
+    }
+
+    layout_err(p, "Unknown header");
+    return pres_fail;
+}
+
+static pres layout_parse_field(struct layout_parser *p, struct layout *layout,
+                               struct layout_part *part, const char *key,
+                               const char *val)
+{
+    pflag is_gpt;
+
+    is_gpt = layout->type == schem_type_gpt;
+
+    /* Flag fields */
+    if(0 == strcmp(key, "bootable")) {
+        if(val || is_gpt) {
+            layout_err(p, "Invalid bootable flag");
+            return pres_fail;
+        }
+
+        part->bootable = 1;
+        return pres_ok;
+    }
+
+    /* Value fields */
+    if(!val) {
+        layout_err(p, "Missing field value");
+        return pres_fail;
+    }
+
+    if(0 == strcmp(key, "start")) {
+        part->has_start = layout_parse_val(val, &part->start);
+        if(!part->has_start) {
+            layout_err(p, "Invalid partition start");
+            return pres_fail;
+        }
+        return pres_ok;
+    }
+
+    if(0 == strcmp(key, "size")) {
+        /* All available space */
+        if(0 == strcmp(val, "+")) {
+            part->has_size = 0;
+            return pres_ok;
+        }
+
+        part->has_size = layout_parse_val(val, &part->size);
+        if(!part->has_size || part->size.val == 0) {
+            layout_err(p, "Invalid partition size");
+            return pres_fail;
+        }
+        return pres_ok;
+    }
+
+    if(0 == strcmp(key, "type")) {
+        part->has_type = layout_parse_type(layout, val, part);
+        if(!part->has_type) {
+            layout_err(p, "Invalid partition type");
+            return pres_fail;
+        }
+        return pres_ok;
+    }
+
+    if(0 == strcmp(key, "uuid")) {
+        part->has_uuid = is_gpt && str_to_guid(val, &part->uuid);
+        if(!part->has_uuid) {
+            layout_err(p, "Invalid partition GUID");
+            return pres_fail;
+        }
+        return pres_ok;
+    }
+
+    if(0 == strcmp(key, "name")) {
+        part->has_name = is_gpt &&
+                         layout_parse_name(val, part->name,
+                                           ARRAY_SIZE(part->name));
+        if(!part->has_name) {
+            layout_err(p, "Invalid partition name");
+            return pres_fail;
+        }
+        return pres_ok;
+    }
+
+    layout_err(p, "Unknown partition field");
+    return pres_fail;
+}
+
+static struct layout_part *layout_part_add(struct layout *layout, pu32 *cap)
+{
+    struct layout_part *parts;
+
+    if(layout->part_cnt >= *cap) {
+        *cap = *cap ? *cap * 2 : layout_parts_init;
+
+        parts = realloc(layout->parts, *cap * sizeof(*parts));
+        if(parts == NULL) {
+            return NULL;
+        }
+
+        layout->parts = parts;
+    }
+
+    parts = &layout->parts[layout->part_cnt];
+    memset(parts, 0, sizeof(*parts));
+
+    layout->part_cnt++;
+
+    return parts;
+}
+
+/* Partition line is a list of 'key=value' fields or flags, separated by
+ * commas and/or whitespace. Values may be double-quoted */
+static pres layout_parse_part(struct layout_parser *p, struct layout *layout,
+                              char *s, pu32 *cap)
+{
+    struct layout_part *part;
+    char *key;
+    char *val;
+    char c;
+
+    if(!p->has_label) {
+        layout_err(p, "Scheme type must be specified first");
+        return pres_fail;
+    }
+
+    part = layout_part_add(layout, cap);
+    if(part == NULL) {
+        layout_err(p, "Out of memory");
+        return pres_fail;
+    }
+
+    for(;;) {
+        while(isspace((unsigned char) *s) || *s == ',') {
+            s++;
+        }
+
+        /* End of line or comment */
+        if(*s == '\0' || *s == '#') {
+            return pres_ok;
+        }
+
+        key = s;
+        while(isalnum((unsigned char) *s) || *s == '-' || *s == '_') {
+            s++;
+        }
+
+        c = *s;
+        if(
+            s == key ||
+            (c != '\0' && c != '=' && c != ',' && !isspace((unsigned char) c))
+        ) {
+            layout_err(p, "Invalid partition field");
+            return pres_fail;
+        }
+
+        if(c != '\0') {
+            *s++ = '\0';
+        }
+
+        if(c != '=') {
+            val = NULL;
+        } else if(*s == '"') {
+            val = ++s;
+
+            s = strchr(s, '"');
+            if(s == NULL) {
+                layout_err(p, "Unterminated quoted value");
+                return pres_fail;
+            }
+            *s++ = '\0';
+        } else {
+            val = s;
+
+            while(*s != '\0' && *s != ',' && !isspace((unsigned char) *s)) {
+                s++;
+            }
+            if(*s != '\0') {
+                *s++ = '\0';
+            }
+        }
+
+        if(!layout_parse_field(p, layout, part, key, val)) {
+            return pres_fail;
+        }
+    }
+}
+
+static pres layout_parse_line(struct layout_parser *p, struct layout *layout,
+                              char *line, pu32 *cap)
+{
+    char *s;
+
+    line = layout_str_trim(line);
+
+    /* Empty line or comment */
+    if(*line == '\0' || *line == '#') {
+        return pres_ok;
+    }
+
+    /* Header line is 'key: value' */
+    s = line;
+    while(isalnum((unsigned char) *s) || *s == '-') {
+        s++;
+    }
+
+    if(s != line && *s == ':') {
+        *s = '\0';
+        return layout_parse_header(p, layout, line, s + 1);
+    }
+
+    return layout_parse_part(p, layout, line, cap);
+}
+
+pres layout_load(struct layout *layout, const char *path)
+{
+    struct layout_parser p;
+    char line[layout_line_sz];
+    FILE *f;
+    pu32 cap;
+    pres res;
+
+    memset(layout, 0, sizeof(*layout));
+    memset(&p, 0, sizeof(p));
+    p.path = path;
+
+    f = fopen(path, "r");
+    if(f == NULL) {
+        perror("fopen()");
+        plog_err("Unable to open layout %s", path);
+        return pres_fail;
+    }
+
+    cap = 0;
+    res = pres_ok;
+
+    while(res && fgets(line, sizeof(line), f) != NULL) {
+        p.line++;
+
+        /* Line does not fit into the buffer */
+        if(strchr(line, '\n') == NULL && !feof(f)) {
+            layout_err(&p, "Line is too long");
+            res = pres_fail;
+            break;
+        }
+
+        res = layout_parse_line(&p, layout, line, &cap);
+    }
+
+    if(res && ferror(f)) {
+        perror("fgets()");
+        res = pres_fail;
+    }
+
+    if(res && !p.has_label) {
+        plog_err("%s: Scheme type is not specified", path);
+        res = pres_fail;
+    }
+
+    fclose(f);
+
+    if(!res) {
+        layout_free(layout);
+    }
+
+    return res;
+}
+
+void layout_free(struct layout *layout)
+{
+    free(layout->parts);
+    memset(layout, 0, sizeof(*layout));
+}
+
+pres layout_regen(const struct layout *layout, struct schem_regen *regen)
+{
+    pu32 i;
+
+    memset(regen, 0, sizeof(*regen));
+    regen->keep_id = layout->has_id;
+
+    if(layout->part_cnt == 0) {
+        return pres_ok;
+    }
+
+    regen->keep_part_ids = malloc(layout->part_cnt *
+                                  sizeof(*regen->keep_part_ids));
+    if(regen->keep_part_ids == NULL) {
+        return pres_fail;
+    }
+
+    /* Layout partitions are in the order of partition table entries */
+    for(i = 0; i < layout->part_cnt; i++) {
+        regen->keep_part_ids[i] = layout->parts[i].has_uuid;
+    }
+    regen->keep_part_cnt = layout->part_cnt;
+
+    return pres_ok;
+}
+
+void layout_regen_free(struct schem_regen *regen)
+{
+    free(regen->keep_part_ids);
+    memset(regen, 0, sizeof(*regen));
+}
+
+static plba layout_val_to_lba(const struct img_ctx *img_ctx,
+                              const struct layout_val *val, pflag round_up)
+{
+    return val->bytes ? byte_to_lba(img_ctx, val->val, round_up) : val->val;
+}
+
+static pres layout_apply_part(const struct layout_part *lpart, pu32 index,
+                              struct schem_txn *txn,
+                              const struct img_ctx *img_ctx)
+{
+    struct schem *schem;
+    struct schem_part *part;
+    struct schem_edit edit;
+    plba_res lba_res;
+    plba secs_cnt;
+
+    schem = txn->schem;
+
+    memset(&edit, 0, sizeof(edit));
+    edit.op = schem_op_create;
+    edit.index = index;
+
+    /* Find start sector, if not specified. Partition follows the previous
+     * one, like in sfdisk, otherwise the first free sector is used */
+    if(lpart->has_start) {
+        edit.start_lba = layout_val_to_lba(img_ctx, &lpart->start, 1);
+    } else if(index > 0) {
+        edit.start_lba = schem->table[index - 1].end_lba + 1;
+        if(lba_align(img_ctx, edit.start_lba, 1) <= schem->last_usable_lba) {
+            edit.start_lba = lba_align(img_ctx, edit.start_lba, 1);
+        }
+    } else {
+        lba_res = schem_find_start_sector(schem, img_ctx, index);
+        if(lba_res == -1) {
+            plog_err("Partition #%lu: unable to find free start sector",
+                     index + 1);
+            return pres_fail;
+        }
+        edit.start_lba = lba_res;
+    }
+
+    /* Start sector is needed to find the last one. Other boundaries and
+     * overlaps are validated on commit */
+    if(
+        edit.start_lba < schem->first_usable_lba ||
+        edit.start_lba > schem->last_usable_lba
+    ) {
+        plog_err("Partition #%lu: start sector %llu is out of usable range "
+                 "(%llu-%llu)", index + 1, edit.start_lba,
+                 schem->first_usable_lba, schem->last_usable_lba);
+        return pres_fail;
+    }
+
+    /* Find last sector, if size is not specified */
+    if(lpart->has_size) {
+        secs_cnt = layout_val_to_lba(img_ctx, &lpart->size, 0);
+        if(secs_cnt == 0) {
+            plog_err("Partition #%lu: size is less, than a sector", index + 1);
+            return pres_fail;
+        }
+        edit.end_lba = edit.start_lba + secs_cnt - 1;
+    } else {
+        lba_res = schem_find_last_sector(schem, img_ctx, index,
+                                         edit.start_lba);
+        if(lba_res == -1) {
+            plog_err("Partition #%lu: unable to find available last sector",
+                     index + 1);
+            return pres_fail;
+        }
+        edit.end_lba = lba_res;
+    }
+
+    if(lpart->has_type && schem->type == schem_type_gpt) {
+        memcpy(&edit.type.guid, &lpart->type.guid, sizeof(edit.type.guid));
+    } else if(lpart->has_type) {
+        edit.type.i = lpart->type.i;
+    }
+
+    if(!schem_txn_apply(txn, &edit)) {
+        return pres_fail;
+    }
+
+    /* Fields, which are not validated, are set directly */
+    part = &schem->table[index];
+
+    if(lpart->has_uuid) {
+        memcpy(&part->unique_guid, &lpart->uuid, sizeof(part->unique_guid));
+    }
+
+    if(lpart->has_name) {
+        memcpy(part->name, lpart->name, sizeof(part->name));
+    }
+
+    if(lpart->bootable) {
+        part->boot_ind = 0x80;
+    }
+
+    return pres_ok;
+}
+
+pres layout_apply(const struct layout *layout, struct schem_ctx *schem_ctx,
+                  const struct img_ctx *img_ctx)
+{
+    struct schem *schem;
+    struct schem_txn txn;
+    pu32 i;
+
+    if(!schem_ctx_new(schem_ctx, img_ctx, layout->type)) {
+        return pres_fail;
+    }
+
+    schem = schem_ctx->schemes[layout->type];
+
+    if(layout->part_cnt > schem->part_cnt) {
+        plog_err("Layout has %lu partitions, but partition table has only "
+                 "%lu entries", layout->part_cnt, schem->part_cnt);
+        return pres_fail;
+    }
+
+    if(layout->has_id) {
+        if(layout->type == schem_type_gpt) {
+            memcpy(&schem->id.guid, &layout->id.guid, sizeof(schem->id.guid));
+        } else {
+            schem->id.i = layout->id.i;
+        }
+    }
+
+    if(!schem_txn_begin(&txn, schem_ctx, layout->type)) {
+        return pres_fail;
+    }
+
+    /* Partitions are created in order, so partitions without start or size
+     * are placed into the space, which is left by the previous ones */
+    for(i = 0; i < layout->part_cnt; i++) {
+        if(!layout_apply_part(&layout->parts[i], i, &txn, img_ctx)) {
+            schem_txn_rollback(&txn);
+            return pres_fail;
+        }
+    }
+
+    /* Scheme is saved later by the caller */
+    return schem_txn_commit(&txn, img_ctx, 0);
+}
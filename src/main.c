@@ -7,15 +7,24 @@
 #include <string.h>
 #include <time.h>
 #include <fcntl.h>
+#include <sys/resource.h>
 
 #include "_version.h"
 #include "partman_types.h"
 #include "options.h"
 #include "log.h"
 #include "scan.h"
+#include "layout.h"
+#include "batch.h"
+#include "dump.h"
+#include "crc32.h"
 #include "img_ctx.h"
 #include "schem.h"
 #include "mbr.h"
+#include "schem_blob.h"
+#include "schem_hist.h"
+#include "stats.h"
+#include "trace.h"
 
 /* Splitted help message (due to possible string length limitations) on
  * some compilers */
@@ -39,6 +48,8 @@
 #define PARTMAN_HELP_2                        \
     "  Misc\n"                                \
     "  |-m  print this menu\n"                \
+    "  |-u  undo the last change\n"           \
+    "  |-U  redo the last undone change\n"    \
     "  |-r  return from any nested scheme\n"  \
     "\n"                                      \
     "  Save & Exit\n"                         \
@@ -54,6 +65,14 @@ enum action_res {
     action_continue, action_exit_ok, action_exit_fatal
 };
 
+enum {
+    /* Number of latest trace events, kept in memory */
+    pm_trace_event_cnt = 1024 * 64
+};
+
+/* Trace file, which is written on exit */
+static const char *pm_trace_path;
+
 static void pm_print_mbr(const struct schem *schem, const struct img_ctx *img_ctx)
 {
     const struct schem_part *part;
@@ -142,6 +161,43 @@ static void pm_print_gpt(const struct schem *schem, const struct img_ctx *img_ct
     }
 }
 
+static void pm_print_free(const struct schem *schem, const struct img_ctx *img_ctx)
+{
+    struct schem_free_ext *exts;
+    struct schem_free_stats stats;
+    pu32 ext_cnt;
+    pu32 i;
+
+    if(!schem_find_free_exts(schem, img_ctx, -1, &exts, &ext_cnt)) {
+        plog_err("Failed to find free space");
+        return;
+    }
+
+    schem_free_stats(exts, ext_cnt, &stats);
+
+    pprint("\n=== Free space ===\n");
+    pprint("Free sectors             %llu\n", stats.free_secs);
+    pprint("Free extents             %lu\n", stats.ext_cnt);
+    pprint("Largest extent           %llu sectors\n", stats.largest_secs);
+    pprint("Aligned free sectors     %llu\n", stats.align_free_secs);
+    pprint("Largest aligned extent   %llu sectors\n",
+           stats.align_largest_secs);
+
+    /* Share of free space, which is outside of the largest extent */
+    if(stats.free_secs > 0) {
+        pprint("Fragmentation            %.1f%%\n",
+               100.0 * (stats.free_secs - stats.largest_secs) /
+               stats.free_secs);
+    }
+
+    for(i = 0; i < ext_cnt; i++) {
+        pprint("|-%llu-%llu  %llu sectors\n", exts[i].start_lba,
+               exts[i].end_lba, exts[i].secs);
+    }
+
+    free(exts);
+}
+
 static void pm_print_common(const struct img_ctx *img_ctx)
 {
     pprint("Image '%s': %llu bytes, %llu sectors\n", img_ctx->img_name,
@@ -171,8 +227,10 @@ pm_print_scheme(const struct schem *schem, const struct img_ctx *img_ctx)
             break;
 
         case schem_cnt:
-            break;
+            return;
     }
+
+    pm_print_free(schem, img_ctx);
 }
 
 static p32 pm_part_prompt(const struct schem *schem, pflag find_used)
@@ -219,22 +277,36 @@ static p32 pm_part_prompt(const struct schem *schem, pflag find_used)
     return part_index;
 }
 
-static void pm_part_delete(struct schem *schem, const struct img_ctx *img_ctx)
+/* Saves partition for undo, before it is changed */
+static pflag pm_part_touch(struct schem_hist *hist, const struct schem *schem,
+                           pu32 part_index)
+{
+    if(!schem_hist_touch(hist, schem->type, part_index)) {
+        pprint("Unable to save undo history\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static void pm_part_delete(struct schem *schem, const struct img_ctx *img_ctx,
+                           struct schem_hist *hist)
 {
     p32 part_index;
 
     /* Prompt partition selection */
     part_index = pm_part_prompt(schem, 1);
-    if(part_index == -1) {
+    if(part_index == -1 || !pm_part_touch(hist, schem, part_index)) {
         return;
     }
 
     /* Delete partition */
-    schem_part_delete(&schem->table[part_index]);
+    schem_part_delete(schem, part_index);
 }
 
 static void
-pm_part_toggle_boot(struct schem *schem, const struct img_ctx *img_ctx)
+pm_part_toggle_boot(struct schem *schem, const struct img_ctx *img_ctx,
+                    struct schem_hist *hist)
 {
     p32 part_index;
     struct schem_part *part;
@@ -246,7 +318,7 @@ pm_part_toggle_boot(struct schem *schem, const struct img_ctx *img_ctx)
 
     /* Prompt partition selection */
     part_index = pm_part_prompt(schem, 1);
-    if(part_index == -1) {
+    if(part_index == -1 || !pm_part_touch(hist, schem, part_index)) {
         return;
     }
 
@@ -255,7 +327,8 @@ pm_part_toggle_boot(struct schem *schem, const struct img_ctx *img_ctx)
     part->boot_ind = (~part->boot_ind) & 0x80;
 }
 
-static void pm_part_change_type_mbr(struct schem *schem, pu32 part_index)
+static void pm_part_change_type_mbr(struct schem *schem, pu32 part_index,
+                                    struct schem_hist *hist)
 {
     pu32 part_type;
     enum scan_res scan_res;
@@ -277,10 +350,16 @@ static void pm_part_change_type_mbr(struct schem *schem, pu32 part_index)
         return;
     }
 
+    if(!pm_part_touch(hist, schem, part_index)) {
+        return;
+    }
+
     schem->table[part_index].type.i = part_type;
+    schem_part_changed(schem, part_index);
 }
 
-static void pm_part_change_type_gpt(struct schem *schem, pu32 part_index)
+static void pm_part_change_type_gpt(struct schem *schem, pu32 part_index,
+                                    struct schem_hist *hist)
 {
     struct guid part_type;
     enum scan_res scan_res;
@@ -296,11 +375,17 @@ static void pm_part_change_type_gpt(struct schem *schem, pu32 part_index)
         return;
     }
 
+    if(!pm_part_touch(hist, schem, part_index)) {
+        return;
+    }
+
     memcpy(&schem->table[part_index].type.guid, &part_type, sizeof(part_type));
+    schem_part_changed(schem, part_index);
 }
 
 static void
-pm_part_change_type(struct schem *schem, const struct img_ctx *img_ctx)
+pm_part_change_type(struct schem *schem, const struct img_ctx *img_ctx,
+                    struct schem_hist *hist)
 {
     p32 part_index;
 
@@ -312,11 +397,11 @@ pm_part_change_type(struct schem *schem, const struct img_ctx *img_ctx)
 
     switch(schem->type) {
         case schem_type_mbr:
-            pm_part_change_type_mbr(schem, part_index);
+            pm_part_change_type_mbr(schem, part_index, hist);
             break;
 
         case schem_type_gpt:
-            pm_part_change_type_gpt(schem, part_index);
+            pm_part_change_type_gpt(schem, part_index, hist);
             break;
 
         case schem_cnt:
@@ -325,7 +410,8 @@ pm_part_change_type(struct schem *schem, const struct img_ctx *img_ctx)
 }
 
 static void
-pm_part_alter(struct schem *schem, const struct img_ctx *img_ctx, pflag is_new)
+pm_part_alter(struct schem *schem, const struct img_ctx *img_ctx, pflag is_new,
+              struct schem_hist *hist)
 {
     enum scan_res scan_res;
     p32 part_index_res;
@@ -376,6 +462,10 @@ pm_part_alter(struct schem *schem, const struct img_ctx *img_ctx, pflag is_new)
         return;
     }
 
+    if(!pm_part_touch(hist, schem, part_index)) {
+        return;
+    }
+
     /* Initialize partition, if creating new */
     if(is_new) {
         schem->funcs.part_init(&schem->table[part_index]);
@@ -383,11 +473,12 @@ pm_part_alter(struct schem *schem, const struct img_ctx *img_ctx, pflag is_new)
 
     schem->table[part_index].start_lba = start_lba;
     schem->table[part_index].end_lba = end_lba;
+    schem_part_changed(schem, part_index);
 }
 
 static enum action_res
 action_handle(struct schem_ctx *schem_ctx, enum schem_type *schem_cur_t,
-              const struct img_ctx *img_ctx, int sym)
+              const struct img_ctx *img_ctx, struct schem_hist *hist, int sym)
 {
     struct schem *schem_cur;
     pres res;
@@ -400,6 +491,10 @@ action_handle(struct schem_ctx *schem_ctx, enum schem_type *schem_cur_t,
 
     res = pres_ok;
 
+    /* Every command starts a new undo step, which is kept only if the
+     * command changes something */
+    schem_hist_snap(hist);
+
     switch(sym) {
         /* Exit */
         case 'q':
@@ -421,7 +516,7 @@ action_handle(struct schem_ctx *schem_ctx, enum schem_type *schem_cur_t,
             if(!schem_cur) {
                 goto no_schem;
             }
-            pm_part_alter(schem_cur, img_ctx, 1);
+            pm_part_alter(schem_cur, img_ctx, 1, hist);
             break;
 
         /* Resize a partition */
@@ -429,7 +524,7 @@ action_handle(struct schem_ctx *schem_ctx, enum schem_type *schem_cur_t,
             if(!schem_cur) {
                 goto no_schem;
             }
-            pm_part_alter(schem_cur, img_ctx, 0);
+            pm_part_alter(schem_cur, img_ctx, 0, hist);
             break;
 
         /* Change partition type */
@@ -437,7 +532,7 @@ action_handle(struct schem_ctx *schem_ctx, enum schem_type *schem_cur_t,
             if(!schem_cur) {
                 goto no_schem;
             }
-            pm_part_change_type(schem_cur, img_ctx);
+            pm_part_change_type(schem_cur, img_ctx, hist);
             break;
 
         /* Toggle partition bootable flag */
@@ -445,7 +540,7 @@ action_handle(struct schem_ctx *schem_ctx, enum schem_type *schem_cur_t,
             if(!schem_cur) {
                 goto no_schem;
             }
-            pm_part_toggle_boot(schem_cur, img_ctx);
+            pm_part_toggle_boot(schem_cur, img_ctx, hist);
             break;
 
         /* Delete a partition */
@@ -453,24 +548,46 @@ action_handle(struct schem_ctx *schem_ctx, enum schem_type *schem_cur_t,
             if(!schem_cur) {
                 goto no_schem;
             }
-            pm_part_delete(schem_cur, img_ctx);
+            pm_part_delete(schem_cur, img_ctx, hist);
             break;
 
         /* Write the partition table */
         case 'w':
+            if(img_ctx->read_only) {
+                pprint("Image is opened in read-only mode, changes can not "
+                       "be written\n");
+                break;
+            }
             res = schem_ctx_save(schem_ctx, img_ctx);
             break;
 
-        /* Create new MBR scheme */
+        /* Undo the last change */
+        case 'u':
+            if(!schem_hist_undo(hist)) {
+                pprint("Nothing to undo\n");
+            }
+            break;
+
+        /* Redo the last undone change */
+        case 'U':
+            if(!schem_hist_redo(hist)) {
+                pprint("Nothing to redo\n");
+            }
+            break;
+
+        /* Create new MBR scheme. Changes of replaced schemes can not be
+         * undone */
         case 'o':
             res = schem_ctx_new(schem_ctx, img_ctx, schem_type_mbr);
             *schem_cur_t = schem_ctx_get_type(schem_ctx);
+            schem_hist_clear(hist);
             break;
 
         /* Create new GPT scheme */
         case 'g':
             res = schem_ctx_new(schem_ctx, img_ctx, schem_type_gpt);
             *schem_cur_t = schem_ctx_get_type(schem_ctx);
+            schem_hist_clear(hist);
             break;
 
         /* Enter Protective MBR */
@@ -491,7 +608,10 @@ action_handle(struct schem_ctx *schem_ctx, enum schem_type *schem_cur_t,
                 pprint("Partitioning scheme is not GPT\n");
                 break;
             }
-            if(!schem_ctx->schemes[schem_type_mbr]) {
+            if(
+                !schem_ctx->schemes[schem_type_mbr] ||
+                !schem_hist_touch_all(hist, schem_type_mbr)
+            ) {
                 pprint("Unable to reset Protective MBR\n");
                 break;
             }
@@ -524,10 +644,13 @@ routine_start(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
     char c;
     enum scan_res scan_res;
     enum action_res action_res;
+    struct schem_hist hist;
 
     /* Determine initial working scheme */
     schem_cur_t = schem_ctx_get_type(schem_ctx);
 
+    schem_hist_init(&hist, schem_ctx);
+
     /* UI loop */
     for(;;) {
         pprint("Command (m for help): ");
@@ -536,7 +659,8 @@ routine_start(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
         /* End of file */
         if(scan_res == scan_eof) {
             pprint("\n");
-            return pres_ok;
+            action_res = action_exit_ok;
+            break;
         }
 
         /* Error - unknown command */
@@ -544,18 +668,23 @@ routine_start(struct schem_ctx *schem_ctx, const struct img_ctx *img_ctx)
             c = '\0';
         }
 
-        action_res = action_handle(schem_ctx, &schem_cur_t, img_ctx, c);
+        action_res = action_handle(schem_ctx, &schem_cur_t, img_ctx, &hist, c);
         if(action_res == action_continue) {
             pprint("\n");
             continue;
         }
 
-        return action_res == action_exit_ok ? pres_ok : pres_fail;
+        break;
     }
+
+    schem_hist_free(&hist);
+
+    return action_res == action_exit_ok ? pres_ok : pres_fail;
 }
 
 static pres
-img_init(struct img_ctx *img_ctx, const struct partman_opts *opts, int img_fd)
+img_init(struct img_ctx *img_ctx, const struct partman_opts *opts,
+         const char *img_name, int img_fd)
 {
     long long sz;
     char c;
@@ -575,6 +704,13 @@ img_init(struct img_ctx *img_ctx, const struct partman_opts *opts, int img_fd)
 
     /* If image size is less, than required */
 
+    if(opts->read_only) {
+        plog_err("Image size (%lld) is less, than required by the parameter "
+                 "(%lld) and can not be extended in read-only mode", sz,
+                 opts->img_sz);
+        return pres_fail;
+    }
+
     plog_info("Image size (%lld) is less, than required by the "
               "parameter (%lld). Image size will be extended now to match the "
               "required size", sz, opts->img_sz);
@@ -593,13 +729,19 @@ img_init(struct img_ctx *img_ctx, const struct partman_opts *opts, int img_fd)
         return pres_fail;
     }
 
+    stats_call(stats_call_write, 1);
+
     /* Now image size is equal to opts->img_sz */
     sz = opts->img_sz;
 
     plog_dbg("Image size is extended to the required value");
 
 init:
-    img_ctx_init(img_ctx, opts->img_name, img_fd, sz);
+    if(!img_ctx_init(img_ctx, img_name, img_fd, sz)) {
+        return pres_fail;
+    }
+
+    img_ctx->read_only = opts->read_only;
 
     if(opts->sec_sz) {
         img_ctx->sec_sz = opts->sec_sz;
@@ -617,13 +759,376 @@ init:
         img_ctx->spt = opts->spt;
     }
 
-    return img_ctx_validate(img_ctx);
+    if(opts->threads) {
+        img_ctx->threads = opts->threads;
+    }
+
+    if(opts->gpt_part_cnt) {
+        img_ctx->gpt_part_cnt = opts->gpt_part_cnt;
+    }
+
+    if(!img_ctx_validate(img_ctx)) {
+        img_ctx_free(img_ctx);
+        return pres_fail;
+    }
+
+    if(opts->uring) {
+        img_ctx_uring_enable(img_ctx);
+    }
+
+    return pres_ok;
+}
+
+static const struct schem *pm_schem_main(const struct schem_ctx *schem_ctx)
+{
+    enum schem_type type;
+
+    type = schem_ctx_get_type(schem_ctx);
+
+    return type < schem_cnt ? schem_ctx->schemes[type] : NULL;
+}
+
+static pres routine_script(struct schem_ctx *schem_ctx,
+                           const struct img_ctx *img_ctx,
+                           const struct layout *layout, enum dump_fmt dump)
+{
+    pres res;
+
+    /* Build the whole scheme in memory, then save it at once */
+    res = layout_apply(layout, schem_ctx, img_ctx);
+    if(!res) {
+        plog_err("Failed to apply layout");
+        return pres_fail;
+    }
+
+    res = schem_ctx_save(schem_ctx, img_ctx);
+    if(!res) {
+        return pres_fail;
+    }
+
+    if(dump) {
+        return dump_scheme(pm_schem_main(schem_ctx), img_ctx, dump);
+    }
+
+    pm_print_scheme(pm_schem_main(schem_ctx), img_ctx);
+
+    return pres_ok;
+}
+
+/* Batch state, shared between all workers */
+struct pm_batch {
+    const struct partman_opts *opts;
+    const struct layout *layout;
+
+    /* Image names */
+    char **img_names;
+    pu32 img_cnt;
+
+    /* Stamp mode: scheme, rendered once, and identifiers, which are kept,
+     * when it gets new ones for each image */
+    struct schem_blob blob;
+    struct schem_regen regen;
+};
+
+static pres pm_batch_open(const struct pm_batch *batch, const char *img_name,
+                          struct img_ctx *img_ctx, int *img_fd)
+{
+    pu64 t;
+    pres res;
+
+    t = stats_begin(stats_img_open);
+
+    *img_fd = open(img_name, O_RDWR|O_CREAT, 0666);
+    if(*img_fd == -1) {
+        perror("open()");
+        plog_err("Unable to open %s", img_name);
+        stats_end(stats_img_open, t);
+        return pres_fail;
+    }
+
+    res = img_init(img_ctx, batch->opts, img_name, *img_fd);
+
+    stats_end(stats_img_open, t);
+
+    if(!res) {
+        plog_err("Failed to prepare image %s", img_name);
+        close(*img_fd);
+        return pres_fail;
+    }
+
+    return pres_ok;
+}
+
+static void pm_batch_close(struct img_ctx *img_ctx, int img_fd)
+{
+    img_ctx_free(img_ctx);
+    close(img_fd);
+}
+
+static pres pm_batch_image(void *arg, pu32 index)
+{
+    const struct pm_batch *batch;
+    const char *img_name;
+    int img_fd;
+    struct img_ctx img_ctx;
+    struct schem_ctx schem_ctx;
+    pres res;
+
+    batch = arg;
+    img_name = batch->img_names[index];
+
+    if(!pm_batch_open(batch, img_name, &img_ctx, &img_fd)) {
+        return pres_fail;
+    }
+
+    /* Rendered scheme is written as it is, only other schemes are loaded
+     * to be removed */
+    if(schem_blob_fits(&batch->blob, &img_ctx)) {
+        res = schem_blob_stamp(&batch->blob, &img_ctx, &batch->regen);
+        if(!res) {
+            plog_err("Failed to stamp image %s", img_name);
+        }
+
+        pm_batch_close(&img_ctx, img_fd);
+        return res;
+    }
+
+    schem_ctx_init(&schem_ctx);
+
+    /* Existing schemes are loaded, so they are removed on save */
+    res = schem_ctx_load(&schem_ctx, &img_ctx) &&
+          layout_apply(batch->layout, &schem_ctx, &img_ctx) &&
+          schem_ctx_save(&schem_ctx, &img_ctx);
+    if(!res) {
+        plog_err("Failed to partition image %s", img_name);
+    }
+
+    schem_ctx_reset(&schem_ctx, 0);
+    pm_batch_close(&img_ctx, img_fd);
+
+    return res;
+}
+
+/* Renders the layout for geometry of the first image. Images of the same
+ * geometry are stamped with it, others are partitioned as usual */
+static pres pm_batch_render(struct pm_batch *batch)
+{
+    int img_fd;
+    struct img_ctx img_ctx;
+    struct schem_ctx schem_ctx;
+    pres res;
+
+    if(!pm_batch_open(batch, batch->img_names[0], &img_ctx, &img_fd)) {
+        return pres_fail;
+    }
+
+    schem_ctx_init(&schem_ctx);
+
+    res = layout_apply(batch->layout, &schem_ctx, &img_ctx) &&
+          schem_blob_render(&batch->blob, &schem_ctx, &img_ctx) &&
+          layout_regen(batch->layout, &batch->regen);
+
+    schem_ctx_reset(&schem_ctx, 0);
+    pm_batch_close(&img_ctx, img_fd);
+
+    return res;
+}
+
+static pres pm_batch_add(struct pm_batch *batch, pu32 *cap, const char *name)
+{
+    char **names;
+
+    if(batch->img_cnt >= *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+
+        names = realloc(batch->img_names, *cap * sizeof(*names));
+        if(names == NULL) {
+            return pres_fail;
+        }
+
+        batch->img_names = names;
+    }
+
+    names = &batch->img_names[batch->img_cnt];
+
+    *names = malloc(strlen(name) + 1);
+    if(*names == NULL) {
+        return pres_fail;
+    }
+    strcpy(*names, name);
+
+    batch->img_cnt++;
+
+    return pres_ok;
+}
+
+/* Reads image names from a list file, one name per line */
+static pres pm_batch_add_list(struct pm_batch *batch, pu32 *cap,
+                              const char *path)
+{
+    char line[4096];
+    FILE *f;
+    pres res;
+
+    f = fopen(path, "r");
+    if(f == NULL) {
+        perror("fopen()");
+        plog_err("Unable to open image list %s", path);
+        return pres_fail;
+    }
+
+    res = pres_ok;
+    while(res && fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n\r")] = '\0';
+
+        /* Empty line */
+        if(line[0] == '\0') {
+            continue;
+        }
+
+        res = pm_batch_add(batch, cap, line);
+    }
+
+    fclose(f);
+
+    return res;
+}
+
+static void pm_batch_free(struct pm_batch *batch)
+{
+    pu32 i;
+
+    schem_blob_free(&batch->blob);
+    layout_regen_free(&batch->regen);
+
+    for(i = 0; i < batch->img_cnt; i++) {
+        free(batch->img_names[i]);
+    }
+    free(batch->img_names);
+}
+
+static pres routine_batch(const struct partman_opts *opts,
+                          const struct layout *layout)
+{
+    struct pm_batch batch;
+    pres *results;
+    pu32 cap;
+    pu32 ok_cnt;
+    pu32 jobs;
+    long cpu_cnt;
+    pu32 i;
+    pres res;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.opts = opts;
+    batch.layout = layout;
+
+    /* Arguments, which start with '@', are image list files */
+    cap = 0;
+    res = pres_ok;
+    for(i = 0; res && i < opts->img_cnt; i++) {
+        if(opts->img_names[i][0] == '@') {
+            res = pm_batch_add_list(&batch, &cap, opts->img_names[i] + 1);
+        } else {
+            res = pm_batch_add(&batch, &cap, opts->img_names[i]);
+        }
+    }
+
+    results = res ? calloc(batch.img_cnt ? batch.img_cnt : 1,
+                           sizeof(*results)) : NULL;
+    if(results == NULL) {
+        plog_err("Failed to prepare image list");
+        pm_batch_free(&batch);
+        return pres_fail;
+    }
+
+    /* Default is a job per CPU */
+    jobs = opts->jobs;
+    if(!jobs) {
+        cpu_cnt = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+        cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        jobs = cpu_cnt > 0 ? cpu_cnt : 1;
+    }
+
+    plog_dbg("Batch of %lu images, %lu jobs", batch.img_cnt, jobs);
+
+    /* Tables must be ready before workers start */
+    crc32_prepare();
+
+    if(opts->stamp && batch.img_cnt > 0 && !pm_batch_render(&batch)) {
+        plog_err("Failed to render layout");
+        free(results);
+        pm_batch_free(&batch);
+        return pres_fail;
+    }
+
+    batch_run(&pm_batch_image, &batch, results, batch.img_cnt, jobs);
+
+    /* Summary */
+    ok_cnt = 0;
+    for(i = 0; i < batch.img_cnt; i++) {
+        pprint("%-8s %s\n", results[i] ? "OK" : "FAILED", batch.img_names[i]);
+        if(results[i]) {
+            ok_cnt++;
+        }
+    }
+
+    pprint("\n%lu of %lu images partitioned\n", ok_cnt, batch.img_cnt);
+
+    free(results);
+    pm_batch_free(&batch);
+
+    return ok_cnt == i;
+}
+
+/* Prints collected statistics to stderr, so they do not mix with dumps */
+static void pm_print_stats(void)
+{
+    struct stats stats;
+    struct rusage usage;
+    int i;
+
+    stats_get(&stats);
+
+    fprintf(stderr, "\nStatistics:\n");
+    fprintf(stderr, "%-20s %10s %14s\n", "Phase", "Count", "Time, ms");
+    for(i = 0; i < stats_phase_cnt; i++) {
+        fprintf(stderr, "%-20s %10llu %14.3f\n", stats_phase_name(i),
+                stats.phases[i].cnt, (double) stats.phases[i].ns / 1000000);
+    }
+
+    fprintf(stderr, "\n%-20s %10s %14s\n", "Call", "Count", "Bytes");
+    for(i = 0; i < stats_call_cnt; i++) {
+        fprintf(stderr, "%-20s %10llu %14llu\n", stats_call_name(i),
+                stats.calls[i].cnt, stats.calls[i].bytes);
+    }
+
+    if(getrusage(RUSAGE_SELF, &usage) == -1) {
+        return;
+    }
+
+    fprintf(stderr, "\nPage faults: %ld minor, %ld major\n",
+            usage.ru_minflt, usage.ru_majflt);
+    fprintf(stderr, "Max RSS: %ld KiB\n", usage.ru_maxrss);
+}
+
+static void pm_save_trace(void)
+{
+    if(!trace_save(pm_trace_path)) {
+        plog_err("Failed to write trace to %s", pm_trace_path);
+    }
+
+    trace_stop();
 }
 
 int main(int argc, char *const *argv)
 {
     struct partman_opts opts;
+    struct layout layout;
     pres res;
+    pu64 t;
 
     int img_fd;
     struct img_ctx img_ctx;
@@ -638,24 +1143,68 @@ int main(int argc, char *const *argv)
     /* Set log level */
     plog_set_level(opts.log_level);
 
-    pprint("partman %s\n\n", PARTMAN_VERSION);
+    /* Statistics are printed on any exit */
+    if(opts.stats) {
+        stats_enable(1);
+        atexit(&pm_print_stats);
+    }
+
+    /* Trace is recorded in memory and written on any exit */
+    if(opts.trace) {
+        if(!trace_start(pm_trace_event_cnt)) {
+            return EXIT_FAILURE;
+        }
+
+        pm_trace_path = opts.trace;
+        atexit(&pm_save_trace);
+    }
+
+    /* Machine-readable output must not contain anything else */
+    if(!opts.dump) {
+        pprint("partman %s\n\n", PARTMAN_VERSION);
+    }
 
     /* Initialize random */
     srand(time(NULL));
 
-    /* Open file */
-    img_fd = open(opts.img_name, O_RDWR|O_CREAT, 0666);
+    /* Parse layout before the image is touched */
+    memset(&layout, 0, sizeof(layout));
+    if(opts.script && !layout_load(&layout, opts.script)) {
+        return EXIT_FAILURE;
+    }
+
+    /* Apply the layout to each image, every image is opened by a worker */
+    if(opts.batch) {
+        res = routine_batch(&opts, &layout);
+        layout_free(&layout);
+        return res ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    t = stats_begin(stats_img_open);
+
+    /* Open file. In read-only mode, file is never created or written */
+    if(opts.read_only) {
+        img_fd = open(opts.img_name, O_RDONLY);
+    } else {
+        img_fd = open(opts.img_name, O_RDWR|O_CREAT, 0666);
+    }
     if(img_fd == -1) {
         perror("open()");
         plog_err("Unable to open %s", opts.img_name);
+        stats_end(stats_img_open, t);
+        layout_free(&layout);
         return EXIT_FAILURE;
     }
 
     /* Initialize image context */
-    res = img_init(&img_ctx, &opts, img_fd);
+    res = img_init(&img_ctx, &opts, opts.img_name, img_fd);
+
+    stats_end(stats_img_open, t);
+
     if(!res) {
         plog_err("Failed to prepare image");
         close(img_fd);
+        layout_free(&layout);
         return EXIT_FAILURE;
     }
 
@@ -669,14 +1218,22 @@ int main(int argc, char *const *argv)
         goto exit;
     }
 
-    /* Start user routine */
-    res = routine_start(&schem_ctx, &img_ctx);
+    /* Start user routine or apply the layout */
+    if(opts.script) {
+        res = routine_script(&schem_ctx, &img_ctx, &layout, opts.dump);
+    } else if(opts.dump) {
+        res = dump_scheme(pm_schem_main(&schem_ctx), &img_ctx, opts.dump);
+    } else {
+        res = routine_start(&schem_ctx, &img_ctx);
+    }
 
 exit:
     /* Free scheme context resources */
     schem_ctx_reset(&schem_ctx, 0);
+    img_ctx_free(&img_ctx);
     close(img_fd);
+    layout_free(&layout);
 
-    return res;
+    return res ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -15,10 +15,21 @@ static const struct option opts_long[] = {
     { "alignment",    required_argument, NULL, 'a' },
     { "heads",        required_argument, NULL, 'H' },
     { "sectors",      required_argument, NULL, 'S' },
+    { "threads",      required_argument, NULL, 'j' },
+    { "gpt-entries",  required_argument, NULL, 'E' },
+    { "io-uring",     no_argument,       NULL, 'U' },
+    { "read-only",    no_argument,       NULL, 'r' },
+    { "script",       required_argument, NULL, 's' },
+    { "batch",        required_argument, NULL, 'B' },
+    { "jobs",         required_argument, NULL, 'J' },
+    { "stamp",        no_argument,       NULL, 'T' },
+    { "dump",         required_argument, NULL, 'D' },
+    { "stats",        no_argument,       NULL, 'P' },
+    { "trace",        required_argument, NULL, 't' },
     { 0,              0,                 0,    0   }
 };
 
-static const char opt_str[] = "L:b:m:a:H:S:";
+static const char opt_str[] = "L:b:m:a:H:S:j:E:Urs:B:J:TD:Pt:";
 
 static void opts_err(const char *exec_name, const char *reason)
 {
@@ -70,6 +81,11 @@ static pres opts_parse_pu8(const char *arg, pu8 *i_ptr)
     return pres_ok;
 }
 
+static pres opts_parse_pu32(const char *arg, pu32 *i_ptr)
+{
+    return sscanf(arg, "%lu", i_ptr) == 1;
+}
+
 static pres opts_parse_pu64(const char *arg, pu64 *i_ptr)
 {
     return sscanf(arg, "%llu", i_ptr) == 1;
@@ -143,18 +159,91 @@ pres opts_parse(struct partman_opts *opts, int argc, char * const *argv)
                     return pres_fail;
                 }
                 break;
+            case 'j':
+                if(!opts_parse_pu32(optarg, &opts->threads) ||
+                   opts->threads < 1) {
+                    opts_err(argv[0], "threads - invalid value");
+                    return pres_fail;
+                }
+                break;
+            case 'E':
+                /* Entry count is a 32-bit GPT header field */
+                if(!opts_parse_pu32(optarg, &opts->gpt_part_cnt) ||
+                   opts->gpt_part_cnt < 1 ||
+                   opts->gpt_part_cnt > 0xFFFFFFFFUL) {
+                    opts_err(argv[0], "gpt-entries - invalid value");
+                    return pres_fail;
+                }
+                break;
+            case 'U':
+                opts->uring = 1;
+                break;
+            case 'r':
+                opts->read_only = 1;
+                break;
+            case 's':
+                opts->script = optarg;
+                break;
+            case 'B':
+                opts->script = optarg;
+                opts->batch = 1;
+                break;
+            case 'J':
+                if(!opts_parse_pu32(optarg, &opts->jobs) || opts->jobs < 1) {
+                    opts_err(argv[0], "jobs - invalid value");
+                    return pres_fail;
+                }
+                break;
+            case 'T':
+                opts->stamp = 1;
+                break;
+            case 'D':
+                if(!dump_fmt_parse(optarg, &opts->dump)) {
+                    opts_err(argv[0], "dump - invalid value");
+                    return pres_fail;
+                }
+                break;
+            case 'P':
+                opts->stats = 1;
+                break;
+            case 't':
+                opts->trace = optarg;
+                break;
             default:
                 opts_err(argv[0], "Unknown option");
                 return pres_fail;
         }
     } while(c != -1);
 
-    if(optind + 1 != argc) {
+    if(opts->dump && opts->batch) {
+        opts_err(argv[0], "dump - can not be used in batch mode");
+        return pres_fail;
+    }
+
+    /* Dump of an existing scheme never writes to the image */
+    if(opts->dump && !opts->script) {
+        opts->read_only = 1;
+    }
+
+    if(opts->stamp && !opts->batch) {
+        opts_err(argv[0], "stamp - can only be used in batch mode");
+        return pres_fail;
+    }
+
+    /* Batch mode takes any number of images, at least one */
+    if(optind >= argc || (!opts->batch && optind + 1 != argc)) {
         opts_err(argv[0], "Missing image file name");
         return pres_fail;
     }
 
+    if(opts->script && opts->read_only) {
+        opts_err(argv[0], "script - can not be used in read-only mode");
+        return pres_fail;
+    }
+
     opts->img_name = argv[optind];
+    opts->img_names = argv + optind;
+    opts->img_cnt = argc - optind;
     return pres_ok;
 }
 